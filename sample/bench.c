@@ -0,0 +1,156 @@
+#include "../src/ugles2.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_random(unsigned char buf[], int size)
+{
+	int i;
+	for (i = 0; i < size; i++) {
+		int r = rand();
+		// mostly empty or solid, like real glyph coverage
+		buf[i] = ((r & 3) == 0)? 0 : ((r & 3) == 1)? 255 : (r >> 4) & 0xff;
+	}
+}
+
+static double bench_blend(GLubyte pixels[], int width, int height
+						, const unsigned char coverage[], int glyph_width, int glyph_height
+						, int flags, int iterations)
+{
+	double start = now_sec();
+	int i;
+	for (i = 0; i < iterations; i++) {
+		int x = (i * 7) % (width - glyph_width);
+		ugles2_blend_coverage(pixels, width, height, x, 4, 220, 220, 250
+							, coverage, glyph_width, glyph_width, glyph_height, flags);
+	}
+	return now_sec() - start;
+}
+
+static void bench_blend_sizes()
+{
+	static const int sizes[][2] = {
+		{  8, 12 }, { 12, 16 }, { 16, 22 }, { 24, 32 }, { 48, 64 },
+	};
+	static const struct { int flags; const char* name; } modes[] = {
+		{ UGLES2_BLEND_PREMULTIPLIED, "premultiplied" },
+	};
+
+	int width  = 512;
+	int height = 80;
+	GLubyte* pixels  = (GLubyte*)malloc(width*height*4);
+	GLubyte* scalar  = (GLubyte*)malloc(width*height*4);
+	unsigned char* coverage = (unsigned char*)malloc(64*64);
+
+	printf("blend kernel: %s (premultiplied only, straight alpha is scalar)\n", ugles2_blend_kernel());
+	printf("%-14s %-6s %12s %12s %8s %s\n", "mode", "glyph", "scalar[ns]", "simd[ns]", "speedup", "result");
+
+	int m, s;
+	for (m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+		for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+			int gw = sizes[s][0];
+			int gh = sizes[s][1];
+			int iterations = 2000000 / (gw * gh) * 20;
+			fill_random(coverage, gw*gh);
+
+			fill_random(pixels, width*height*4);
+			memcpy(scalar, pixels, width*height*4);
+			double t_scalar = bench_blend(scalar, width, height, coverage, gw, gh, modes[m].flags | UGLES2_BLEND_SCALAR, iterations);
+			double t_simd   = bench_blend(pixels, width, height, coverage, gw, gh, modes[m].flags, iterations);
+
+			int i, max_diff = 0;
+			for (i = 0; i < width*height*4; i++) {
+				int diff = abs(pixels[i] - scalar[i]);
+				if (max_diff < diff) {
+					max_diff = diff;
+				}
+			}
+
+			char glyph[16];
+			snprintf(glyph, sizeof(glyph), "%dx%d", gw, gh);
+			printf("%-14s %-6s %12.1f %12.1f %7.2fx %s (max diff %d)\n", modes[m].name, glyph
+					, t_scalar / iterations * 1e9, t_simd / iterations * 1e9, t_scalar / t_simd
+					, (max_diff == 0)? "identical" : "differs", max_diff);
+		}
+	}
+
+	free(coverage);
+	free(scalar);
+	free(pixels);
+}
+
+static double bench_convert(GLubyte dst[], const unsigned char src[], int width, int height, int layout, int flags, int iterations)
+{
+	double start = now_sec();
+	int i;
+	for (i = 0; i < iterations; i++) {
+		ugles2_convert_pixels(dst, src, 0, width, height, layout, flags);
+	}
+	return now_sec() - start;
+}
+
+static void bench_convert_layouts()
+{
+	static const struct { int layout; int flags; int bytes; const char* name; } modes[] = {
+		{ UGLES2_PIXELS_RGB,        0, 3, "rgb" },
+		{ UGLES2_PIXELS_BGR,        0, 3, "bgr" },
+		{ UGLES2_PIXELS_BGRA,       0, 4, "bgra" },
+		{ UGLES2_PIXELS_ARGB,       0, 4, "argb" },
+		{ UGLES2_PIXELS_ABGR,       0, 4, "abgr" },
+		{ UGLES2_PIXELS_GRAY,       0, 1, "gray" },
+		{ UGLES2_PIXELS_GRAY_ALPHA, 0, 2, "gray alpha" },
+		{ UGLES2_PIXELS_RGBA,       UGLES2_CONVERT_PREMULTIPLY, 4, "premultiply" },
+		{ UGLES2_PIXELS_RGB,        UGLES2_CONVERT_FLIP, 3, "rgb flipped" },
+	};
+
+	int width  = 1920;
+	int height = 1080;
+	int iterations = 20;
+	unsigned char* src = (unsigned char*)malloc(width*height*4);
+	GLubyte* pixels = (GLubyte*)malloc(width*height*4);
+	GLubyte* scalar = (GLubyte*)malloc(width*height*4);
+	fill_random(src, width*height*4);
+
+	printf("\nconvert kernel: %s (%dx%d, output MB/s)\n", ugles2_convert_kernel(), width, height);
+	printf("%-14s %12s %12s %8s %s\n", "layout", "scalar", "simd", "speedup", "result");
+
+	int m;
+	for (m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+		double t_scalar = bench_convert(scalar, src, width, height, modes[m].layout, modes[m].flags | UGLES2_CONVERT_SCALAR, iterations);
+		double t_simd   = bench_convert(pixels, src, width, height, modes[m].layout, modes[m].flags, iterations);
+		int same = (memcmp(pixels, scalar, width*height*4) == 0);
+
+		// every tail length, from unaligned sources
+		int w;
+		for (w = 1; (w <= 67) && same; w++) {
+			ugles2_convert_pixels(scalar, src + 1, w * modes[m].bytes + 5, w, 3, modes[m].layout, modes[m].flags | UGLES2_CONVERT_SCALAR);
+			ugles2_convert_pixels(pixels, src + 1, w * modes[m].bytes + 5, w, 3, modes[m].layout, modes[m].flags);
+			same = (memcmp(pixels, scalar, w*3*4) == 0);
+		}
+
+		double mb = (double)width * height * 4 * iterations / 1e6;
+		printf("%-14s %12.1f %12.1f %7.2fx %s\n", modes[m].name, mb / t_scalar, mb / t_simd, t_scalar / t_simd
+				, same? "identical" : "differs");
+	}
+
+	free(scalar);
+	free(pixels);
+	free(src);
+}
+
+int main(int argc, char *argv[])
+{
+	srand(1);
+	bench_blend_sizes();
+	bench_convert_layouts();
+	return 0;
+}
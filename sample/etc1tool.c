@@ -0,0 +1,79 @@
+#include "../src/ugles2.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// converts a bmp/png/jpeg image into an ETC1 .pkm or .ktx file
+static void usage(const char name[])
+{
+	fprintf(stderr, "usage: %s [-m] [-g] input output.{pkm,ktx}\n", name);
+	fprintf(stderr, "  -m  store a mipmap chain (ktx)\n");
+	fprintf(stderr, "  -g  build the mipmaps in linear light (ktx)\n");
+}
+
+static int has_ext(const char file[], const char ext[])
+{
+	size_t n = strlen(file);
+	size_t m = strlen(ext);
+	return (n > m) && (strcmp(file + n - m, ext) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int mipmap = UGLES2_MIPMAP_NONE;
+	int gamma = 0;
+	int i = 1;
+	for (; (i < argc) && (argv[i][0] == '-'); i++) {
+		if (strcmp(argv[i], "-m") == 0) {
+			mipmap = UGLES2_MIPMAP_BOX;
+		} else if (strcmp(argv[i], "-g") == 0) {
+			gamma = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - i != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	const char* input  = argv[i];
+	const char* output = argv[i + 1];
+	if ((mipmap != UGLES2_MIPMAP_NONE) && gamma) {
+		mipmap = UGLES2_MIPMAP_GAMMA;
+	}
+
+	void* image = ugles2_open_image(input);
+	if (image == NULL) {
+		fprintf(stderr, "%s: cannot open\n", input);
+		return 1;
+	}
+	int width, height;
+	ugles2_image_size(image, &width, &height);
+	GLubyte* pixels = ugles2_decode_image(image, NULL);
+	if (pixels == NULL) {
+		fprintf(stderr, "%s: cannot decode\n", input);
+		ugles2_close_image(image);
+		return 1;
+	}
+
+	int res;
+	if (has_ext(output, ".pkm")) {
+		res = ugles2_write_pkm(output, pixels, width, height);
+	} else if (has_ext(output, ".ktx")) {
+		res = ugles2_write_ktx(output, pixels, width, height, mipmap);
+	} else {
+		fprintf(stderr, "%s: not .pkm or .ktx\n", output);
+		res = -1;
+	}
+	ugles2_close_image(image);
+
+	if (res != 0) {
+		fprintf(stderr, "%s: cannot write\n", output);
+		return 1;
+	}
+	printf("%s: %dx%d, %lu bytes per level 0\n", output, width, height, (unsigned long)ugles2_etc1_size(width, height));
+
+	return 0;
+}
@@ -16,6 +16,8 @@
 struct app_data {
 	struct shader {
 		GLuint program;
+		void*  reflection;
+		void*  layout;
 		struct locations {
 			GLint  a_position;
 			GLint  a_texture;
@@ -23,6 +25,10 @@ struct app_data {
 			GLint  u_texture;
 			GLint  u_vp;
 		} locations;
+		struct names {
+			unsigned u_model;
+			unsigned u_texture;
+		} names;
 	} shader;
 
 	struct object {
@@ -56,18 +62,25 @@ void init_shader(struct ugles2_context* context, struct app_data* app_data)
 		"  gl_FragColor = texture2D(u_texture,vec2(v_texture.s,v_texture.t));\n"
 		"}\n";
 
-	GLuint program = ugles2_compile_program(vshader_src, fshader_src);
-	glUseProgram(program);
+	void* reflection = NULL;
+	GLuint program = ugles2_compile_reflected_program(vshader_src, fshader_src, &reflection);
+	ugles2_use_program(context, program);
 
 	app_data->shader.program = program;
-	app_data->shader.locations.a_position = glGetAttribLocation(program, "a_position");
-	app_data->shader.locations.a_texture  = glGetAttribLocation(program, "a_texture");
-	app_data->shader.locations.u_model    = glGetUniformLocation(program, "u_model");
-	app_data->shader.locations.u_texture  = glGetUniformLocation(program, "u_texture");
-	app_data->shader.locations.u_vp       = glGetUniformLocation(program, "u_vp_matrix");
-
-	glEnableVertexAttribArray(app_data->shader.locations.a_position);
-	glEnableVertexAttribArray(app_data->shader.locations.a_texture);
+	app_data->shader.reflection = reflection;
+	app_data->shader.names.u_model   = ugles2_name_hash("u_model");
+	app_data->shader.names.u_texture = ugles2_name_hash("u_texture");
+	app_data->shader.locations.a_position = ugles2_attrib_location(reflection, ugles2_name_hash("a_position"));
+	app_data->shader.locations.a_texture  = ugles2_attrib_location(reflection, ugles2_name_hash("a_texture"));
+	app_data->shader.locations.u_model    = ugles2_uniform_location(reflection, app_data->shader.names.u_model);
+	app_data->shader.locations.u_texture  = ugles2_uniform_location(reflection, app_data->shader.names.u_texture);
+	app_data->shader.locations.u_vp       = ugles2_uniform_location(reflection, ugles2_name_hash("u_vp_matrix"));
+
+	// vertices: half float position, normalized unsigned short texture coordinates
+	void* layout = ugles2_create_vertex_layout();
+	ugles2_vertex_layout_add(layout, app_data->shader.locations.a_position, 3, UGLES2_VERTEX_HALF);
+	ugles2_vertex_layout_add(layout, app_data->shader.locations.a_texture , 2, UGLES2_VERTEX_USHORT_NORM);
+	app_data->shader.layout = layout;
 }
 
 void init_projection(struct ugles2_context* context, struct app_data* app_data)
@@ -94,17 +107,18 @@ void init_triangle(struct ugles2_context* context, struct app_data* app_data, co
 	unsigned short indices[] = { 0, 1, 2 };
 
 	// buffer
-	GLuint vbuffer = ugles2_gen_buffer(GL_ARRAY_BUFFER, vertices, sizeof(vertices), GL_STATIC_DRAW);
+	GLuint vbuffer = ugles2_gen_vertex_buffer(app_data->shader.layout, vertices, sizeof(vertices) / sizeof(vertices[0]) / 5, GL_STATIC_DRAW);
 	GLuint ibuffer = ugles2_gen_buffer(GL_ELEMENT_ARRAY_BUFFER, indices, sizeof(indices), GL_STATIC_DRAW);
 
 	// load texture image
 	GLuint texture;
 	int texture_width, texture_height;
-	if (ugles2_load_size(&texture_width, &texture_height, texture_filename) == 0) {
-		GLubyte* pixels = (GLubyte*)malloc(texture_width*texture_height*4);
-		ugles2_load_pixels(pixels, texture_width, texture_height, texture_filename);
-		texture =  ugles2_create_texture(pixels, texture_width, texture_height);
-		free(pixels);
+	void* image = ugles2_open_image(texture_filename);
+	if (image != NULL) {
+		ugles2_image_size(image, &texture_width, &texture_height);
+		GLubyte* pixels = ugles2_decode_image(image, NULL);
+		texture = ugles2_create_texture(pixels, texture_width, texture_height);
+		ugles2_close_image(image);
 	} else {
 		texture_width  = 1;
 		texture_height = 4;
@@ -136,7 +150,7 @@ void init_text(struct ugles2_context* context, struct app_data* app_data, const
 	unsigned short indices[] = { 0, 1, 3, 2 };
 
 	// buffer
-	GLuint vbuffer = ugles2_gen_buffer(GL_ARRAY_BUFFER, vertices, sizeof(vertices), GL_STATIC_DRAW);
+	GLuint vbuffer = ugles2_gen_vertex_buffer(app_data->shader.layout, vertices, sizeof(vertices) / sizeof(vertices[0]) / 5, GL_STATIC_DRAW);
 	GLuint ibuffer = ugles2_gen_buffer(GL_ELEMENT_ARRAY_BUFFER, indices, sizeof(indices), GL_STATIC_DRAW);
 
 	// load texture image
@@ -179,49 +193,48 @@ void init(struct ugles2_context* context, struct app_data* app_data, const char
 
 	// gl setting
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	glEnable(GL_DEPTH_TEST);
+	ugles2_enable(context, GL_DEPTH_TEST);
 	glClearColor(0.3f, 0.3f, 0.5f, 1.0f);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glEnable(GL_BLEND);
+	ugles2_blend_func(context, GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	ugles2_enable(context, GL_BLEND);
 
 	init_shader(context, app_data);
 	init_projection(context, app_data);
 	init_triangle(context, app_data, texture_filename);
 	init_text(context, app_data, texture_filename);
+
+	// creating buffers and textures bound them behind the state cache
+	ugles2_invalidate_state(context);
 }
 
 void draw_triangle(struct ugles2_context* context, struct app_data* app_data, int frames)
 {
-	glBindBuffer(GL_ARRAY_BUFFER, app_data->triangle.vbuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app_data->triangle.ibuffer);
-	glVertexAttribPointer(app_data->shader.locations.a_position, 3, GL_FLOAT, GL_FALSE, 20, (void*)0);
-	glVertexAttribPointer(app_data->shader.locations.a_texture , 2, GL_FLOAT, GL_FALSE, 20, (void*)12);
+	ugles2_apply_vertex_layout(context, app_data->shader.layout, app_data->triangle.vbuffer);
+	ugles2_bind_buffer(context, GL_ELEMENT_ARRAY_BUFFER, app_data->triangle.ibuffer);
 
-	// texture
-	glActiveTexture(GL_TEXTURE0);
-	glUniform1i(app_data->shader.locations.u_texture, 0);
-	glBindTexture(GL_TEXTURE_2D, app_data->triangle.texture);
+	// texture (the shadowed uniform is only sent when it changes)
+	GLint unit = 0;
+	ugles2_set_uniform(app_data->shader.reflection, app_data->shader.names.u_texture, &unit, 1);
+	ugles2_bind_texture(context, 0, GL_TEXTURE_2D, app_data->triangle.texture);
 
 	// model matrix
 	float t[16];
 	ugles2_matrix_rotate_y(t, 1.0f * frames);
 	t[14] = -1.0f;
-	glUniformMatrix4fv(app_data->shader.locations.u_model, 1, GL_FALSE, t);
+	ugles2_set_uniform(app_data->shader.reflection, app_data->shader.names.u_model, t, 1);
 
 	glDrawElements(GL_TRIANGLE_STRIP, 3, GL_UNSIGNED_SHORT, 0);
 }
 
 void draw_text(struct ugles2_context* context, struct app_data* app_data, int frames)
 {
-	glBindBuffer(GL_ARRAY_BUFFER, app_data->text.vbuffer);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app_data->text.ibuffer);
-	glVertexAttribPointer(app_data->shader.locations.a_position, 3, GL_FLOAT, GL_FALSE, 20, (void*)0);
-	glVertexAttribPointer(app_data->shader.locations.a_texture , 2, GL_FLOAT, GL_FALSE, 20, (void*)12);
+	ugles2_apply_vertex_layout(context, app_data->shader.layout, app_data->text.vbuffer);
+	ugles2_bind_buffer(context, GL_ELEMENT_ARRAY_BUFFER, app_data->text.ibuffer);
 
-	// texture
-	glActiveTexture(GL_TEXTURE0);
-	glUniform1i(app_data->shader.locations.u_texture, 0);
-	glBindTexture(GL_TEXTURE_2D, app_data->text.texture);
+	// texture (the shadowed uniform is only sent when it changes)
+	GLint unit = 0;
+	ugles2_set_uniform(app_data->shader.reflection, app_data->shader.names.u_texture, &unit, 1);
+	ugles2_bind_texture(context, 0, GL_TEXTURE_2D, app_data->text.texture);
 
 	// model matrix
 	float t[16];
@@ -233,14 +246,14 @@ void draw_text(struct ugles2_context* context, struct app_data* app_data, int fr
 	t[12] = (1.0 / (float)context->width * x - 0.5) + (1.0 / context->width) * 512 / 2;
 	t[13] = ((1.0 / (float)context->height * (-y) + 0.5f) - (1.0f / context->height) * 64 / 2) * context->height/context->width;
 	t[14] = 0.0001f;
-	glUniformMatrix4fv(app_data->shader.locations.u_model, 1, GL_FALSE, t);
+	ugles2_set_uniform(app_data->shader.reflection, app_data->shader.names.u_model, t, 1);
 
 	glDrawElements(GL_TRIANGLE_STRIP, 4, GL_UNSIGNED_SHORT, 0);
 }
 
 void draw(struct ugles2_context* context, struct app_data* app_data, int frames)
 {
-	glViewport(0, 0, context->width, context->height);
+	ugles2_viewport(context, 0, 0, context->width, context->height);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	draw_triangle(context, app_data, frames);
@@ -259,7 +272,9 @@ void finalize(struct ugles2_context* context, struct app_data* app_data)
 	glDeleteBuffers(1, &app_data->triangle.ibuffer);
 	glDeleteBuffers(1, &app_data->triangle.vbuffer);
 
-	glDeleteProgram(app_data->shader.program);
+	ugles2_destroy_vertex_layout(app_data->shader.layout);
+	ugles2_destroy_reflection(app_data->shader.reflection);
+	ugles2_delete_program(app_data->shader.program);
 }
 
 static ugles2_open_platform get_open_platform_func()
@@ -309,6 +324,10 @@ int main(int argc, char *argv[])
 	struct timeval et;
 	gettimeofday(&et, NULL);
 
+	unsigned long issued = 0;
+	unsigned long filtered = 0;
+	ugles2_state_stats(&context, &issued, &filtered);
+
 	finalize(&context, &app_data);
 
 	ugles2_finalize(&context);
@@ -316,6 +335,7 @@ int main(int argc, char *argv[])
 	int elapsed = (et.tv_sec - st.tv_sec) * 1000 + (et.tv_usec - st.tv_usec) / 1000;
 	printf("elapsed: %d.%03d [sec]\n", elapsed / 1000, elapsed % 1000);
 	printf("fps: %f \n", frames  /(float)elapsed * 1000.0f);
+	printf("state calls: %lu issued, %lu filtered\n", issued, filtered);
 
 	return 0;
 }
@@ -0,0 +1,115 @@
+#include "../src/ugles2.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// packs files into an asset pack, or lists one
+static void usage(const char name[])
+{
+	fprintf(stderr, "usage: %s output.pack [-f format] [-d] [name=]file ...\n", name);
+	fprintf(stderr, "       %s -l input.pack name ...\n", name);
+	fprintf(stderr, "  -f  how the following images are stored:\n");
+	fprintf(stderr, "      file (as is), rgba, rgb565, rgba4444, la, l, a, auto\n");
+	fprintf(stderr, "  -d  dither the following images when converting\n");
+	fprintf(stderr, "  -l  look names up in a pack\n");
+}
+
+static const char* formats[] = { "rgba", "rgb565", "rgba4444", "la", "l", "a", "auto" };
+
+static int lookup(const char pack_file[], char* names[], int count)
+{
+	void* pack = ugles2_open_pack(pack_file);
+	if (pack == NULL) {
+		fprintf(stderr, "%s: not a pack\n", pack_file);
+		return 1;
+	}
+	printf("%s: %d entries\n", pack_file, ugles2_pack_entries(pack));
+
+	int res = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		struct ugles2_asset asset;
+		if (ugles2_pack_find(pack, names[i], &asset) < 0) {
+			printf("%s: not found\n", names[i]);
+			res = 1;
+		} else if (asset.type == UGLES2_ASSET_PIXELS) {
+			int known = (asset.format >= 0) && (asset.format < (int)(sizeof(formats) / sizeof(formats[0])));
+			printf("%s: %u bytes, %dx%d %s\n", names[i], asset.size, asset.width, asset.height
+				, known? formats[asset.format] : "unknown");
+		} else {
+			printf("%s: %u bytes\n", names[i], asset.size);
+		}
+	}
+	ugles2_close_pack(pack);
+
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	if ((argc >= 3) && (strcmp(argv[1], "-l") == 0)) {
+		return lookup(argv[2], argv + 3, argc - 3);
+	}
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct ugles2_pack_entry* entries = (struct ugles2_pack_entry*)calloc(argc, sizeof(struct ugles2_pack_entry));
+	int count = 0;
+	int pixels = 0;
+	int format = UGLES2_FORMAT_RGBA;
+	int dither = 0;
+	int i;
+	for (i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-d") == 0) {
+			dither = 1;
+		} else if (strcmp(argv[i], "-f") == 0) {
+			if (++i == argc) {
+				usage(argv[0]);
+				return 1;
+			}
+			pixels = strcmp(argv[i], "file") != 0;
+			if (pixels) {
+				for (format = 0; format <= UGLES2_FORMAT_AUTO; format++) {
+					if (strcmp(argv[i], formats[format]) == 0) {
+						break;
+					}
+				}
+				if (format > UGLES2_FORMAT_AUTO) {
+					fprintf(stderr, "%s: unknown format\n", argv[i]);
+					return 1;
+				}
+			}
+		} else {
+			struct ugles2_pack_entry* entry = &entries[count++];
+			char* eq = strchr(argv[i], '=');
+			if (eq != NULL) {
+				*eq = '\0';
+				entry->name = argv[i];
+				entry->file = eq + 1;
+			} else {
+				entry->name = argv[i];
+				entry->file = argv[i];
+			}
+			entry->pixels = pixels;
+			entry->format = format;
+			entry->dither = dither;
+		}
+	}
+
+	int res = ugles2_write_pack(argv[1], entries, count);
+	if (res == -2) {
+		fprintf(stderr, "%s: duplicate names\n", argv[1]);
+	} else if (res == -3) {
+		fprintf(stderr, "%s: cannot read an entry\n", argv[1]);
+	} else if (res != 0) {
+		fprintf(stderr, "%s: cannot write\n", argv[1]);
+	} else {
+		printf("%s: %d entries\n", argv[1], count);
+	}
+	free(entries);
+
+	return (res == 0)? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include "../src/ugles2.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// records two identical frames with UGLES2_RECORD_DELTA and checks that the
+// second one is stored as an empty delta rather than a key frame
+
+static unsigned get_le32(const unsigned char p[])
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+int main(int argc, char *argv[])
+{
+	const char* file = (argc > 1)? argv[1] : "recordtest.u2sq";
+	int width  = 64;
+	int height = 48;
+
+	void* attr = ugles2_create_attr();
+	ugles2_attr_set_pbuffer_size(attr, width, height);
+	ugles2_attr_set_config_attr(attr, EGL_SURFACE_TYPE, EGL_PBUFFER_BIT);
+	struct ugles2_context context;
+	memset(&context, 0, sizeof(context));
+	int res = ugles2_initialize(&context, attr, NULL, NULL);
+	ugles2_destroy_attr(attr);
+	if (res != 0) {
+		fprintf(stderr, "ugles2_initialize() failed -> %d\n", res);
+		return 1;
+	}
+
+	void* recorder = ugles2_begin_recording(&context, file, UGLES2_RECORD_DELTA);
+	if (recorder == NULL) {
+		fprintf(stderr, "%s: cannot record\n", file);
+		ugles2_finalize(&context);
+		return 1;
+	}
+	int i;
+	for (i = 0; i < 2; i++) {
+		glClearColor(0.2f, 0.4f, 0.6f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		ugles2_record_frame(&context, recorder);
+	}
+	int frames = ugles2_end_recording(&context, recorder);
+	ugles2_finalize(&context);
+
+	// the second frame record follows the header and the first (key) frame
+	FILE* fp = fopen(file, "rb");
+	unsigned char record[8];
+	long offset = 32 + 8 + (long)width * height * 4;
+	if ((fp == NULL) || (fseek(fp, offset, SEEK_SET) != 0) || (fread(record, sizeof(record), 1, fp) != 1)) {
+		fprintf(stderr, "%s: cannot read the second frame\n", file);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		return 1;
+	}
+	fclose(fp);
+
+	unsigned type = get_le32(record);
+	unsigned size = get_le32(record + 4);
+	int ok = (frames == 2) && (type == UGLES2_RECORD_DELTA) && (size == 0);
+	printf("%s: %d frames, second frame type %u, %u payload bytes: %s\n", file, frames, type, size, ok? "ok" : "FAILED");
+
+	return ok? 0 : 1;
+}
@@ -4,6 +4,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <GLES2/gl2ext.h>
 
 #if defined(USE_PNG)
 #include <png.h>
@@ -18,10 +26,90 @@
 #include FT_FREETYPE_H
 #include FT_GLYPH_H
 
+#define GLYPH_CACHE_BUCKETS 256
+#define GLYPH_ATLAS_SIZE    512
+#define GLYPH_ATLAS_QUADS   256
+#define KERNING_BUCKETS     64
+
+struct glyph
+{
+	struct glyph* next;
+	FT_Face face;
+	int size;
+	FT_UInt index;
+	int left;
+	int top;
+	FT_Pos advance;		// 26.6
+	int ascent;
+	int descent;
+	int has_bitmap;
+	int width;
+	int rows;
+	unsigned char* bitmap;	// width x rows coverage, no padding
+	int atlas_x;
+	int atlas_y;
+	int atlas_generation;
+};
+
+struct glyph_atlas
+{
+	GLuint texture;
+	int width;
+	int height;
+	int shelf_x;
+	int shelf_y;
+	int shelf_h;
+	int generation;
+
+	GLuint program;
+	GLint  a_position;
+	GLint  a_texture;
+	GLint  u_screen;
+	GLint  u_offset;
+	GLint  u_color;
+	GLint  u_texture;
+
+	int quads;
+	float vertices[GLYPH_ATLAS_QUADS * 16];
+	unsigned short indices[GLYPH_ATLAS_QUADS * 6];
+};
+
+struct kerning_pair
+{
+	FT_UInt left;	// 0 marks an empty bucket
+	FT_UInt right;
+	FT_Pos delta;	// 26.6
+};
+
+struct font_size
+{
+	struct font_size* next;
+	FT_Face face;
+	int size;
+	int ascender;
+	int descender;
+	int height;
+
+	int has_kerning;
+	struct kerning_pair* pairs;
+	int pair_buckets;
+	int pair_count;
+};
+
 struct freetype_context
 {
 	FT_Library library;
 	FT_Face face;
+
+	struct glyph** glyphs;
+	int glyph_buckets;
+	int glyph_count;
+	int pixel_size;
+	int cache_generation;
+	int blend_flags;
+	struct font_size* sizes;
+
+	struct glyph_atlas atlas;
 };
 #endif
 
@@ -32,6 +120,14 @@ struct ugles2_attr {
 
 static int init_context(struct ugles2_context* context, struct ugles2_platform* platform, struct ugles2_attr* attr);
 static void close_platform(struct ugles2_platform* platform);
+static void stop_loader(struct ugles2_context* context);
+static void stop_capture(struct ugles2_context* context);
+static void disable_program_cache(struct ugles2_context* context);
+static void disable_texture_cache(struct ugles2_context* context);
+#if defined(USE_FREETYPE)
+static void clear_glyph_cache(struct freetype_context* ft);
+static void release_text_resources(struct ugles2_context* context);
+#endif
 
 void* ugles2_create_attr()
 {
@@ -232,6 +328,16 @@ int ugles2_initialize(struct ugles2_context* context, void* attr, ugles2_open_pl
 
 void ugles2_finalize(struct ugles2_context* context)
 {
+	stop_capture(context);
+	stop_loader(context);
+#if defined(USE_FREETYPE)
+	release_text_resources(context);
+#endif
+	disable_program_cache(context);
+	disable_texture_cache(context);
+	free(context->state);
+	context->state = NULL;
+
 	if (context->context != EGL_NO_CONTEXT) {
 		eglDestroyContext(context->display, context->context);
 		context->context = EGL_NO_CONTEXT;
@@ -256,6 +362,8 @@ void ugles2_finalize(struct ugles2_context* context)
 #if defined(USE_FREETYPE)
 	if (context->freetype != NULL) {
 		struct freetype_context* ft = (struct freetype_context*)context->freetype;
+		clear_glyph_cache(ft);
+		free(ft->glyphs);
 		FT_Done_FreeType(ft->library);
 		free(ft);
 		context->freetype = NULL;
@@ -405,24 +513,6 @@ int ugles2_link_shaders(GLuint program, GLuint vshader, GLuint fshader)
 	return 0;
 }
 
-GLuint ugles2_compile_program(const char vshader_src[], const char fshader_src[])
-{
-	GLuint program = glCreateProgram();
-
-	GLuint vshader = ugles2_compile_vertex_shader(vshader_src);
-	GLuint fshader = ugles2_compile_fragment_shader(fshader_src);
-
-	if (ugles2_link_shaders(program, vshader, fshader) != 0) {
-		glDeleteProgram(program);
-		return 0;
-	}
-
-	glDeleteShader(fshader);
-	glDeleteShader(vshader);
-
-	return program;
-}
-
 GLuint ugles2_gen_buffer(GLenum target, void* p, unsigned size, GLenum usage)
 {
 	GLuint buffer;
@@ -433,406 +523,7122 @@ GLuint ugles2_gen_buffer(GLenum target, void* p, unsigned size, GLenum usage)
 	return buffer;
 }
 
+static int has_gl_extension(const char name[])
+{
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	size_t n = strlen(name);
+	const char* p = extensions;
+	while ((p != NULL) && ((p = strstr(p, name)) != NULL)) {
+		if (((p == extensions) || (p[-1] == ' ')) && ((p[n] == ' ') || (p[n] == '\0'))) {
+			return 1;
+		}
+		p += n;
+	}
+	return 0;
+}
+
+static void put_u32(unsigned char* p, uint32_t v)
+{
+	p[0] = (unsigned char)(v);
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static void put_u64(unsigned char* p, uint64_t v)
+{
+	put_u32(p, (uint32_t)v);
+	put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
 // =============================================================================
-// texture
+// state cache
+//
+// wrappers remember what they last set on the context and drop calls that
+// would not change anything. state starts unknown, so the first call of each
+// kind always reaches GL; GL calls made around the wrappers need
+// ugles2_invalidate_state().
+
+#define STATE_TEXTURE_UNITS 16
+#define STATE_VERTEX_ATTRIBS 16
+#define STATE_UNKNOWN 0xffffffffU
+
+static const GLenum state_caps[] = {
+	GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_DITHER, GL_POLYGON_OFFSET_FILL,
+	GL_SAMPLE_ALPHA_TO_COVERAGE, GL_SAMPLE_COVERAGE, GL_SCISSOR_TEST, GL_STENCIL_TEST,
+};
+#define STATE_CAPS (sizeof(state_caps) / sizeof(state_caps[0]))
+
+struct vertex_attrib_state {
+	GLuint enabled;		// STATE_UNKNOWN, 0 or 1
+	int pointer_valid;
+	GLuint buffer;		// GL_ARRAY_BUFFER when the pointer was set
+	GLint size;
+	GLenum type;
+	GLboolean normalized;
+	GLsizei stride;
+	const void* pointer;
+};
 
-typedef int (*load_func)(const char file[], int* width, int* height, GLubyte* pixels);
+struct gl_state {
+	GLuint program;
+	GLuint array_buffer;
+	GLuint element_buffer;
+	GLuint active_unit;
+	GLuint textures[STATE_TEXTURE_UNITS][2];	// GL_TEXTURE_2D, GL_TEXTURE_CUBE_MAP
+	GLuint caps[STATE_CAPS];
+	GLenum blend_src;
+	GLenum blend_dst;
+	int viewport_valid;
+	GLint viewport[4];
+	struct vertex_attrib_state attribs[STATE_VERTEX_ATTRIBS];
+
+	unsigned long issued;
+	unsigned long filtered;
+};
 
-static void copy_line_bgr(GLubyte* dst, uint8_t* src, uint8_t alpha, int w)
+static struct gl_state* get_state(struct ugles2_context* context)
 {
-	int i;
-	for (i = 0; i < w; i++) {
-		dst[i*4  ] = src[i*3+2];	// R
-		dst[i*4+1] = src[i*3+1];	// G
-		dst[i*4+2] = src[i*3  ];	// B
-		dst[i*4+3] = alpha;			// A
+	if (context->state == NULL) {
+		struct gl_state* state = (struct gl_state*)malloc(sizeof(struct gl_state));
+		if (state == NULL) {
+			return NULL;
+		}
+		memset(state, 0, sizeof(*state));
+		context->state = state;
+		ugles2_invalidate_state(context);
 	}
+	return (struct gl_state*)context->state;
 }
 
-static void copy_line_rgb(GLubyte* dst, uint8_t* src, uint8_t alpha, int w)
+// counts the call and tells whether it has to reach GL
+static int state_changed(struct gl_state* state, int changed)
 {
-	int i;
-	for (i = 0; i < w; i++) {
-		dst[i*4  ] = src[i*3  ];	// R
-		dst[i*4+1] = src[i*3+1];	// G
-		dst[i*4+2] = src[i*3+2];	// B
-		dst[i*4+3] = alpha;			// A
+	if (changed) {
+		state->issued++;
+	} else {
+		state->filtered++;
 	}
+	return changed;
 }
 
-#if defined(USE_PNG)
-static int load_png(const char file[], int* width, int* height, GLubyte* pixels)
+static void forget_texture_bindings(struct ugles2_context* context)
 {
-	FILE* fp = fopen(file, "rb");
-	if (fp == NULL) {
-		return -1;
+	struct gl_state* state = (struct gl_state*)context->state;
+	if (state != NULL) {
+		memset(state->textures, 0xff, sizeof(state->textures));
 	}
+}
 
-	char sig[8];
-	if ((fread(sig, 1, 8, fp) != 8) || png_sig_cmp(sig, 0, 8) != 0) {
-		fclose(fp);
-		return -1;
-	}
-	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	if ((png_ptr == NULL) || (info_ptr == NULL)) {
-		fclose(fp);
-		return -1;
+#if defined(USE_FREETYPE)
+static void forget_attrib_pointer(struct ugles2_context* context, GLint index)
+{
+	struct gl_state* state = (struct gl_state*)context->state;
+	if ((state != NULL) && (index >= 0) && (index < STATE_VERTEX_ATTRIBS)) {
+		state->attribs[index].pointer_valid = 0;
 	}
+}
+#endif
 
-	png_init_io(png_ptr, fp);
-	png_set_sig_bytes(png_ptr, 8);
-
-	png_read_info(png_ptr, info_ptr);
-
-	png_uint_32 w, h;
-	int bpp, color_type, interlace_method, compression_method, filter_method;
-	png_get_IHDR(png_ptr, info_ptr, &w, &h, &bpp, &color_type, &interlace_method, &compression_method, &filter_method);
-	//printf("w:%d h:%d bpp:%d color:%d interlace:%d compression:%d filter:%d\n"
-	//		, w, h, bpp, color_type, interlace_method, compression_method, filter_method);
+void ugles2_invalidate_state(struct ugles2_context* context)
+{
+	struct gl_state* state = (struct gl_state*)context->state;
+	if (state == NULL) {
+		return;
+	}
+	state->program        = STATE_UNKNOWN;
+	state->array_buffer   = STATE_UNKNOWN;
+	state->element_buffer = STATE_UNKNOWN;
+	state->active_unit    = STATE_UNKNOWN;
+	memset(state->textures, 0xff, sizeof(state->textures));
+	memset(state->caps, 0xff, sizeof(state->caps));
+	state->blend_src = STATE_UNKNOWN;
+	state->blend_dst = STATE_UNKNOWN;
+	state->viewport_valid = 0;
+	int i;
+	for (i = 0; i < STATE_VERTEX_ATTRIBS; i++) {
+		state->attribs[i].enabled = STATE_UNKNOWN;
+		state->attribs[i].pointer_valid = 0;
+	}
+}
 
-	if (width != NULL) {
-		*width = w;
+int ugles2_state_stats(struct ugles2_context* context, unsigned long* issued, unsigned long* filtered)
+{
+	struct gl_state* state = (struct gl_state*)context->state;
+	if (state == NULL) {
+		return -1;
 	}
-	if (height != NULL) {
-		*height = h;
+	if (issued != NULL) {
+		*issued = state->issued;
+	}
+	if (filtered != NULL) {
+		*filtered = state->filtered;
 	}
+	return 0;
+}
 
-	if (pixels != NULL) {
-		png_set_strip_16(png_ptr);
-		png_set_expand(png_ptr);
-		if (color_type != PNG_COLOR_TYPE_RGB_ALPHA) {
-			png_set_filler(png_ptr, 255, PNG_FILLER_AFTER);
+void ugles2_use_program(struct ugles2_context* context, GLuint program)
+{
+	struct gl_state* state = get_state(context);
+	if ((state == NULL) || state_changed(state, state->program != program)) {
+		glUseProgram(program);
+		if (state != NULL) {
+			state->program = program;
 		}
+	}
+}
 
-		png_bytepp image = (png_bytepp)png_malloc(png_ptr, sizeof(png_bytep)*h);
-		int j;
-		for (j = 0; j < h; j++) {
-			image[j] = (png_bytep)&pixels[(h - j - 1)*w*4];
+void ugles2_bind_buffer(struct ugles2_context* context, GLenum target, GLuint buffer)
+{
+	struct gl_state* state = get_state(context);
+	GLuint* bound = NULL;
+	if (state != NULL) {
+		if (target == GL_ARRAY_BUFFER) {
+			bound = &state->array_buffer;
+		} else if (target == GL_ELEMENT_ARRAY_BUFFER) {
+			bound = &state->element_buffer;
+		}
+	}
+	if ((bound == NULL) || state_changed(state, *bound != buffer)) {
+		glBindBuffer(target, buffer);
+		if (bound != NULL) {
+			*bound = buffer;
 		}
-		png_set_rows(png_ptr, info_ptr, image);
-		png_read_image(png_ptr, image);
-		png_free(png_ptr, image);
 	}
-
-	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-
-	fclose(fp);
-
-	return 0;
 }
-#endif
 
-#if defined(USE_JPEG)
-static int load_jpeg(const char file[], int* width, int* height, GLubyte* pixels)
+void ugles2_bind_texture(struct ugles2_context* context, int unit, GLenum target, GLuint texture)
 {
-	FILE* fp = fopen(file, "rb");
-	if (fp == NULL) {
-		return -1;
+	struct gl_state* state = get_state(context);
+	int t = (target == GL_TEXTURE_CUBE_MAP)? 1 : 0;
+	if ((state == NULL) || (unit < 0) || (unit >= STATE_TEXTURE_UNITS)) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(target, texture);
+		if (state != NULL) {
+			state->active_unit = STATE_UNKNOWN;
+		}
+		return;
 	}
-	struct jpeg_decompress_struct dec;
-	memset(&dec, 0, sizeof(dec));
-	jpeg_create_decompress(&dec);
 
-	struct jpeg_error_mgr error_mgr;
-	memset(&error_mgr, 0, sizeof(error_mgr));
-	dec.err = jpeg_std_error(&error_mgr);
+	// the unit is left active, as glActiveTexture + glBindTexture would
+	if (state_changed(state, state->active_unit != (GLuint)unit)) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		state->active_unit = unit;
+	}
+	if (state_changed(state, state->textures[unit][t] != texture)) {
+		glBindTexture(target, texture);
+		state->textures[unit][t] = texture;
+	}
+}
 
-	jpeg_stdio_src(&dec, fp);
+static void set_cap(struct ugles2_context* context, GLenum cap, GLuint enable)
+{
+	struct gl_state* state = get_state(context);
+	unsigned i = 0;
+	if (state != NULL) {
+		for (i = 0; i < STATE_CAPS; i++) {
+			if (state_caps[i] == cap) {
+				break;
+			}
+		}
+	}
+	if ((state == NULL) || (i == STATE_CAPS) || state_changed(state, state->caps[i] != enable)) {
+		if (enable) {
+			glEnable(cap);
+		} else {
+			glDisable(cap);
+		}
+		if ((state != NULL) && (i < STATE_CAPS)) {
+			state->caps[i] = enable;
+		}
+	}
+}
 
-	jpeg_read_header(&dec, TRUE);
+void ugles2_enable(struct ugles2_context* context, GLenum cap)
+{
+	set_cap(context, cap, 1);
+}
 
-	jpeg_start_decompress(&dec);
+void ugles2_disable(struct ugles2_context* context, GLenum cap)
+{
+	set_cap(context, cap, 0);
+}
 
-	if (width != NULL) {
-		*width = dec.output_width;
-	}
-	if (height != NULL) {
-		*height = dec.output_height;
+void ugles2_blend_func(struct ugles2_context* context, GLenum src, GLenum dst)
+{
+	struct gl_state* state = get_state(context);
+	if ((state == NULL) || state_changed(state, (state->blend_src != src) || (state->blend_dst != dst))) {
+		glBlendFunc(src, dst);
+		if (state != NULL) {
+			state->blend_src = src;
+			state->blend_dst = dst;
+		}
 	}
-	int pitch = dec.output_width * dec.output_components;
+}
 
-	if (pixels != NULL) {
-		JSAMPARRAY buffer = (*dec.mem->alloc_sarray)((j_common_ptr)&dec, JPOOL_IMAGE, pitch, 1);
-		int j;
-		int w = dec.output_width;
-		int h = dec.output_height;
-		for (j = 0; j < h; j++) {
-			jpeg_read_scanlines(&dec, buffer, 1);
-			copy_line_rgb(&pixels[((h - j - 1)*w)*4], buffer[0], 255, w);
+void ugles2_viewport(struct ugles2_context* context, GLint x, GLint y, GLsizei width, GLsizei height)
+{
+	struct gl_state* state = get_state(context);
+	if ((state == NULL) || state_changed(state, !state->viewport_valid
+			|| (state->viewport[0] != x) || (state->viewport[1] != y)
+			|| (state->viewport[2] != width) || (state->viewport[3] != height))) {
+		glViewport(x, y, width, height);
+		if (state != NULL) {
+			state->viewport[0] = x;
+			state->viewport[1] = y;
+			state->viewport[2] = width;
+			state->viewport[3] = height;
+			state->viewport_valid = 1;
 		}
-		jpeg_finish_decompress(&dec);
 	}
+}
 
-	jpeg_destroy_decompress(&dec);
+static void set_vertex_attrib_array(struct ugles2_context* context, GLuint index, GLuint enable)
+{
+	struct gl_state* state = get_state(context);
+	if ((state == NULL) || (index >= STATE_VERTEX_ATTRIBS) || state_changed(state, state->attribs[index].enabled != enable)) {
+		if (enable) {
+			glEnableVertexAttribArray(index);
+		} else {
+			glDisableVertexAttribArray(index);
+		}
+		if ((state != NULL) && (index < STATE_VERTEX_ATTRIBS)) {
+			state->attribs[index].enabled = enable;
+		}
+	}
+}
 
-	fclose(fp);
+void ugles2_enable_vertex_attrib(struct ugles2_context* context, GLuint index)
+{
+	set_vertex_attrib_array(context, index, 1);
+}
 
-	return 0;
+void ugles2_disable_vertex_attrib(struct ugles2_context* context, GLuint index)
+{
+	set_vertex_attrib_array(context, index, 0);
 }
-#endif
 
-static int load_bmp(const char file[], int* width, int* height, GLubyte* pixels)
+// the pointer is relative to the GL_ARRAY_BUFFER bound at the time, so that is part of the state
+void ugles2_vertex_attrib_pointer(struct ugles2_context* context, GLuint index, GLint size, GLenum type
+					, GLboolean normalized, GLsizei stride, const void* pointer)
 {
-	int w, h, pitch, bpp;
-	FILE* fp = fopen(file, "rb");
-	if (fp == NULL) {
-		return -1;
+	struct gl_state* state = get_state(context);
+	struct vertex_attrib_state* a = ((state != NULL) && (index < STATE_VERTEX_ATTRIBS))? &state->attribs[index] : NULL;
+	int changed = (a == NULL) || (state->array_buffer == STATE_UNKNOWN) || !a->pointer_valid
+			|| (a->buffer != state->array_buffer) || (a->size != size) || (a->type != type)
+			|| (a->normalized != normalized) || (a->stride != stride) || (a->pointer != pointer);
+	if ((state == NULL) || state_changed(state, changed)) {
+		glVertexAttribPointer(index, size, type, normalized, stride, pointer);
+		if (a != NULL) {
+			a->pointer_valid = (state->array_buffer != STATE_UNKNOWN);
+			a->buffer     = state->array_buffer;
+			a->size       = size;
+			a->type       = type;
+			a->normalized = normalized;
+			a->stride     = stride;
+			a->pointer    = pointer;
+		}
 	}
-	
-	unsigned char header[54];
-	size_t size = fread(header, 54, 1, fp);
+}
 
-	bpp = header[0x1c+1] << 8 | header[0x1c];
-	if ((size != 1U) || bpp != 24) {
-		fclose(fp);
-		return -1;
-	}
-	w  = header[0x12+3] << 24 | header[0x12+2] << 16 | header[0x12+1] << 8 | header[0x12];
-	h  = header[0x16+3] << 24 | header[0x16+2] << 16 | header[0x16+1] << 8 | header[0x16];
-	pitch  = (int)(((w * 3) + 3) & ~3U);
+// =============================================================================
+// vertex layout
+//
+// a layout describes interleaved attributes. source vertices are given as
+// floats and packed into the compact types (half floats, normalized integers);
+// each attribute starts on a 4 byte boundary as GLES prefers, and the stride
+// follows from the attributes added.
+
+#define VERTEX_LAYOUT_ATTRIBS 16
+#define GL_HALF_FLOAT_ES3 0x140B	// GL_HALF_FLOAT of GLES 3, not in the GLES 2 headers
+
+struct vertex_attrib_format {
+	GLint  location;	// -1: packed but not applied
+	int    components;
+	int    type;		// UGLES2_VERTEX_*
+	GLenum gl_type;
+	GLboolean normalized;
+	int    offset;
+};
 
-	int offset = header[0x0a+3] << 24 | header[0x0a+2] << 16 | header[0x0a+1] << 8 | header[0x0a];
+struct vertex_layout {
+	struct vertex_attrib_format attribs[VERTEX_LAYOUT_ATTRIBS];
+	int count;
+	int stride;
+	int floats;		// per source vertex
+};
 
-	if (width != NULL) {
-		*width = w;
+// 0 when neither GL_OES_vertex_half_float nor GLES 3 is available
+static GLenum half_float_type()
+{
+	if (has_gl_extension("GL_OES_vertex_half_float")) {
+		return GL_HALF_FLOAT_OES;
 	}
-	if (height != NULL) {
-		*height = h;
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if ((version != NULL) && (strncmp(version, "OpenGL ES ", 10) == 0) && (version[10] >= '3')) {
+		return GL_HALF_FLOAT_ES3;
 	}
+	return 0;
+}
 
-	if (pixels != NULL) {
-		if (offset != 0) {
-			fseek(fp, offset, SEEK_SET);
+static unsigned short float_to_half(float value)
+{
+	union { float f; uint32_t u; } v;
+	v.f = value;
+	uint32_t sign = (v.u >> 16) & 0x8000;
+	int exponent = (int)((v.u >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = v.u & 0x7fffff;
+
+	if (((v.u >> 23) & 0xff) == 0xff) {
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);	// inf, nan
+	}
+	if (exponent >= 31) {
+		return sign | 0x7c00;
+	}
+	if (exponent <= 0) {
+		if (exponent < -10) {
+			return sign;
 		}
-		uint8_t* bitmap = (uint8_t*)malloc(pitch);
-		int x, y;
-		for (y = 0; y < h; y++) {
-			if (fread(bitmap, pitch, 1, fp) < 1) {
-				memset(bitmap, 0x80, pitch);
-			}
-			copy_line_bgr(&pixels[(y*w)*4], bitmap, 255, w);
+		// denormal, round to nearest even
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1U << shift) - 1);
+		uint32_t middle = 1U << (shift - 1);
+		if ((rest > middle) || ((rest == middle) && (half & 1))) {
+			half++;
 		}
-		free(bitmap);
+		return sign | half;
 	}
 
-	fclose(fp);
+	uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	if ((rest > 0x1000) || ((rest == 0x1000) && (half & 1))) {
+		half++;		// may carry into the exponent, which is still correct
+	}
+	return sign | half;
+}
 
-	return 0;
+static float clamp_unit(float value, float low)
+{
+	return (value < low)? low : (value > 1.0f)? 1.0f : value;
 }
 
-load_func get_load_func(const char ext[])
+void* ugles2_create_vertex_layout()
 {
-	if (ext == NULL) {
+	struct vertex_layout* layout = (struct vertex_layout*)malloc(sizeof(struct vertex_layout));
+	if (layout == NULL) {
 		return NULL;
 	}
+	memset(layout, 0, sizeof(*layout));
+	return layout;
+}
 
-	if (strcmp(ext, "bmp") == 0) {
-		return load_bmp;
-	} else if (strcmp(ext, "png") == 0) {
-#if defined(USE_PNG)
-		return load_png;
-#else
-		return NULL;
-#endif
-	} else if ((strcmp(ext, "jpg") == 0) || (strcmp(ext, "jpeg") == 0)) {
-#if defined(USE_JPEG)
-		return load_jpeg;
-#else
-		return NULL;
-#endif
-	} else {
-		return NULL;
-	}
+void ugles2_destroy_vertex_layout(void* layout)
+{
+	free(layout);
 }
 
-const char* filename_ext(const char filename[])
+// returns the attribute's offset in the vertex, or negative
+int ugles2_vertex_layout_add(void* layout, GLint location, int components, int type)
 {
-	int len = strlen(filename);
-	int i;
-	for (i = 0; i < len; i++) {
-		if (filename[len - i - 1] == '.') {
-			return &filename[len - i];
+	struct vertex_layout* l = (struct vertex_layout*)layout;
+	if ((l->count == VERTEX_LAYOUT_ATTRIBS) || (components < 1) || (components > 4)) {
+		return -1;
+	}
+
+	int size;
+	GLenum gl_type;
+	GLboolean normalized = GL_TRUE;
+	switch (type) {
+	case UGLES2_VERTEX_FLOAT:
+		gl_type = GL_FLOAT;
+		size = 4;
+		normalized = GL_FALSE;
+		break;
+	case UGLES2_VERTEX_HALF:
+		gl_type = half_float_type();
+		size = 2;
+		normalized = GL_FALSE;
+		if (gl_type == 0) {
+			type = UGLES2_VERTEX_FLOAT;
+			gl_type = GL_FLOAT;
+			size = 4;
 		}
+		break;
+	case UGLES2_VERTEX_SHORT_NORM:
+		gl_type = GL_SHORT;
+		size = 2;
+		break;
+	case UGLES2_VERTEX_USHORT_NORM:
+		gl_type = GL_UNSIGNED_SHORT;
+		size = 2;
+		break;
+	case UGLES2_VERTEX_BYTE_NORM:
+		gl_type = GL_BYTE;
+		size = 1;
+		break;
+	case UGLES2_VERTEX_UBYTE_NORM:
+		gl_type = GL_UNSIGNED_BYTE;
+		size = 1;
+		break;
+	default:
+		return -2;
 	}
-	return NULL;
+
+	struct vertex_attrib_format* a = &l->attribs[l->count++];
+	a->location   = location;
+	a->components = components;
+	a->type       = type;
+	a->gl_type    = gl_type;
+	a->normalized = normalized;
+	a->offset     = l->stride;
+	l->stride += (size * components + 3) & ~3;
+	l->floats += components;
+
+	return a->offset;
 }
 
-GLuint ugles2_load_texture(const char file[])
+int ugles2_vertex_layout_stride(void* layout)
 {
-	int width;
-	int height;
+	return ((struct vertex_layout*)layout)->stride;
+}
 
-	if (strlen(file) < 4) {
-		return 0;
+// packs count vertices of the layout's floats each into out (count * stride bytes)
+void ugles2_pack_vertices(void* layout, const float* vertices, int count, void* out)
+{
+	struct vertex_layout* l = (struct vertex_layout*)layout;
+	unsigned char* dst = (unsigned char*)out;
+	memset(dst, 0, (size_t)l->stride * count);
+
+	int i, j, k;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < l->count; j++) {
+			const struct vertex_attrib_format* a = &l->attribs[j];
+			unsigned char* p = dst + a->offset;
+			for (k = 0; k < a->components; k++) {
+				float v = *vertices++;
+				switch (a->type) {
+				case UGLES2_VERTEX_FLOAT:
+					memcpy(p + k*4, &v, 4);
+					break;
+				case UGLES2_VERTEX_HALF: {
+					unsigned short h = float_to_half(v);
+					memcpy(p + k*2, &h, 2);
+					break;
+				}
+				case UGLES2_VERTEX_SHORT_NORM: {
+					short s = (short)lrintf(clamp_unit(v, -1.0f) * 32767.0f);
+					memcpy(p + k*2, &s, 2);
+					break;
+				}
+				case UGLES2_VERTEX_USHORT_NORM: {
+					unsigned short s = (unsigned short)lrintf(clamp_unit(v, 0.0f) * 65535.0f);
+					memcpy(p + k*2, &s, 2);
+					break;
+				}
+				case UGLES2_VERTEX_BYTE_NORM:
+					((signed char*)p)[k] = (signed char)lrintf(clamp_unit(v, -1.0f) * 127.0f);
+					break;
+				case UGLES2_VERTEX_UBYTE_NORM:
+					p[k] = (unsigned char)lrintf(clamp_unit(v, 0.0f) * 255.0f);
+					break;
+				}
+			}
+		}
+		dst += l->stride;
 	}
+}
 
-	load_func load_image = get_load_func(filename_ext(file));
-	if (load_image == NULL) {
+GLuint ugles2_gen_vertex_buffer(void* layout, const float* vertices, int count, GLenum usage)
+{
+	struct vertex_layout* l = (struct vertex_layout*)layout;
+	void* packed = malloc((size_t)l->stride * count);
+	if (packed == NULL) {
 		return 0;
 	}
+	ugles2_pack_vertices(layout, vertices, count, packed);
+	GLuint buffer = ugles2_gen_buffer(GL_ARRAY_BUFFER, packed, l->stride * count, usage);
+	free(packed);
 
-	if (load_image(file, &width, &height, NULL) != 0) {
-		return 0;
-	}
+	return buffer;
+}
 
-	GLubyte* pixels = (GLubyte*)malloc(width*height*4);
-	if (pixels == NULL) {
-		return 0;
-	}
+// binds buffer and points every located attribute at it, through the state cache
+void ugles2_apply_vertex_layout(struct ugles2_context* context, void* layout, GLuint buffer)
+{
+	struct vertex_layout* l = (struct vertex_layout*)layout;
+	ugles2_bind_buffer(context, GL_ARRAY_BUFFER, buffer);
 
-	if (load_image(file, &width, &height, pixels) != 0) {
-		free(pixels);
-		return 0;
+	int i;
+	for (i = 0; i < l->count; i++) {
+		const struct vertex_attrib_format* a = &l->attribs[i];
+		if (a->location < 0) {
+			continue;
+		}
+		ugles2_enable_vertex_attrib(context, a->location);
+		ugles2_vertex_attrib_pointer(context, a->location, a->components, a->gl_type, a->normalized
+			, l->stride, (const char*)0 + a->offset);
 	}
+}
 
+// =============================================================================
+// texture cache
+//
+// like the program cache, the loaders look up the cache of the current EGL
+// context. files are keyed by path, memory sources by a hash of their bytes,
+// both together with the options. textures nobody references stay loaded until
+// the budget needs their memory, least recently used first.
+
+struct cached_texture {
+	struct cached_texture* next;
+	uint64_t key;
+	char* file;				// NULL for memory sources
+	unsigned size;			// of a memory source
 	GLuint texture;
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-
-	GLenum format = GL_RGBA;
-	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+	int refs;
+	uint64_t used;			// cache clock of the last load
+	unsigned long bytes;	// on the GPU
+	struct ugles2_texture_info info;
+};
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+struct texture_cache {
+	struct texture_cache* next;
+	EGLContext egl_context;
+	struct cached_texture* textures;
+	uint64_t clock;
+	struct ugles2_texture_cache_stats stats;
+};
 
-	free(pixels);
+static pthread_mutex_t texture_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct texture_cache* texture_caches = NULL;
 
-	return texture;
+static uint64_t hash_bytes(uint64_t h, const void* data, size_t size)
+{
+	// FNV-1a
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* end = p + size;
+	for (; p < end; p++) {
+		h = (h ^ *p) * 0x100000001b3ULL;
+	}
+	return h;
 }
 
-int ugles2_load_size(int* width, int* height, const char file[])
+static struct texture_cache* current_texture_cache()
 {
-	if ((file == NULL) || (strlen(file) < 4)) {
-		return -1;
+	EGLContext egl_context = eglGetCurrentContext();
+	pthread_mutex_lock(&texture_caches_mutex);
+	struct texture_cache* cache;
+	for (cache = texture_caches; cache != NULL; cache = cache->next) {
+		if (cache->egl_context == egl_context) {
+			break;
+		}
 	}
+	pthread_mutex_unlock(&texture_caches_mutex);
 
-	load_func load_image = get_load_func(filename_ext(file));
-	if (load_image == NULL) {
-		return -1;
+	return cache;
+}
+
+static uint64_t texture_key(const char file[], const void* data, unsigned size, const struct ugles2_texture_options* options)
+{
+	struct ugles2_texture_options o;
+	if (options != NULL) {
+		o = *options;
+	} else {
+		ugles2_init_texture_options(&o);
 	}
 
-	if (load_image(file, width, height, NULL) != 0) {
-		return -1;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	if (file != NULL) {
+		h = hash_bytes(h, file, strlen(file) + 1);
+	} else {
+		h = hash_bytes(h ^ 0xffU, data, size);
 	}
+	return hash_bytes(h, &o, sizeof(o));
+}
+
+// a memory source matches on its hash and size alone, its bytes are not kept
+static struct cached_texture* find_cached_texture(struct texture_cache* cache, uint64_t key, const char file[], unsigned size)
+{
+	struct cached_texture* t;
+	for (t = cache->textures; t != NULL; t = t->next) {
+		if ((t->key == key) && (t->size == size) && ((file == NULL)? (t->file == NULL) : (t->file != NULL) && (strcmp(t->file, file) == 0))) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static void evict_textures(struct texture_cache* cache)
+{
+	while ((cache->stats.budget > 0) && (cache->stats.bytes > cache->stats.budget)) {
+		struct cached_texture** oldest = NULL;
+		struct cached_texture** t;
+		for (t = &cache->textures; *t != NULL; t = &(*t)->next) {
+			if (((*t)->refs == 0) && ((oldest == NULL) || ((*t)->used < (*oldest)->used))) {
+				oldest = t;
+			}
+		}
+		if (oldest == NULL) {
+			return;		// everything left is in use
+		}
+
+		struct cached_texture* found = *oldest;
+		*oldest = found->next;
+		glDeleteTextures(1, &found->texture);
+		cache->stats.textures--;
+		cache->stats.unused--;
+		cache->stats.bytes -= found->bytes;
+		cache->stats.evictions++;
+		free(found->file);
+		free(found);
+	}
+}
+
+static GLuint use_cached_texture(struct texture_cache* cache, struct cached_texture* t, struct ugles2_texture_info* info)
+{
+	if (t->refs++ == 0) {
+		cache->stats.unused--;
+	}
+	t->used = ++cache->clock;
+	cache->stats.hits++;
+	if (info != NULL) {
+		*info = t->info;
+	}
+	return t->texture;
+}
+
+static void store_cached_texture(struct texture_cache* cache, uint64_t key, const char file[], unsigned size
+	, const struct ugles2_texture_options* options, GLuint texture, const struct ugles2_texture_info* info)
+{
+	cache->stats.misses++;
+	struct cached_texture* t = (struct cached_texture*)malloc(sizeof(struct cached_texture));
+	if (t == NULL) {
+		return;		// served uncached
+	}
+	memset(t, 0, sizeof(*t));
+	if (file != NULL) {
+		t->file = strdup(file);
+		if (t->file == NULL) {
+			free(t);
+			return;
+		}
+	}
+	t->key = key;
+	t->size = size;
+	t->texture = texture;
+	t->refs = 1;
+	t->used = ++cache->clock;
+	t->info = *info;
+	t->bytes = info->bytes;
+	if ((options != NULL) && (options->mipmap == UGLES2_MIPMAP_GL)) {
+		t->bytes += t->bytes / 3;	// levels built by the driver
+	}
+	t->next = cache->textures;
+	cache->textures = t;
+
+	cache->stats.textures++;
+	cache->stats.bytes += t->bytes;
+	evict_textures(cache);
+}
+
+void ugles2_delete_texture(GLuint texture)
+{
+	struct texture_cache* cache = current_texture_cache();
+	if (cache != NULL) {
+		struct cached_texture* t;
+		for (t = cache->textures; t != NULL; t = t->next) {
+			if (t->texture == texture) {
+				if ((t->refs > 0) && (--t->refs == 0)) {
+					cache->stats.unused++;
+					evict_textures(cache);
+				}
+				return;
+			}
+		}
+	}
+	glDeleteTextures(1, &texture);
+}
+
+static void disable_texture_cache(struct ugles2_context* context)
+{
+	struct texture_cache* cache = (struct texture_cache*)context->textures;
+	if (cache == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&texture_caches_mutex);
+	struct texture_cache** c;
+	for (c = &texture_caches; *c != NULL; c = &(*c)->next) {
+		if (*c == cache) {
+			*c = cache->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&texture_caches_mutex);
+
+	// the textures go away with the GL context
+	while (cache->textures != NULL) {
+		struct cached_texture* next = cache->textures->next;
+		free(cache->textures->file);
+		free(cache->textures);
+		cache->textures = next;
+	}
+	free(cache);
+	context->textures = NULL;
+}
+
+int ugles2_enable_texture_cache(struct ugles2_context* context, unsigned long budget)
+{
+	if (context->textures != NULL) {
+		return ugles2_set_texture_budget(context, budget);
+	}
+
+	struct texture_cache* cache = (struct texture_cache*)malloc(sizeof(struct texture_cache));
+	if (cache == NULL) {
+		return -1;
+	}
+	memset(cache, 0, sizeof(*cache));
+	cache->egl_context = context->context;
+	cache->stats.budget = budget;
+
+	pthread_mutex_lock(&texture_caches_mutex);
+	cache->next = texture_caches;
+	texture_caches = cache;
+	pthread_mutex_unlock(&texture_caches_mutex);
+	context->textures = cache;
+
+	return 0;
+}
+
+int ugles2_set_texture_budget(struct ugles2_context* context, unsigned long budget)
+{
+	struct texture_cache* cache = (struct texture_cache*)context->textures;
+	if (cache == NULL) {
+		return -1;
+	}
+	cache->stats.budget = budget;
+	evict_textures(cache);
+	return 0;
+}
+
+int ugles2_texture_cache_stats(struct ugles2_context* context, struct ugles2_texture_cache_stats* stats)
+{
+	struct texture_cache* cache = (struct texture_cache*)context->textures;
+	if ((cache == NULL) || (stats == NULL)) {
+		return -1;
+	}
+	*stats = cache->stats;
+	return 0;
+}
+
+// =============================================================================
+// etc1
+//
+// ETC1 blocks are 4x4 pixels in 8 bytes: two half blocks (side by side, or one
+// above the other when flipped), each with a base color and one of 8 modifier
+// tables, and a 2-bit modifier per pixel. the encoder tries both layouts in
+// differential and individual mode and keeps the smallest squared error.
+
+static const int etc1_modifiers[8][4] = {
+	{  2,   8,  -2,   -8 },
+	{  5,  17,  -5,  -17 },
+	{  9,  29,  -9,  -29 },
+	{ 13,  42, -13,  -42 },
+	{ 18,  60, -18,  -60 },
+	{ 24,  80, -24,  -80 },
+	{ 33, 106, -33, -106 },
+	{ 47, 183, -47, -183 },
+};
+
+static inline int clamp255(int v)
+{
+	return (v < 0)? 0 : (v > 255)? 255 : v;
+}
+
+// whether pixel (x, y) of a block is in the second half
+static inline int etc1_half(int x, int y, int flip)
+{
+	return flip? (y >= 2) : (x >= 2);
+}
+
+static void decode_etc1_block(const unsigned char block[8], GLubyte rgba[64])
+{
+	int base[2][3];
+	int c;
+	if (block[3] & 0x02) {
+		for (c = 0; c < 3; c++) {
+			int b = block[c] >> 3;
+			int d = block[c] & 0x07;
+			int b2 = b + ((d >= 4)? d - 8 : d);
+			base[0][c] = (b << 3) | (b >> 2);
+			base[1][c] = ((b2 & 0x1f) << 3) | ((b2 & 0x1f) >> 2);
+		}
+	} else {
+		for (c = 0; c < 3; c++) {
+			base[0][c] = (block[c] >> 4) * 0x11;
+			base[1][c] = (block[c] & 0x0f) * 0x11;
+		}
+	}
+	int table[2] = { block[3] >> 5, (block[3] >> 2) & 0x07 };
+	int flip = block[3] & 0x01;
+	unsigned msb = block[4] << 8 | block[5];
+	unsigned lsb = block[6] << 8 | block[7];
+
+	int x, y;
+	for (y = 0; y < 4; y++) {
+		for (x = 0; x < 4; x++) {
+			int p = x * 4 + y;
+			int half = etc1_half(x, y, flip);
+			int m = etc1_modifiers[table[half]][((msb >> p) & 1) << 1 | ((lsb >> p) & 1)];
+			GLubyte* out = &rgba[(y * 4 + x) * 4];
+			out[0] = clamp255(base[half][0] + m);
+			out[1] = clamp255(base[half][1] + m);
+			out[2] = clamp255(base[half][2] + m);
+			out[3] = 255;
+		}
+	}
+}
+
+// best table and modifiers for the 8 pixels of a half block; returns the error
+static unsigned fit_etc1_half(const GLubyte rgba[64], int flip, int half, const int base[3]
+	, int* best_table, unsigned* msb, unsigned* lsb)
+{
+	unsigned best_error = 0xffffffffU;
+	unsigned best_msb = 0;
+	unsigned best_lsb = 0;
+	int t;
+	for (t = 0; t < 8; t++) {
+		unsigned error = 0;
+		unsigned m = 0;
+		unsigned l = 0;
+		int x, y;
+		for (y = 0; (y < 4) && (error < best_error); y++) {
+			for (x = 0; x < 4; x++) {
+				if (etc1_half(x, y, flip) != half) {
+					continue;
+				}
+				const GLubyte* p = &rgba[(y * 4 + x) * 4];
+				unsigned pixel_error = 0xffffffffU;
+				int index = 0;
+				int i;
+				for (i = 0; i < 4; i++) {
+					int dr = clamp255(base[0] + etc1_modifiers[t][i]) - p[0];
+					int dg = clamp255(base[1] + etc1_modifiers[t][i]) - p[1];
+					int db = clamp255(base[2] + etc1_modifiers[t][i]) - p[2];
+					unsigned e = dr * dr + dg * dg + db * db;
+					if (e < pixel_error) {
+						pixel_error = e;
+						index = i;
+					}
+				}
+				error += pixel_error;
+				m |= (unsigned)(index >> 1) << (x * 4 + y);
+				l |= (unsigned)(index & 1) << (x * 4 + y);
+			}
+		}
+		if (error < best_error) {
+			best_error = error;
+			best_msb = m;
+			best_lsb = l;
+			*best_table = t;
+		}
+	}
+	*msb |= best_msb;
+	*lsb |= best_lsb;
+	return best_error;
+}
+
+static unsigned encode_etc1_mode(const GLubyte rgba[64], int flip, int differential, unsigned char block[8])
+{
+	int avg[2][3] = { { 0, 0, 0 }, { 0, 0, 0 } };
+	int x, y, c;
+	for (y = 0; y < 4; y++) {
+		for (x = 0; x < 4; x++) {
+			for (c = 0; c < 3; c++) {
+				avg[etc1_half(x, y, flip)][c] += rgba[(y * 4 + x) * 4 + c];
+			}
+		}
+	}
+
+	int q[2][3];
+	int base[2][3];
+	int h;
+	for (h = 0; h < 2; h++) {
+		for (c = 0; c < 3; c++) {
+			int v = (avg[h][c] + 4) / 8;
+			if (differential) {
+				q[h][c] = (v * 31 + 127) / 255;
+				base[h][c] = (q[h][c] << 3) | (q[h][c] >> 2);
+			} else {
+				q[h][c] = (v * 15 + 127) / 255;
+				base[h][c] = q[h][c] * 0x11;
+			}
+		}
+	}
+	if (differential) {
+		for (c = 0; c < 3; c++) {
+			int d = q[1][c] - q[0][c];
+			if ((d < -4) || (d > 3)) {
+				return 0xffffffffU;
+			}
+			block[c] = q[0][c] << 3 | (d & 0x07);
+		}
+	} else {
+		for (c = 0; c < 3; c++) {
+			block[c] = q[0][c] << 4 | q[1][c];
+		}
+	}
+
+	int table[2];
+	unsigned msb = 0;
+	unsigned lsb = 0;
+	unsigned error = fit_etc1_half(rgba, flip, 0, base[0], &table[0], &msb, &lsb)
+		+ fit_etc1_half(rgba, flip, 1, base[1], &table[1], &msb, &lsb);
+
+	block[3] = table[0] << 5 | table[1] << 2 | (differential? 0x02 : 0) | flip;
+	block[4] = msb >> 8;
+	block[5] = msb;
+	block[6] = lsb >> 8;
+	block[7] = lsb;
+
+	return error;
+}
+
+static void encode_etc1_block(const GLubyte rgba[64], unsigned char block[8])
+{
+	unsigned best_error = 0xffffffffU;
+	int flip, differential;
+	for (differential = 1; differential >= 0; differential--) {
+		for (flip = 0; flip < 2; flip++) {
+			unsigned char candidate[8];
+			unsigned error = encode_etc1_mode(rgba, flip, differential, candidate);
+			if (error < best_error) {
+				best_error = error;
+				memcpy(block, candidate, 8);
+			}
+		}
+	}
+}
+
+size_t ugles2_etc1_size(int width, int height)
+{
+	if ((width <= 0) || (height <= 0)) {
+		return 0;
+	}
+	size_t blocks_x = ((size_t)width + 3) / 4;
+	size_t blocks_y = ((size_t)height + 3) / 4;
+	if (blocks_x > SIZE_MAX / 8 / blocks_y) {
+		return 0;
+	}
+	return blocks_x * blocks_y * 8;
+}
+
+// blocks over the edge repeat the last row and column
+void ugles2_encode_etc1(const GLubyte* pixels, int width, int height, void* data)
+{
+	unsigned char* out = (unsigned char*)data;
+	int bx, by, x, y;
+	for (by = 0; by < height; by += 4) {
+		for (bx = 0; bx < width; bx += 4) {
+			GLubyte rgba[64];
+			for (y = 0; y < 4; y++) {
+				int sy = (by + y < height)? by + y : height - 1;
+				for (x = 0; x < 4; x++) {
+					int sx = (bx + x < width)? bx + x : width - 1;
+					memcpy(&rgba[(y * 4 + x) * 4], &pixels[((size_t)sy * width + sx) * 4], 4);
+				}
+			}
+			encode_etc1_block(rgba, out);
+			out += 8;
+		}
+	}
+}
+
+void ugles2_decode_etc1(const void* data, int width, int height, GLubyte* pixels)
+{
+	const unsigned char* in = (const unsigned char*)data;
+	int bx, by, y;
+	for (by = 0; by < height; by += 4) {
+		for (bx = 0; bx < width; bx += 4) {
+			GLubyte rgba[64];
+			decode_etc1_block(in, rgba);
+			in += 8;
+			int w = (bx + 4 <= width)? 4 : width - bx;
+			for (y = 0; (y < 4) && (by + y < height); y++) {
+				memcpy(&pixels[((size_t)(by + y) * width + bx) * 4], &rgba[y * 16], w * 4);
+			}
+		}
+	}
+}
+
+// PKM (ETC1 only, one level) and KTX (GL_ETC1_RGB8_OES, any levels) files.
+// both are held to the 16 bits a PKM size has; uploads check GL_MAX_TEXTURE_SIZE
+#define KTX_HEADER_SIZE 64
+#define ETC1_MAX_SIZE   0xffff
+
+struct etc1_file {
+	int width;
+	int height;
+	int levels;
+	int ktx;
+	int swap;		// KTX written with the other byte order
+	size_t data;	// offset of the first level (KTX: of its image size)
+};
+
+static uint32_t get_u32(const unsigned char* p, int swap)
+{
+	return swap? ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3])
+		: ((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+}
+
+static int is_etc1_file(const unsigned char* data, size_t size)
+{
+	static const unsigned char ktx_id[12] = { 0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n' };
+	return ((size >= 16) && (memcmp(data, "PKM 10", 6) == 0))
+		|| ((size >= KTX_HEADER_SIZE) && (memcmp(data, ktx_id, 12) == 0));
+}
+
+static int read_etc1_header(const unsigned char* h, size_t size, struct etc1_file* file)
+{
+	memset(file, 0, sizeof(*file));
+	if (!is_etc1_file(h, size)) {
+		return -1;
+	}
+	if (h[0] == 'P') {
+		if ((h[6] << 8 | h[7]) != 0) {	// ETC1_RGB_NO_MIPMAPS
+			return -1;
+		}
+		file->width  = h[12] << 8 | h[13];
+		file->height = h[14] << 8 | h[15];
+		file->levels = 1;
+		file->data   = 16;
+		return ((file->width > 0) && (file->height > 0))? 0 : -1;
+	}
+	file->ktx  = 1;
+	file->swap = (get_u32(h + 12, 0) != 0x04030201);
+	uint32_t internal_format = get_u32(h + 28, file->swap);
+	uint32_t width  = get_u32(h + 36, file->swap);
+	uint32_t height = get_u32(h + 40, file->swap);
+	uint32_t depth  = get_u32(h + 44, file->swap);
+	uint32_t faces  = get_u32(h + 52, file->swap);
+	uint32_t levels = get_u32(h + 56, file->swap);
+	uint32_t kv_bytes = get_u32(h + 60, file->swap);
+	if ((internal_format != GL_ETC1_RGB8_OES) || (depth != 0) || (faces != 1) || (get_u32(h + 48, file->swap) > 1)) {
+		return -1;
+	}
+	if ((width == 0) || (height == 0) || (width > ETC1_MAX_SIZE) || (height > ETC1_MAX_SIZE)
+		|| (kv_bytes > size - KTX_HEADER_SIZE)) {
+		return -1;
+	}
+	// no more levels than the chain down to 1x1 has
+	uint32_t chain = 1;
+	uint32_t level_w = width;
+	uint32_t level_h = height;
+	while ((level_w > 1) || (level_h > 1)) {
+		level_w = (level_w > 1)? level_w / 2 : 1;
+		level_h = (level_h > 1)? level_h / 2 : 1;
+		chain++;
+	}
+	if (levels > chain) {
+		return -1;
+	}
+	file->width  = (int)width;
+	file->height = (int)height;
+	file->levels = (levels == 0)? 1 : (int)levels;
+	file->data   = KTX_HEADER_SIZE + kv_bytes;
+	return 0;
+}
+
+// the level at *offset, which moves on to the next one; NULL when the data is short
+static const unsigned char* etc1_level(const unsigned char* data, size_t size, const struct etc1_file* file
+	, size_t* offset, int width, int height)
+{
+	size_t level_size = ugles2_etc1_size(width, height);
+	size_t p = *offset;
+	if (level_size == 0) {
+		return NULL;
+	}
+	if (file->ktx) {
+		if ((p > size) || (size - p < 4) || (get_u32(data + p, file->swap) != level_size)) {
+			return NULL;
+		}
+		p += 4;
+	}
+	if ((p > size) || (level_size > size - p)) {
+		return NULL;
+	}
+	*offset = p + level_size;	// a multiple of 8, so KTX needs no padding
+	return data + p;
+}
+
+// =============================================================================
+// pixel conversion
+//
+// rows of source pixels into RGBA. the SSSE3 kernels are compiled for their
+// target alone and picked when the CPU has it, so builds for plain x86-64 use
+// them too; NEON is there whenever the build targets it. the kernels return
+// the pixels they did and the scalar rows finish the rest.
+
+#define DIV255(v) (((v) + 1 + ((v) >> 8)) >> 8)		// truncates, exact for 0 <= v <= 65534
+
+#define PIXEL_LAYOUTS (UGLES2_PIXELS_GRAY_ALPHA + 1)
+
+typedef void (*pixel_row_func)(GLubyte* dst, const GLubyte* src, int n);
+typedef int  (*pixel_row_simd_func)(GLubyte* dst, const GLubyte* src, int n);
+
+static const int pixel_bytes[PIXEL_LAYOUTS] = { 3, 3, 4, 4, 4, 4, 1, 2 };
+
+// source byte of R, G, B and A
+static const unsigned char pixel_orders[PIXEL_LAYOUTS][4] = {
+	{ 0, 1, 2, 0 }, { 2, 1, 0, 0 }, { 0, 1, 2, 3 }, { 2, 1, 0, 3 }, { 1, 2, 3, 0 }, { 3, 2, 1, 0 },
+	{ 0, 0, 0, 0 }, { 0, 0, 0, 1 },
+};
+
+static void rgb_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i*4  ] = src[i*3  ];
+		dst[i*4+1] = src[i*3+1];
+		dst[i*4+2] = src[i*3+2];
+		dst[i*4+3] = 255;
+	}
+}
+
+static void bgr_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i*4  ] = src[i*3+2];
+		dst[i*4+1] = src[i*3+1];
+		dst[i*4+2] = src[i*3  ];
+		dst[i*4+3] = 255;
+	}
+}
+
+static void rgba_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	memmove(dst, src, (size_t)n * 4);
+}
+
+static void swizzle_row(GLubyte* dst, const GLubyte* src, int n, const unsigned char order[4])
+{
+	int i;
+	for (i = 0; i < n; i++, dst += 4, src += 4) {
+		GLubyte r = src[order[0]];
+		GLubyte g = src[order[1]];
+		GLubyte b = src[order[2]];
+		GLubyte a = src[order[3]];
+		dst[0] = r;
+		dst[1] = g;
+		dst[2] = b;
+		dst[3] = a;
+	}
+}
+
+static void bgra_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	swizzle_row(dst, src, n, pixel_orders[UGLES2_PIXELS_BGRA]);
+}
+
+static void argb_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	swizzle_row(dst, src, n, pixel_orders[UGLES2_PIXELS_ARGB]);
+}
+
+static void abgr_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	swizzle_row(dst, src, n, pixel_orders[UGLES2_PIXELS_ABGR]);
+}
+
+static void gray_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i*4] = dst[i*4+1] = dst[i*4+2] = src[i];
+		dst[i*4+3] = 255;
+	}
+}
+
+static void gray_alpha_row(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		dst[i*4] = dst[i*4+1] = dst[i*4+2] = src[i*2];
+		dst[i*4+3] = src[i*2+1];
+	}
+}
+
+static void premultiply_row(GLubyte* dst, int n)
+{
+	int i;
+	for (i = 0; i < n; i++, dst += 4) {
+		unsigned a = dst[3];
+		dst[0] = DIV255(dst[0] * a);
+		dst[1] = DIV255(dst[1] * a);
+		dst[2] = DIV255(dst[2] * a);
+	}
+}
+
+static const pixel_row_func pixel_rows[PIXEL_LAYOUTS] = {
+	rgb_row, bgr_row, rgba_row, bgra_row, argb_row, abgr_row, gray_row, gray_alpha_row,
+};
+
+static pixel_row_simd_func pixel_rows_simd[PIXEL_LAYOUTS];
+static pixel_row_simd_func premultiply_row_simd;
+static const char* pixel_kernel = "scalar";
+static pthread_once_t pixel_kernel_once = PTHREAD_ONCE_INIT;
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(UGLES2_NO_SIMD)
+#include <tmmintrin.h>
+#define SSSE3 __attribute__((target("ssse3")))
+
+// 16 pixels from 48 bytes, 4 at a time through one shuffle
+SSSE3 static int rgb_shuffle_row_ssse3(GLubyte* dst, const GLubyte* src, int n, const unsigned char order[4])
+{
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	const __m128i m = _mm_setr_epi8(order[0], order[1], order[2], -1, order[0] + 3, order[1] + 3, order[2] + 3, -1
+		, order[0] + 6, order[1] + 6, order[2] + 6, -1, order[0] + 9, order[1] + 9, order[2] + 9, -1);
+	int i;
+	for (i = 0; i + 16 <= n; i += 16, src += 48, dst += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+		_mm_storeu_si128((__m128i*)dst,        _mm_or_si128(_mm_shuffle_epi8(a, m), alpha));
+		_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), m), alpha));
+		_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), m), alpha));
+		_mm_storeu_si128((__m128i*)(dst + 48), _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), m), alpha));
+	}
+	return i;
+}
+
+SSSE3 static int rgb_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	return rgb_shuffle_row_ssse3(dst, src, n, pixel_orders[UGLES2_PIXELS_RGB]);
+}
+
+SSSE3 static int bgr_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	return rgb_shuffle_row_ssse3(dst, src, n, pixel_orders[UGLES2_PIXELS_BGR]);
+}
+
+SSSE3 static int swizzle_row_ssse3(GLubyte* dst, const GLubyte* src, int n, const unsigned char order[4])
+{
+	__m128i m = _mm_setr_epi8(order[0], order[1], order[2], order[3], order[0] + 4, order[1] + 4, order[2] + 4, order[3] + 4
+		, order[0] + 8, order[1] + 8, order[2] + 8, order[3] + 8, order[0] + 12, order[1] + 12, order[2] + 12, order[3] + 12);
+	int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&src[i*4]);
+		_mm_storeu_si128((__m128i*)&dst[i*4], _mm_shuffle_epi8(v, m));
+	}
+	return i;
+}
+
+SSSE3 static int bgra_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	return swizzle_row_ssse3(dst, src, n, pixel_orders[UGLES2_PIXELS_BGRA]);
+}
+
+SSSE3 static int argb_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	return swizzle_row_ssse3(dst, src, n, pixel_orders[UGLES2_PIXELS_ARGB]);
+}
+
+SSSE3 static int abgr_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	return swizzle_row_ssse3(dst, src, n, pixel_orders[UGLES2_PIXELS_ABGR]);
+}
+
+SSSE3 static int gray_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	const __m128i m0 = _mm_setr_epi8( 0,  0,  0, -1,  1,  1,  1, -1,  2,  2,  2, -1,  3,  3,  3, -1);
+	const __m128i m1 = _mm_setr_epi8( 4,  4,  4, -1,  5,  5,  5, -1,  6,  6,  6, -1,  7,  7,  7, -1);
+	const __m128i m2 = _mm_setr_epi8( 8,  8,  8, -1,  9,  9,  9, -1, 10, 10, 10, -1, 11, 11, 11, -1);
+	const __m128i m3 = _mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&src[i]);
+		_mm_storeu_si128((__m128i*)&dst[i*4],      _mm_or_si128(_mm_shuffle_epi8(v, m0), alpha));
+		_mm_storeu_si128((__m128i*)&dst[i*4 + 16], _mm_or_si128(_mm_shuffle_epi8(v, m1), alpha));
+		_mm_storeu_si128((__m128i*)&dst[i*4 + 32], _mm_or_si128(_mm_shuffle_epi8(v, m2), alpha));
+		_mm_storeu_si128((__m128i*)&dst[i*4 + 48], _mm_or_si128(_mm_shuffle_epi8(v, m3), alpha));
+	}
+	return i;
+}
+
+SSSE3 static int gray_alpha_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	const __m128i m0 = _mm_setr_epi8(0, 0, 0, 1,  2,  2,  2,  3,  4,  4,  4,  5,  6,  6,  6,  7);
+	const __m128i m1 = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+	int i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&src[i*2]);
+		_mm_storeu_si128((__m128i*)&dst[i*4],      _mm_shuffle_epi8(v, m0));
+		_mm_storeu_si128((__m128i*)&dst[i*4 + 16], _mm_shuffle_epi8(v, m1));
+	}
+	return i;
+}
+
+// alpha is multiplied by 255, which DIV255 gives back unchanged
+SSSE3 static int premultiply_row_ssse3(GLubyte* dst, const GLubyte* src, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one  = _mm_set1_epi16(1);
+	const __m128i keep = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+	const __m128i m_lo = _mm_setr_epi8(3, -1, 3, -1, 3, -1, -1, -1,  7, -1,  7, -1,  7, -1, -1, -1);
+	const __m128i m_hi = _mm_setr_epi8(11, -1, 11, -1, 11, -1, -1, -1, 15, -1, 15, -1, 15, -1, -1, -1);
+	int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v  = _mm_loadu_si128((const __m128i*)&src[i*4]);
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), _mm_or_si128(_mm_shuffle_epi8(v, m_lo), keep));
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), _mm_or_si128(_mm_shuffle_epi8(v, m_hi), keep));
+		lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, one), _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, one), _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128((__m128i*)&dst[i*4], _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+static void init_pixel_kernel()
+{
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("ssse3")) {
+		return;
+	}
+	pixel_rows_simd[UGLES2_PIXELS_RGB]        = rgb_row_ssse3;
+	pixel_rows_simd[UGLES2_PIXELS_BGR]        = bgr_row_ssse3;
+	pixel_rows_simd[UGLES2_PIXELS_BGRA]       = bgra_row_ssse3;
+	pixel_rows_simd[UGLES2_PIXELS_ARGB]       = argb_row_ssse3;
+	pixel_rows_simd[UGLES2_PIXELS_ABGR]       = abgr_row_ssse3;
+	pixel_rows_simd[UGLES2_PIXELS_GRAY]       = gray_row_ssse3;
+	pixel_rows_simd[UGLES2_PIXELS_GRAY_ALPHA] = gray_alpha_row_ssse3;
+	premultiply_row_simd = premultiply_row_ssse3;
+	pixel_kernel = "ssse3";
+}
+
+#elif defined(__ARM_NEON__) && !defined(UGLES2_NO_SIMD)
+#include <arm_neon.h>
+
+static int rgb_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x3_t s = vld3q_u8(&src[i*3]);
+		uint8x16x4_t d = { { s.val[0], s.val[1], s.val[2], vdupq_n_u8(255) } };
+		vst4q_u8(&dst[i*4], d);
+	}
+	return i;
+}
+
+static int bgr_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x3_t s = vld3q_u8(&src[i*3]);
+		uint8x16x4_t d = { { s.val[2], s.val[1], s.val[0], vdupq_n_u8(255) } };
+		vst4q_u8(&dst[i*4], d);
+	}
+	return i;
+}
+
+static int swizzle_row_neon(GLubyte* dst, const GLubyte* src, int n, const unsigned char order[4])
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t s = vld4q_u8(&src[i*4]);
+		uint8x16x4_t d = { { s.val[order[0]], s.val[order[1]], s.val[order[2]], s.val[order[3]] } };
+		vst4q_u8(&dst[i*4], d);
+	}
+	return i;
+}
+
+static int bgra_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	return swizzle_row_neon(dst, src, n, pixel_orders[UGLES2_PIXELS_BGRA]);
+}
+
+static int argb_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	return swizzle_row_neon(dst, src, n, pixel_orders[UGLES2_PIXELS_ARGB]);
+}
+
+static int abgr_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	return swizzle_row_neon(dst, src, n, pixel_orders[UGLES2_PIXELS_ABGR]);
+}
+
+static int gray_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t g = vld1q_u8(&src[i]);
+		uint8x16x4_t d = { { g, g, g, vdupq_n_u8(255) } };
+		vst4q_u8(&dst[i*4], d);
+	}
+	return i;
+}
+
+static int gray_alpha_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t s = vld2q_u8(&src[i*2]);
+		uint8x16x4_t d = { { s.val[0], s.val[0], s.val[0], s.val[1] } };
+		vst4q_u8(&dst[i*4], d);
+	}
+	return i;
+}
+
+static inline uint8x8_t premultiply_u8(uint8x8_t c, uint8x8_t a)
+{
+	uint16x8_t v = vmull_u8(c, a);
+	return vmovn_u16(vshrq_n_u16(vaddq_u16(vaddq_u16(v, vdupq_n_u16(1)), vshrq_n_u16(v, 8)), 8));
+}
+
+static int premultiply_row_neon(GLubyte* dst, const GLubyte* src, int n)
+{
+	int i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint8x8x4_t p = vld4_u8(&src[i*4]);
+		p.val[0] = premultiply_u8(p.val[0], p.val[3]);
+		p.val[1] = premultiply_u8(p.val[1], p.val[3]);
+		p.val[2] = premultiply_u8(p.val[2], p.val[3]);
+		vst4_u8(&dst[i*4], p);
+	}
+	return i;
+}
+
+static void init_pixel_kernel()
+{
+	pixel_rows_simd[UGLES2_PIXELS_RGB]        = rgb_row_neon;
+	pixel_rows_simd[UGLES2_PIXELS_BGR]        = bgr_row_neon;
+	pixel_rows_simd[UGLES2_PIXELS_BGRA]       = bgra_row_neon;
+	pixel_rows_simd[UGLES2_PIXELS_ARGB]       = argb_row_neon;
+	pixel_rows_simd[UGLES2_PIXELS_ABGR]       = abgr_row_neon;
+	pixel_rows_simd[UGLES2_PIXELS_GRAY]       = gray_row_neon;
+	pixel_rows_simd[UGLES2_PIXELS_GRAY_ALPHA] = gray_alpha_row_neon;
+	premultiply_row_simd = premultiply_row_neon;
+	pixel_kernel = "neon";
+}
+
+#else
+static void init_pixel_kernel()
+{
+}
+#endif
+
+// the kernels read all of src before writing, so dst may be src when both are 4 bytes a pixel
+static void convert_row(GLubyte* dst, const GLubyte* src, int n, int layout, int flags)
+{
+	pthread_once(&pixel_kernel_once, init_pixel_kernel);
+
+	int done = 0;
+	if (((flags & UGLES2_CONVERT_SCALAR) == 0) && (pixel_rows_simd[layout] != NULL)) {
+		done = pixel_rows_simd[layout](dst, src, n);
+	}
+	pixel_rows[layout](dst + done * 4, src + done * pixel_bytes[layout], n - done);
+
+	if (flags & UGLES2_CONVERT_PREMULTIPLY) {
+		done = 0;
+		if (((flags & UGLES2_CONVERT_SCALAR) == 0) && (premultiply_row_simd != NULL)) {
+			done = premultiply_row_simd(dst, dst, n);
+		}
+		premultiply_row(dst + done * 4, n - done);
+	}
+}
+
+int ugles2_convert_pixels(GLubyte* dst, const void* src, int src_stride, int width, int height, int layout, int flags)
+{
+	if ((width < 0) || (height < 0) || (layout < 0) || (layout >= PIXEL_LAYOUTS)) {
+		return -1;
+	}
+	if (src_stride == 0) {
+		src_stride = width * pixel_bytes[layout];
+	}
+
+	int j;
+	for (j = 0; j < height; j++) {
+		int y = (flags & UGLES2_CONVERT_FLIP)? height - j - 1 : j;
+		convert_row(dst + (size_t)y * width * 4, (const GLubyte*)src + (size_t)j * src_stride, width, layout, flags);
+	}
+
+	return 0;
+}
+
+const char* ugles2_convert_kernel(void)
+{
+	pthread_once(&pixel_kernel_once, init_pixel_kernel);
+	return pixel_kernel;
+}
+
+// =============================================================================
+// texture
+
+struct ugles2_image;
+
+struct image_decoder {
+	int  (*open)(struct ugles2_image* image);
+	int  (*decode)(struct ugles2_image* image, GLubyte* pixels);
+	void (*close)(struct ugles2_image* image);
+};
+
+struct ugles2_image {
+	const struct image_decoder* decoder;
+	const unsigned char* data;	// the encoded image: mapped, read or the caller's
+	size_t size;
+	size_t offset;				// read position of png
+	void* mapping;				// munmap()ed on close
+	void* buffer;				// free()d on close
+	int width;
+	int height;
+	int decoded;
+	void* state;
+	GLubyte* pixels;
+};
+
+// bytes of the decoded RGBA; 0 when a size is not positive or the product overflows
+static size_t rgba_size(int width, int height)
+{
+	if ((width <= 0) || (height <= 0) || ((size_t)width > SIZE_MAX / 4 / (size_t)height)) {
+		return 0;
+	}
+	return (size_t)width * height * 4;
+}
+
+#if defined(USE_PNG)
+struct png_state {
+	png_structp png_ptr;
+	png_infop info_ptr;
+	int color_type;
+};
+
+static void read_png_data(png_structp png_ptr, png_bytep out, png_size_t length)
+{
+	struct ugles2_image* image = (struct ugles2_image*)png_get_io_ptr(png_ptr);
+	if (length > image->size - image->offset) {
+		png_error(png_ptr, "read error");
+	}
+	memcpy(out, image->data + image->offset, length);
+	image->offset += length;
+}
+
+static int open_png(struct ugles2_image* image)
+{
+	if ((image->size < 8) || png_sig_cmp((png_const_bytep)image->data, 0, 8) != 0) {
+		return -1;
+	}
+	image->offset = 8;
+
+	struct png_state* png = (struct png_state*)malloc(sizeof(struct png_state));
+	if (png == NULL) {
+		return -1;
+	}
+	memset(png, 0, sizeof(*png));
+	image->state = png;
+
+	png->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png->png_ptr == NULL) {
+		return -1;
+	}
+	png->info_ptr = png_create_info_struct(png->png_ptr);
+	if (png->info_ptr == NULL) {
+		return -1;
+	}
+
+	png_set_read_fn(png->png_ptr, image, read_png_data);
+	png_set_sig_bytes(png->png_ptr, 8);
+
+	png_read_info(png->png_ptr, png->info_ptr);
+
+	png_uint_32 w, h;
+	int bpp, interlace_method, compression_method, filter_method;
+	png_get_IHDR(png->png_ptr, png->info_ptr, &w, &h, &bpp, &png->color_type, &interlace_method, &compression_method, &filter_method);
+	//printf("w:%d h:%d bpp:%d color:%d interlace:%d compression:%d filter:%d\n"
+	//		, w, h, bpp, png->color_type, interlace_method, compression_method, filter_method);
+
+	image->width  = w;
+	image->height = h;
+
+	return 0;
+}
+
+static int decode_png(struct ugles2_image* image, GLubyte* pixels)
+{
+	struct png_state* png = (struct png_state*)image->state;
+	png_structp png_ptr = png->png_ptr;
+	int w = image->width;
+	int h = image->height;
+
+	png_set_strip_16(png_ptr);
+	png_set_expand(png_ptr);
+	if ((png->color_type == PNG_COLOR_TYPE_GRAY) || (png->color_type == PNG_COLOR_TYPE_GRAY_ALPHA)) {
+		png_set_gray_to_rgb(png_ptr);
+	}
+	if ((png->color_type & PNG_COLOR_MASK_ALPHA) == 0) {
+		png_set_filler(png_ptr, 255, PNG_FILLER_AFTER);
+	}
+
+	png_bytepp rows = (png_bytepp)png_malloc(png_ptr, sizeof(png_bytep)*h);
+	int j;
+	for (j = 0; j < h; j++) {
+		rows[j] = (png_bytep)&pixels[(h - j - 1)*w*4];
+	}
+	png_read_image(png_ptr, rows);
+	png_free(png_ptr, rows);
+
+	return 0;
+}
+
+static void close_png(struct ugles2_image* image)
+{
+	struct png_state* png = (struct png_state*)image->state;
+	if (png == NULL) {
+		return;
+	}
+	if (png->png_ptr != NULL) {
+		png_destroy_read_struct(&png->png_ptr, (png->info_ptr != NULL)? &png->info_ptr : NULL, NULL);
+	}
+	free(png);
+	image->state = NULL;
+}
+
+static const struct image_decoder png_decoder = { open_png, decode_png, close_png };
+#endif
+
+#if defined(USE_JPEG)
+struct jpeg_state {
+	struct jpeg_decompress_struct dec;
+	struct jpeg_error_mgr error_mgr;
+};
+
+static int open_jpeg(struct ugles2_image* image)
+{
+	struct jpeg_state* jpeg = (struct jpeg_state*)malloc(sizeof(struct jpeg_state));
+	if (jpeg == NULL) {
+		return -1;
+	}
+	memset(jpeg, 0, sizeof(*jpeg));
+	image->state = jpeg;
+
+	jpeg->dec.err = jpeg_std_error(&jpeg->error_mgr);
+	jpeg_create_decompress(&jpeg->dec);
+
+	jpeg_mem_src(&jpeg->dec, (unsigned char*)image->data, image->size);
+
+	jpeg_read_header(&jpeg->dec, TRUE);
+
+	jpeg->dec.out_color_space = JCS_RGB;
+	jpeg_calc_output_dimensions(&jpeg->dec);
+
+	image->width  = jpeg->dec.output_width;
+	image->height = jpeg->dec.output_height;
+
+	return 0;
+}
+
+static int decode_jpeg(struct ugles2_image* image, GLubyte* pixels)
+{
+	struct jpeg_state* jpeg = (struct jpeg_state*)image->state;
+	struct jpeg_decompress_struct* dec = &jpeg->dec;
+
+	jpeg_start_decompress(dec);
+
+	int w = dec->output_width;
+	int h = dec->output_height;
+	int pitch = w * dec->output_components;
+
+	JSAMPARRAY buffer = (*dec->mem->alloc_sarray)((j_common_ptr)dec, JPOOL_IMAGE, pitch, 1);
+	int j;
+	for (j = 0; j < h; j++) {
+		jpeg_read_scanlines(dec, buffer, 1);
+		convert_row(&pixels[((h - j - 1)*w)*4], buffer[0], w, UGLES2_PIXELS_RGB, 0);
+	}
+	jpeg_finish_decompress(dec);
+
+	return 0;
+}
+
+static void close_jpeg(struct ugles2_image* image)
+{
+	struct jpeg_state* jpeg = (struct jpeg_state*)image->state;
+	if (jpeg == NULL) {
+		return;
+	}
+	jpeg_destroy_decompress(&jpeg->dec);
+	free(jpeg);
+	image->state = NULL;
+}
+
+static const struct image_decoder jpeg_decoder = { open_jpeg, decode_jpeg, close_jpeg };
+#endif
+
+struct bmp_state {
+	size_t offset;
+	size_t pitch;
+};
+
+static inline int get_le32(const unsigned char* p)
+{
+	return p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static int open_bmp(struct ugles2_image* image)
+{
+	if (image->size < 54) {
+		return -1;
+	}
+	const unsigned char* header = image->data;
+	int bpp = header[0x1c+1] << 8 | header[0x1c];
+	if (bpp != 24) {
+		return -1;
+	}
+
+	struct bmp_state* bmp = (struct bmp_state*)malloc(sizeof(struct bmp_state));
+	if (bmp == NULL) {
+		return -1;
+	}
+	image->state = bmp;
+
+	int w = get_le32(&header[0x12]);
+	int h = get_le32(&header[0x16]);
+	int offset = get_le32(&header[0x0a]);
+	if (offset == 0) {
+		offset = 54;
+	}
+	if ((rgba_size(w, h) == 0) || (offset < 54) || ((size_t)offset > image->size)) {
+		return -1;
+	}
+	bmp->offset = offset;
+	bmp->pitch  = ((size_t)w * 3 + 3) & ~(size_t)3;
+	if (bmp->pitch > (image->size - bmp->offset) / h) {
+		return -1;
+	}
+
+	image->width  = w;
+	image->height = h;
+
+	return 0;
+}
+
+// rows are converted straight from the encoded data
+static int decode_bmp(struct ugles2_image* image, GLubyte* pixels)
+{
+	struct bmp_state* bmp = (struct bmp_state*)image->state;
+	int w = image->width;
+	int h = image->height;
+
+	int y;
+	for (y = 0; y < h; y++) {
+		size_t row = bmp->offset + (size_t)y * bmp->pitch;
+		GLubyte* out = &pixels[(size_t)y * w * 4];
+		if ((size_t)w * 3 <= image->size - row) {
+			convert_row(out, image->data + row, w, UGLES2_PIXELS_BGR, 0);
+		} else {
+			memset(out, 0x80, (size_t)w * 4);
+		}
+	}
+
+	return 0;
+}
+
+static void close_bmp(struct ugles2_image* image)
+{
+	free(image->state);
+	image->state = NULL;
+}
+
+static const struct image_decoder bmp_decoder = { open_bmp, decode_bmp, close_bmp };
+
+static int open_etc1(struct ugles2_image* image)
+{
+	struct etc1_file* etc1 = (struct etc1_file*)malloc(sizeof(struct etc1_file));
+	if (etc1 == NULL) {
+		return -1;
+	}
+	image->state = etc1;
+
+	if (read_etc1_header(image->data, image->size, etc1) != 0) {
+		return -1;
+	}
+	image->width  = etc1->width;
+	image->height = etc1->height;
+
+	return 0;
+}
+
+// the software path for drivers without GL_OES_compressed_ETC1_RGB8_texture
+static int decode_etc1_image(struct ugles2_image* image, GLubyte* pixels)
+{
+	struct etc1_file* etc1 = (struct etc1_file*)image->state;
+	size_t offset = etc1->data;
+	const unsigned char* data = etc1_level(image->data, image->size, etc1, &offset, image->width, image->height);
+	if (data == NULL) {
+		return -1;
+	}
+	ugles2_decode_etc1(data, image->width, image->height, pixels);
+
+	return 0;
+}
+
+static void close_etc1(struct ugles2_image* image)
+{
+	free(image->state);
+	image->state = NULL;
+}
+
+static const struct image_decoder etc1_decoder = { open_etc1, decode_etc1_image, close_etc1 };
+
+static const struct image_decoder* get_decoder(const char ext[])
+{
+	if (ext == NULL) {
+		return NULL;
+	}
+
+	if (strcmp(ext, "bmp") == 0) {
+		return &bmp_decoder;
+	} else if (strcmp(ext, "png") == 0) {
+#if defined(USE_PNG)
+		return &png_decoder;
+#else
+		return NULL;
+#endif
+	} else if ((strcmp(ext, "jpg") == 0) || (strcmp(ext, "jpeg") == 0)) {
+#if defined(USE_JPEG)
+		return &jpeg_decoder;
+#else
+		return NULL;
+#endif
+	} else if ((strcmp(ext, "pkm") == 0) || (strcmp(ext, "ktx") == 0)) {
+		return &etc1_decoder;
+	} else {
+		return NULL;
+	}
+}
+
+const char* filename_ext(const char filename[])
+{
+	int len = strlen(filename);
+	int i;
+	for (i = 0; i < len; i++) {
+		if (filename[len - i - 1] == '.') {
+			return &filename[len - i];
+		}
+	}
+	return NULL;
+}
+
+// encoded images in memory are recognized by their signature
+static const struct image_decoder* sniff_decoder(const unsigned char* data, size_t size)
+{
+	if ((size >= 2) && (data[0] == 'B') && (data[1] == 'M')) {
+		return &bmp_decoder;
+	}
+#if defined(USE_PNG)
+	if ((size >= 8) && (png_sig_cmp((png_const_bytep)data, 0, 8) == 0)) {
+		return &png_decoder;
+	}
+#endif
+#if defined(USE_JPEG)
+	if ((size >= 3) && (data[0] == 0xff) && (data[1] == 0xd8) && (data[2] == 0xff)) {
+		return &jpeg_decoder;
+	}
+#endif
+	if (is_etc1_file(data, size)) {
+		return &etc1_decoder;
+	}
+	return NULL;
+}
+
+// the whole file, mapped read-only; files that cannot be mapped are read
+static const unsigned char* map_file(const char file[], size_t* size, void** mapping, void** buffer)
+{
+	*mapping = NULL;
+	*buffer = NULL;
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+		close(fd);
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+
+	void* p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED) {
+		close(fd);
+		*mapping = p;
+		return (const unsigned char*)p;
+	}
+
+	unsigned char* data = (unsigned char*)malloc(*size);
+	size_t done = 0;
+	while ((data != NULL) && (done < *size)) {
+		ssize_t n = read(fd, data + done, *size - done);
+		if (n <= 0) {
+			free(data);
+			data = NULL;
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+	*buffer = data;
+	return data;
+}
+
+static void unmap_file(size_t size, void* mapping, void* buffer)
+{
+	if (mapping != NULL) {
+		munmap(mapping, size);
+	}
+	free(buffer);
+}
+
+static struct ugles2_image* open_image_data(const struct image_decoder* decoder, const unsigned char* data, size_t size
+	, void* mapping, void* buffer)
+{
+	struct ugles2_image* image = (struct ugles2_image*)malloc(sizeof(struct ugles2_image));
+	if (image == NULL) {
+		unmap_file(size, mapping, buffer);
+		return NULL;
+	}
+	memset(image, 0, sizeof(*image));
+	image->decoder = decoder;
+	image->data    = data;
+	image->size    = size;
+	image->mapping = mapping;
+	image->buffer  = buffer;
+
+	if (decoder->open(image) != 0) {
+		ugles2_close_image(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+void* ugles2_open_image(const char file[])
+{
+	if ((file == NULL) || (strlen(file) < 4)) {
+		return NULL;
+	}
+
+	const struct image_decoder* decoder = get_decoder(filename_ext(file));
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	size_t size;
+	void* mapping;
+	void* buffer;
+	const unsigned char* data = map_file(file, &size, &mapping, &buffer);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	return open_image_data(decoder, data, size, mapping, buffer);
+}
+
+void* ugles2_open_memory_image(const void* buf, unsigned size)
+{
+	if (buf == NULL) {
+		return NULL;
+	}
+	const struct image_decoder* decoder = sniff_decoder((const unsigned char*)buf, size);
+	if (decoder == NULL) {
+		return NULL;
+	}
+
+	return open_image_data(decoder, (const unsigned char*)buf, size, NULL, NULL);
+}
+
+int ugles2_image_size(void* image, int* width, int* height)
+{
+	struct ugles2_image* img = (struct ugles2_image*)image;
+	if (img == NULL) {
+		return -1;
+	}
+
+	if (width != NULL) {
+		*width = img->width;
+	}
+	if (height != NULL) {
+		*height = img->height;
+	}
+
+	return 0;
+}
+
+GLubyte* ugles2_decode_image(void* image, GLubyte* pixels)
+{
+	struct ugles2_image* img = (struct ugles2_image*)image;
+	if (img == NULL) {
+		return NULL;
+	}
+
+	if (img->decoded) {
+		// the stream has been consumed; only the library-owned result can be handed out again
+		return (pixels == NULL)? img->pixels : NULL;
+	}
+
+	if (pixels == NULL) {
+		size_t size = rgba_size(img->width, img->height);
+		img->pixels = (size != 0)? (GLubyte*)malloc(size) : NULL;
+		if (img->pixels == NULL) {
+			return NULL;
+		}
+		pixels = img->pixels;
+	}
+
+	img->decoded = 1;
+	if (img->decoder->decode(img, pixels) != 0) {
+		return NULL;
+	}
+
+	return pixels;
+}
+
+void ugles2_close_image(void* image)
+{
+	struct ugles2_image* img = (struct ugles2_image*)image;
+	if (img == NULL) {
+		return;
+	}
+
+	img->decoder->close(img);
+
+	if (img->pixels != NULL) {
+		free(img->pixels);
+	}
+	unmap_file(img->size, img->mapping, img->buffer);
+	free(img);
+}
+
+GLuint ugles2_load_texture(const char file[])
+{
+	return ugles2_load_texture_with_options(file, NULL, NULL);
+}
+
+int ugles2_load_size(int* width, int* height, const char file[])
+{
+	void* image = ugles2_open_image(file);
+	if (image == NULL) {
+		return -1;
+	}
+
+	ugles2_image_size(image, width, height);
+	ugles2_close_image(image);
+
+	return 0;
+}
+
+int ugles2_load_pixels(GLubyte* pixels, int width, int height, const char file[])
+{
+	void* image = ugles2_open_image(file);
+	if (image == NULL) {
+		return -1;
+	}
+
+	int res = 0;
+	struct ugles2_image* img = (struct ugles2_image*)image;
+	if ((img->width != width) || (img->height != height)) {
+		res = -1;
+	} else if (ugles2_decode_image(image, pixels) == NULL) {
+		res = -1;
+	}
+
+	ugles2_close_image(image);
+
+	return res;
+}
+
+// texture formats: decoded RGBA is converted row by row at upload. quantizing
+// is floor((v * max + d) / 255) with d = 127 (rounding) or a 4x4 Bayer offset.
+
+struct texture_format {
+	GLenum format;
+	GLenum type;
+	int    bytes;	// per pixel
+};
+
+static const struct texture_format texture_formats[] = {
+	{ GL_RGBA,            GL_UNSIGNED_BYTE,          4 },	// UGLES2_FORMAT_RGBA
+	{ GL_RGB,             GL_UNSIGNED_SHORT_5_6_5,   2 },	// UGLES2_FORMAT_RGB565
+	{ GL_RGBA,            GL_UNSIGNED_SHORT_4_4_4_4, 2 },	// UGLES2_FORMAT_RGBA4444
+	{ GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE,          2 },	// UGLES2_FORMAT_LUMINANCE_ALPHA
+	{ GL_LUMINANCE,       GL_UNSIGNED_BYTE,          1 },	// UGLES2_FORMAT_LUMINANCE
+	{ GL_ALPHA,           GL_UNSIGNED_BYTE,          1 },	// UGLES2_FORMAT_ALPHA
+};
+
+static const unsigned char bayer4[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+// offsets for row y, indexed by x & 3
+static void dither_offsets(unsigned short d[4], int y, int dither)
+{
+	int i;
+	for (i = 0; i < 4; i++) {
+		d[i] = dither? ((2 * bayer4[y & 3][i] + 1) * 255) / 32 : 127;
+	}
+}
+
+static inline unsigned quantize(unsigned v, unsigned max, unsigned d)
+{
+	return (v * max + d) / 255;
+}
+
+static inline unsigned luma(const GLubyte* p)
+{
+	return (p[0] * 77 + p[1] * 150 + p[2] * 29 + 128) >> 8;
+}
+
+static void convert_row_scalar(void* dst, const GLubyte* src, int x, int n, int format, const unsigned short d[4])
+{
+	unsigned short* dst16 = (unsigned short*)dst;
+	GLubyte* dst8 = (GLubyte*)dst;
+	int i;
+	for (i = x; i < x + n; i++) {
+		const GLubyte* p = &src[i*4];
+		unsigned o = d[i & 3];
+		switch (format) {
+		case UGLES2_FORMAT_RGB565:
+			dst16[i] = quantize(p[0], 31, o) << 11 | quantize(p[1], 63, o) << 5 | quantize(p[2], 31, o);
+			break;
+		case UGLES2_FORMAT_RGBA4444:
+			dst16[i] = quantize(p[0], 15, o) << 12 | quantize(p[1], 15, o) << 8 | quantize(p[2], 15, o) << 4 | quantize(p[3], 15, o);
+			break;
+		case UGLES2_FORMAT_LUMINANCE_ALPHA:
+			dst8[i*2  ] = luma(p);
+			dst8[i*2+1] = p[3];
+			break;
+		case UGLES2_FORMAT_LUMINANCE:
+			dst8[i] = luma(p);
+			break;
+		case UGLES2_FORMAT_ALPHA:
+			dst8[i] = p[3];
+			break;
+		}
+	}
+}
+
+#if defined(__SSE2__) && !defined(UGLES2_NO_SIMD)
+#include <emmintrin.h>
+
+// floor(t / 255), exact for the t < 16384 the formats produce
+static inline __m128i quantize_epi16(__m128i v, int max, __m128i d)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(max)), d);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(1)), _mm_srli_epi16(t, 8)), 8);
+}
+
+// 8 pixels per step; returns the pixels converted
+static int convert_row_simd(void* dst, const GLubyte* src, int n, int format, const unsigned short d[4])
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i dv = _mm_set_epi16(d[3], d[2], d[1], d[0], d[3], d[2], d[1], d[0]);
+	unsigned short* dst16 = (unsigned short*)dst;
+	GLubyte* dst8 = (GLubyte*)dst;
+
+	int i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i p0 = _mm_loadu_si128((const __m128i*)&src[i*4]);
+		__m128i p1 = _mm_loadu_si128((const __m128i*)&src[i*4+16]);
+		__m128i r = _mm_packs_epi32(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+		__m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), mask), _mm_and_si128(_mm_srli_epi32(p1, 8), mask));
+		__m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), mask), _mm_and_si128(_mm_srli_epi32(p1, 16), mask));
+		__m128i a = _mm_packs_epi32(_mm_srli_epi32(p0, 24), _mm_srli_epi32(p1, 24));
+		__m128i l, out;
+
+		switch (format) {
+		case UGLES2_FORMAT_RGB565:
+			out = _mm_or_si128(_mm_slli_epi16(quantize_epi16(r, 31, dv), 11)
+				, _mm_or_si128(_mm_slli_epi16(quantize_epi16(g, 63, dv), 5), quantize_epi16(b, 31, dv)));
+			_mm_storeu_si128((__m128i*)&dst16[i], out);
+			break;
+		case UGLES2_FORMAT_RGBA4444:
+			out = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(quantize_epi16(r, 15, dv), 12), _mm_slli_epi16(quantize_epi16(g, 15, dv), 8))
+				, _mm_or_si128(_mm_slli_epi16(quantize_epi16(b, 15, dv), 4), quantize_epi16(a, 15, dv)));
+			_mm_storeu_si128((__m128i*)&dst16[i], out);
+			break;
+		case UGLES2_FORMAT_LUMINANCE_ALPHA:
+		case UGLES2_FORMAT_LUMINANCE:
+			l = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)), _mm_mullo_epi16(g, _mm_set1_epi16(150)))
+				, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(29)), _mm_set1_epi16(128)));
+			l = _mm_srli_epi16(l, 8);
+			if (format == UGLES2_FORMAT_LUMINANCE) {
+				_mm_storel_epi64((__m128i*)&dst8[i], _mm_packus_epi16(l, l));
+			} else {
+				_mm_storeu_si128((__m128i*)&dst8[i*2], _mm_or_si128(l, _mm_slli_epi16(a, 8)));
+			}
+			break;
+		case UGLES2_FORMAT_ALPHA:
+			_mm_storel_epi64((__m128i*)&dst8[i], _mm_packus_epi16(a, a));
+			break;
+		}
+	}
+
+	return i;
+}
+
+#elif defined(__ARM_NEON__) && !defined(UGLES2_NO_SIMD)
+#include <arm_neon.h>
+
+static inline uint16x8_t quantize_u16(uint8x8_t v, int max, uint16x8_t d)
+{
+	uint16x8_t t = vmlal_u8(d, v, vdup_n_u8(max));
+	return vshrq_n_u16(vaddq_u16(vaddq_u16(t, vdupq_n_u16(1)), vshrq_n_u16(t, 8)), 8);
+}
+
+static int convert_row_simd(void* dst, const GLubyte* src, int n, int format, const unsigned short d[4])
+{
+	const uint16_t lanes[8] = { d[0], d[1], d[2], d[3], d[0], d[1], d[2], d[3] };
+	const uint16x8_t dv = vld1q_u16(lanes);
+	unsigned short* dst16 = (unsigned short*)dst;
+	GLubyte* dst8 = (GLubyte*)dst;
+
+	int i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint8x8x4_t p = vld4_u8(&src[i*4]);
+		uint16x8_t l, out;
+		uint8x8x2_t la;
+
+		switch (format) {
+		case UGLES2_FORMAT_RGB565:
+			out = vorrq_u16(vshlq_n_u16(quantize_u16(p.val[0], 31, dv), 11)
+				, vorrq_u16(vshlq_n_u16(quantize_u16(p.val[1], 63, dv), 5), quantize_u16(p.val[2], 31, dv)));
+			vst1q_u16(&dst16[i], out);
+			break;
+		case UGLES2_FORMAT_RGBA4444:
+			out = vorrq_u16(vorrq_u16(vshlq_n_u16(quantize_u16(p.val[0], 15, dv), 12), vshlq_n_u16(quantize_u16(p.val[1], 15, dv), 8))
+				, vorrq_u16(vshlq_n_u16(quantize_u16(p.val[2], 15, dv), 4), quantize_u16(p.val[3], 15, dv)));
+			vst1q_u16(&dst16[i], out);
+			break;
+		case UGLES2_FORMAT_LUMINANCE_ALPHA:
+		case UGLES2_FORMAT_LUMINANCE:
+			l = vmlal_u8(vmull_u8(p.val[0], vdup_n_u8(77)), p.val[1], vdup_n_u8(150));
+			l = vaddq_u16(vmlal_u8(l, p.val[2], vdup_n_u8(29)), vdupq_n_u16(128));
+			if (format == UGLES2_FORMAT_LUMINANCE) {
+				vst1_u8(&dst8[i], vshrn_n_u16(l, 8));
+			} else {
+				la.val[0] = vshrn_n_u16(l, 8);
+				la.val[1] = p.val[3];
+				vst2_u8(&dst8[i*2], la);
+			}
+			break;
+		case UGLES2_FORMAT_ALPHA:
+			vst1_u8(&dst8[i], p.val[3]);
+			break;
+		}
+	}
+
+	return i;
+}
+
+#else
+
+static int convert_row_simd(void* dst, const GLubyte* src, int n, int format, const unsigned short d[4])
+{
+	return 0;
+}
+#endif
+
+static void convert_pixels(void* dst, const GLubyte* src, int width, int height, int format, int dither)
+{
+	const struct texture_format* f = &texture_formats[format];
+	int j;
+	for (j = 0; j < height; j++) {
+		unsigned short d[4];
+		dither_offsets(d, j, dither);
+		GLubyte* out = (GLubyte*)dst + (size_t)j * width * f->bytes;
+		const GLubyte* in = src + (size_t)j * width * 4;
+		int done = convert_row_simd(out, in, width, format, d);
+		convert_row_scalar(out, in, done, width - done, format, d);
+	}
+}
+
+// opaque gray is luminance, gray is luminance alpha, opaque color is 565
+static int choose_texture_format(const GLubyte* pixels, int width, int height)
+{
+	int opaque = 1;
+	int gray = 1;
+	size_t i;
+	size_t n = (size_t)width * height;
+	for (i = 0; (i < n) && (opaque || gray); i++) {
+		const GLubyte* p = &pixels[i*4];
+		opaque &= (p[3] == 255);
+		gray &= (p[0] == p[1]) && (p[1] == p[2]);
+	}
+	if (gray) {
+		return opaque? UGLES2_FORMAT_LUMINANCE : UGLES2_FORMAT_LUMINANCE_ALPHA;
+	}
+	return opaque? UGLES2_FORMAT_RGB565 : UGLES2_FORMAT_RGBA;
+}
+
+// converts into scratch (large enough for the level) unless the format is RGBA;
+// returns the bytes uploaded
+static unsigned long upload_level(int level, const GLubyte* pixels, int width, int height
+	, int format, int dither, void* scratch)
+{
+	const struct texture_format* f = &texture_formats[format];
+	const void* data = pixels;
+	if ((pixels != NULL) && (format != UGLES2_FORMAT_RGBA)) {
+		convert_pixels(scratch, pixels, width, height, format, dither);
+		data = scratch;
+	}
+	glTexImage2D(GL_TEXTURE_2D, level, f->format, width, height, 0, f->format, f->type, data);
+
+	return (unsigned long)width * height * f->bytes;
+}
+
+void ugles2_init_texture_options(struct ugles2_texture_options* options)
+{
+	options->min_filter = GL_NEAREST;
+	options->mag_filter = GL_NEAREST;
+	options->wrap_s     = GL_REPEAT;
+	options->wrap_t     = GL_REPEAT;
+	options->mipmap     = UGLES2_MIPMAP_NONE;
+	options->npot       = UGLES2_NPOT_KEEP;
+	options->format     = UGLES2_FORMAT_RGBA;
+	options->dither     = 0;
+}
+
+static int is_power_of_two(int n)
+{
+	return (n & (n - 1)) == 0;
+}
+
+static int next_power_of_two(int n)
+{
+	int p = 1;
+	while (p < n) {
+		p <<= 1;
+	}
+	return p;
+}
+
+// GLES 2 without GL_OES_texture_npot samples NPOT textures only when they are
+// clamped and not mipmapped
+static int has_full_npot()
+{
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if ((version != NULL) && (strncmp(version, "OpenGL ES ", 10) == 0) && (version[10] >= '3')) {
+		return 1;
+	}
+	return has_gl_extension("GL_OES_texture_npot");
+}
+
+// the image goes top-left, its last column and row are repeated so filtering
+// at its edges does not pull in the padding
+static void pad_pixels(const GLubyte* src, int width, int height, GLubyte* dst, int dst_width, int dst_height)
+{
+	int i, j;
+	for (j = 0; j < dst_height; j++) {
+		const GLubyte* s = src + (size_t)((j < height)? j : height - 1) * width * 4;
+		GLubyte* d = dst + (size_t)j * dst_width * 4;
+		memcpy(d, s, width * 4);
+		for (i = width; i < dst_width; i++) {
+			memcpy(d + i*4, s + (width - 1)*4, 4);
+		}
+	}
+}
+
+// bilinear, sampling at pixel centers
+static void resize_pixels(const GLubyte* src, int width, int height, GLubyte* dst, int dst_width, int dst_height)
+{
+	int i, j, c;
+	for (j = 0; j < dst_height; j++) {
+		float fy = (j + 0.5f) * height / dst_height - 0.5f;
+		if (fy < 0.0f) {
+			fy = 0.0f;
+		}
+		int y0 = (int)fy;
+		int y1 = (y0 + 1 < height)? y0 + 1 : y0;
+		float wy = fy - y0;
+		for (i = 0; i < dst_width; i++) {
+			float fx = (i + 0.5f) * width / dst_width - 0.5f;
+			if (fx < 0.0f) {
+				fx = 0.0f;
+			}
+			int x0 = (int)fx;
+			int x1 = (x0 + 1 < width)? x0 + 1 : x0;
+			float wx = fx - x0;
+			const GLubyte* p00 = src + ((size_t)y0 * width + x0) * 4;
+			const GLubyte* p01 = src + ((size_t)y0 * width + x1) * 4;
+			const GLubyte* p10 = src + ((size_t)y1 * width + x0) * 4;
+			const GLubyte* p11 = src + ((size_t)y1 * width + x1) * 4;
+			for (c = 0; c < 4; c++) {
+				float top    = p00[c] + (p01[c] - p00[c]) * wx;
+				float bottom = p10[c] + (p11[c] - p10[c]) * wx;
+				dst[((size_t)j * dst_width + i) * 4 + c] = (GLubyte)(top + (bottom - top) * wy + 0.5f);
+			}
+		}
+	}
+}
+
+static float srgb_to_linear_table[256];
+static GLubyte linear_to_srgb_table[4096];
+static pthread_once_t srgb_tables_once = PTHREAD_ONCE_INIT;
+
+static void init_srgb_tables()
+{
+	int i;
+	for (i = 0; i < 256; i++) {
+		float c = i / 255.0f;
+		srgb_to_linear_table[i] = (c <= 0.04045f)? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+	for (i = 0; i < 4096; i++) {
+		float l = i / 4095.0f;
+		float c = (l <= 0.0031308f)? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+		linear_to_srgb_table[i] = (GLubyte)(c * 255.0f + 0.5f);
+	}
+}
+
+// next level by a 2x2 box; odd sizes clamp the last row and column
+static void downsample_pixels(const GLubyte* src, int width, int height, GLubyte* dst, int dst_width, int dst_height, int gamma)
+{
+	int i, j, c;
+	for (j = 0; j < dst_height; j++) {
+		int y0 = j * 2;
+		int y1 = (y0 + 1 < height)? y0 + 1 : y0;
+		for (i = 0; i < dst_width; i++) {
+			int x0 = i * 2;
+			int x1 = (x0 + 1 < width)? x0 + 1 : x0;
+			const GLubyte* p[4] = {
+				src + ((size_t)y0 * width + x0) * 4,
+				src + ((size_t)y0 * width + x1) * 4,
+				src + ((size_t)y1 * width + x0) * 4,
+				src + ((size_t)y1 * width + x1) * 4,
+			};
+			GLubyte* d = dst + ((size_t)j * dst_width + i) * 4;
+			for (c = 0; c < 3; c++) {
+				if (gamma) {
+					float l = srgb_to_linear_table[p[0][c]] + srgb_to_linear_table[p[1][c]]
+						+ srgb_to_linear_table[p[2][c]] + srgb_to_linear_table[p[3][c]];
+					d[c] = linear_to_srgb_table[(int)(l * (4095.0f / 4.0f) + 0.5f)];
+				} else {
+					d[c] = (p[0][c] + p[1][c] + p[2][c] + p[3][c] + 2) >> 2;
+				}
+			}
+			d[3] = (p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) >> 2;
+		}
+	}
+}
+
+static int upload_cpu_mipmaps(GLubyte* pixels, int width, int height, int gamma
+	, int format, int dither, void* scratch, unsigned long* bytes)
+{
+	if (gamma) {
+		pthread_once(&srgb_tables_once, init_srgb_tables);
+	}
+
+	GLubyte* level_pixels = (GLubyte*)malloc((size_t)((width + 1) / 2) * ((height + 1) / 2) * 4);
+	if (level_pixels == NULL) {
+		return -1;
+	}
+
+	// each level is built from the previous one, in place of the source buffer
+	int level = 0;
+	while ((width > 1) || (height > 1)) {
+		int w = (width > 1)? width / 2 : 1;
+		int h = (height > 1)? height / 2 : 1;
+		downsample_pixels(pixels, width, height, level_pixels, w, h, gamma);
+		memcpy(pixels, level_pixels, (size_t)w * h * 4);
+		level++;
+		*bytes += upload_level(level, pixels, w, h, format, dither, scratch);
+		width = w;
+		height = h;
+	}
+	free(level_pixels);
+
+	return 0;
+}
+
+static int is_mipmap_filter(GLenum filter)
+{
+	return (filter != GL_NEAREST) && (filter != GL_LINEAR);
+}
+
+// the options, or the defaults without them; mipmaps always get a mipmap min filter
+static void copy_texture_options(struct ugles2_texture_options* o, const struct ugles2_texture_options* options)
+{
+	if (options != NULL) {
+		*o = *options;
+	} else {
+		ugles2_init_texture_options(o);
+	}
+	if ((o->mipmap != UGLES2_MIPMAP_NONE) && !is_mipmap_filter(o->min_filter)) {
+		o->min_filter = GL_LINEAR_MIPMAP_LINEAR;
+	}
+}
+
+GLuint ugles2_create_texture_with_options(const GLubyte pixels[], int width, int height
+	, const struct ugles2_texture_options* options, struct ugles2_texture_info* info)
+{
+	struct ugles2_texture_options o;
+	copy_texture_options(&o, options);
+
+	// sizes the driver cannot sample (or mipmap) are padded or resized to a power of two,
+	// or the texture falls back to clamped, single level sampling
+	int w = width;
+	int h = height;
+	int restricted = (!is_power_of_two(width) || !is_power_of_two(height))
+		&& ((o.mipmap != UGLES2_MIPMAP_NONE) || (o.wrap_s != GL_CLAMP_TO_EDGE) || (o.wrap_t != GL_CLAMP_TO_EDGE))
+		&& !has_full_npot();
+	if (restricted) {
+		if ((o.npot == UGLES2_NPOT_PAD) || (o.npot == UGLES2_NPOT_RESIZE)) {
+			w = next_power_of_two(width);
+			h = next_power_of_two(height);
+		} else if (o.npot == UGLES2_NPOT_CLAMP) {
+			o.mipmap = UGLES2_MIPMAP_NONE;
+			o.min_filter = ((o.min_filter == GL_NEAREST) || (o.min_filter == GL_NEAREST_MIPMAP_NEAREST)
+				|| (o.min_filter == GL_NEAREST_MIPMAP_LINEAR))? GL_NEAREST : GL_LINEAR;
+			o.wrap_s = GL_CLAMP_TO_EDGE;
+			o.wrap_t = GL_CLAMP_TO_EDGE;
+		}
+	}
+
+	// CPU mipmaps are built in a copy, as are padded and resized images
+	GLubyte* copy = NULL;
+	if ((pixels != NULL) && ((w != width) || (h != height)
+		|| (o.mipmap == UGLES2_MIPMAP_BOX) || (o.mipmap == UGLES2_MIPMAP_GAMMA))) {
+		copy = (GLubyte*)malloc((size_t)w * h * 4);
+		if (copy == NULL) {
+			return 0;
+		}
+		if ((w == width) && (h == height)) {
+			memcpy(copy, pixels, (size_t)w * h * 4);
+		} else if (o.npot == UGLES2_NPOT_PAD) {
+			pad_pixels(pixels, width, height, copy, w, h);
+		} else {
+			resize_pixels(pixels, width, height, copy, w, h);
+		}
+	}
+
+	const GLubyte* level0 = (copy != NULL)? copy : pixels;
+	int format = o.format;
+	if ((format == UGLES2_FORMAT_AUTO) && (level0 != NULL)) {
+		format = choose_texture_format(level0, w, h);
+	}
+	if ((format < 0) || (format >= (int)(sizeof(texture_formats) / sizeof(texture_formats[0])))) {
+		format = UGLES2_FORMAT_RGBA;
+	}
+	void* scratch = NULL;
+	if ((level0 != NULL) && (format != UGLES2_FORMAT_RGBA)) {
+		scratch = malloc((size_t)w * h * texture_formats[format].bytes);
+		if (scratch == NULL) {
+			free(copy);
+			return 0;
+		}
+	}
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	// converted rows are tightly packed
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	unsigned long bytes = upload_level(0, level0, w, h, format, o.dither, scratch);
+	if (o.mipmap == UGLES2_MIPMAP_GL) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+	} else if ((o.mipmap == UGLES2_MIPMAP_BOX) || (o.mipmap == UGLES2_MIPMAP_GAMMA)) {
+		if ((copy == NULL) || (upload_cpu_mipmaps(copy, w, h, o.mipmap == UGLES2_MIPMAP_GAMMA, format, o.dither, scratch, &bytes) != 0)) {
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+	free(scratch);
+	free(copy);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, o.min_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, o.mag_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, o.wrap_s);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, o.wrap_t);
+
+	if (info != NULL) {
+		info->width  = w;
+		info->height = h;
+		info->format = texture_formats[format].format;
+		info->type   = texture_formats[format].type;
+		info->bytes  = bytes;
+	}
+
+	return texture;
+}
+
+GLuint ugles2_create_texture(const GLubyte pixels[], int width, int height)
+{
+	return ugles2_create_texture_with_options(pixels, width, height, NULL, NULL);
+}
+
+// levels go up as they are stored, straight from the encoded data; without
+// the extension the file is decoded like any other image instead
+static GLuint upload_etc1_texture(const unsigned char* data, size_t size
+	, const struct ugles2_texture_options* options, struct ugles2_texture_info* info)
+{
+	struct etc1_file etc1;
+	if ((read_etc1_header(data, size, &etc1) != 0) || !has_gl_extension("GL_OES_compressed_ETC1_RGB8_texture")) {
+		return 0;
+	}
+	GLint max_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	if ((etc1.width > max_size) || (etc1.height > max_size)) {
+		return 0;
+	}
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	unsigned long bytes = 0;
+	size_t offset = etc1.data;
+	int w = etc1.width;
+	int h = etc1.height;
+	int complete = 0;	// the stored chain goes down to 1x1
+	int level;
+	for (level = 0; level < etc1.levels; level++) {
+		const unsigned char* level_data = etc1_level(data, size, &etc1, &offset, w, h);
+		if (level_data == NULL) {
+			break;
+		}
+		size_t level_size = ugles2_etc1_size(w, h);
+		glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_ETC1_RGB8_OES, w, h, 0, (GLsizei)level_size, level_data);
+		bytes += level_size;
+		complete = (w == 1) && (h == 1);
+		w = (w > 1)? w / 2 : 1;
+		h = (h > 1)? h / 2 : 1;
+	}
+
+	if (level == 0) {
+		glDeleteTextures(1, &texture);
+		return 0;
+	}
+
+	// compressed levels cannot be generated, so the stored chain is all there is
+	struct ugles2_texture_options o;
+	if (options != NULL) {
+		o = *options;
+	} else {
+		ugles2_init_texture_options(&o);
+	}
+	if (!complete) {
+		o.min_filter = ((o.min_filter == GL_NEAREST) || (o.min_filter == GL_NEAREST_MIPMAP_NEAREST)
+			|| (o.min_filter == GL_NEAREST_MIPMAP_LINEAR))? GL_NEAREST : GL_LINEAR;
+	} else if ((o.mipmap != UGLES2_MIPMAP_NONE) && !is_mipmap_filter(o.min_filter)) {
+		o.min_filter = GL_LINEAR_MIPMAP_LINEAR;
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, o.min_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, o.mag_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, o.wrap_s);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, o.wrap_t);
+
+	if (info != NULL) {
+		info->width  = etc1.width;
+		info->height = etc1.height;
+		info->format = GL_ETC1_RGB8_OES;
+		info->type   = 0;
+		info->bytes  = bytes;
+	}
+
+	return texture;
+}
+
+static GLuint load_etc1_texture(const char file[], const struct ugles2_texture_options* options
+	, struct ugles2_texture_info* info)
+{
+	const char* ext = filename_ext(file);
+	if ((ext == NULL) || ((strcmp(ext, "pkm") != 0) && (strcmp(ext, "ktx") != 0))) {
+		return 0;
+	}
+
+	size_t size;
+	void* mapping;
+	void* buffer;
+	const unsigned char* data = map_file(file, &size, &mapping, &buffer);
+	if (data == NULL) {
+		return 0;
+	}
+	GLuint texture = upload_etc1_texture(data, size, options, info);
+	unmap_file(size, mapping, buffer);
+
+	return texture;
+}
+
+static GLuint load_texture_file(const char file[], const struct ugles2_texture_options* options
+	, struct ugles2_texture_info* info)
+{
+	GLuint texture = load_etc1_texture(file, options, info);
+	if (texture != 0) {
+		return texture;
+	}
+
+	void* image = ugles2_open_image(file);
+	if (image == NULL) {
+		return 0;
+	}
+
+	int width;
+	int height;
+	ugles2_image_size(image, &width, &height);
+
+	GLubyte* pixels = ugles2_decode_image(image, NULL);
+	if (pixels == NULL) {
+		ugles2_close_image(image);
+		return 0;
+	}
+
+	texture = ugles2_create_texture_with_options(pixels, width, height, options, info);
+
+	ugles2_close_image(image);
+
+	return texture;
+}
+
+static GLuint load_memory_texture(const void* buf, unsigned size, const struct ugles2_texture_options* options
+	, struct ugles2_texture_info* info)
+{
+	GLuint texture = upload_etc1_texture((const unsigned char*)buf, size, options, info);
+	if (texture != 0) {
+		return texture;
+	}
+
+	void* image = ugles2_open_memory_image(buf, size);
+	if (image == NULL) {
+		return 0;
+	}
+
+	int width;
+	int height;
+	ugles2_image_size(image, &width, &height);
+
+	GLubyte* pixels = ugles2_decode_image(image, NULL);
+	if (pixels != NULL) {
+		texture = ugles2_create_texture_with_options(pixels, width, height, options, info);
+	}
+
+	ugles2_close_image(image);
+
+	return texture;
+}
+
+GLuint ugles2_load_texture_with_options(const char file[], const struct ugles2_texture_options* options
+	, struct ugles2_texture_info* info)
+{
+	struct texture_cache* cache = current_texture_cache();
+	if (cache == NULL) {
+		return load_texture_file(file, options, info);
+	}
+
+	uint64_t key = texture_key(file, NULL, 0, options);
+	struct cached_texture* t = find_cached_texture(cache, key, file, 0);
+	if (t != NULL) {
+		return use_cached_texture(cache, t, info);
+	}
+
+	struct ugles2_texture_info i;
+	GLuint texture = load_texture_file(file, options, &i);
+	if (texture != 0) {
+		store_cached_texture(cache, key, file, 0, options, texture, &i);
+		if (info != NULL) {
+			*info = i;
+		}
+	}
+	return texture;
+}
+
+GLuint ugles2_load_memory_texture(const void* buf, unsigned size)
+{
+	struct texture_cache* cache = current_texture_cache();
+	if (cache == NULL) {
+		return load_memory_texture(buf, size, NULL, NULL);
+	}
+
+	uint64_t key = texture_key(NULL, buf, size, NULL);
+	struct cached_texture* t = find_cached_texture(cache, key, NULL, size);
+	if (t != NULL) {
+		return use_cached_texture(cache, t, NULL);
+	}
+
+	struct ugles2_texture_info i;
+	GLuint texture = load_memory_texture(buf, size, NULL, &i);
+	if (texture != 0) {
+		store_cached_texture(cache, key, NULL, size, NULL, texture, &i);
+	}
+	return texture;
+}
+
+int ugles2_write_pkm(const char file[], const GLubyte* pixels, int width, int height)
+{
+	if ((width <= 0) || (height <= 0) || (width > 0xffff) || (height > 0xffff)) {
+		return -1;
+	}
+	size_t size = ugles2_etc1_size(width, height);
+	void* data = malloc(size);
+	if (data == NULL) {
+		return -1;
+	}
+	ugles2_encode_etc1(pixels, width, height, data);
+
+	unsigned char header[16] = { 'P', 'K', 'M', ' ', '1', '0', 0, 0 };
+	int padded_width  = (width + 3) & ~3;
+	int padded_height = (height + 3) & ~3;
+	header[8]  = padded_width >> 8;
+	header[9]  = padded_width;
+	header[10] = padded_height >> 8;
+	header[11] = padded_height;
+	header[12] = width >> 8;
+	header[13] = width;
+	header[14] = height >> 8;
+	header[15] = height;
+
+	int res = -1;
+	FILE* fp = fopen(file, "wb");
+	if (fp != NULL) {
+		if ((fwrite(header, sizeof(header), 1, fp) == 1) && (fwrite(data, size, 1, fp) == 1)) {
+			res = 0;
+		}
+		if (fclose(fp) != 0) {
+			res = -1;
+		}
+	}
+	free(data);
+
+	return res;
+}
+
+// mipmap: UGLES2_MIPMAP_NONE, or a CPU filter (UGLES2_MIPMAP_BOX, UGLES2_MIPMAP_GAMMA)
+int ugles2_write_ktx(const char file[], const GLubyte* pixels, int width, int height, int mipmap)
+{
+	static const unsigned char ktx_id[12] = { 0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n' };
+	if ((width <= 0) || (height <= 0) || (width > ETC1_MAX_SIZE) || (height > ETC1_MAX_SIZE)) {
+		return -1;
+	}
+
+	int levels = 1;
+	if (mipmap != UGLES2_MIPMAP_NONE) {
+		int w = width;
+		int h = height;
+		while ((w > 1) || (h > 1)) {
+			w = (w > 1)? w / 2 : 1;
+			h = (h > 1)? h / 2 : 1;
+			levels++;
+		}
+	}
+	int gamma = (mipmap == UGLES2_MIPMAP_GAMMA);
+	if (gamma) {
+		pthread_once(&srgb_tables_once, init_srgb_tables);
+	}
+
+	unsigned char header[KTX_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	memcpy(header, ktx_id, sizeof(ktx_id));
+	put_u32(header + 12, 0x04030201);
+	put_u32(header + 20, 1);				// glTypeSize
+	put_u32(header + 28, GL_ETC1_RGB8_OES);
+	put_u32(header + 32, GL_RGB);
+	put_u32(header + 36, width);
+	put_u32(header + 40, height);
+	put_u32(header + 52, 1);				// faces
+	put_u32(header + 56, levels);
+
+	GLubyte* level_pixels = (GLubyte*)malloc((size_t)width * height * 4);
+	GLubyte* next_pixels  = (GLubyte*)malloc((size_t)((width + 1) / 2) * ((height + 1) / 2) * 4);
+	void* data = malloc(ugles2_etc1_size(width, height));
+	FILE* fp = fopen(file, "wb");
+	int res = -1;
+	if ((level_pixels != NULL) && (next_pixels != NULL) && (data != NULL) && (fp != NULL)
+		&& (fwrite(header, sizeof(header), 1, fp) == 1)) {
+		memcpy(level_pixels, pixels, (size_t)width * height * 4);
+		int w = width;
+		int h = height;
+		int level;
+		for (level = 0; level < levels; level++) {
+			if (level > 0) {
+				int next_w = (w > 1)? w / 2 : 1;
+				int next_h = (h > 1)? h / 2 : 1;
+				downsample_pixels(level_pixels, w, h, next_pixels, next_w, next_h, gamma);
+				memcpy(level_pixels, next_pixels, (size_t)next_w * next_h * 4);
+				w = next_w;
+				h = next_h;
+			}
+			unsigned char image_size[4];
+			size_t size = ugles2_etc1_size(w, h);
+			put_u32(image_size, (uint32_t)size);
+			ugles2_encode_etc1(level_pixels, w, h, data);
+			if ((fwrite(image_size, 4, 1, fp) != 1) || (fwrite(data, size, 1, fp) != 1)) {
+				break;
+			}
+		}
+		res = (level == levels)? 0 : -1;
+	}
+	if ((fp != NULL) && (fclose(fp) != 0)) {
+		res = -1;
+	}
+	free(data);
+	free(next_pixels);
+	free(level_pixels);
+
+	return res;
+}
+
+
+// =============================================================================
+// texture atlas
+//
+// images are packed into RGBA pages with a skyline packer: the free space of a
+// page is kept as the list of segments of its top contour, and a rectangle goes
+// where its bottom edge ends lowest. pages are allocated once and every image
+// is uploaded into its rectangle with glTexSubImage2D, so inserting into an
+// existing page never uploads the whole page again. ugles2_atlas_add_images()
+// composites the pages it opens in memory and uploads each of them once.
+
+#define ATLAS_DEFAULT_SIZE 1024
+
+struct skyline_node {
+	int x;
+	int y;
+	int width;
+};
+
+struct atlas_page {
+	GLuint texture;
+	struct skyline_node* nodes;
+	int node_count;
+	GLubyte* staging;	// pixels of a page opened by ugles2_atlas_add_images()
+};
+
+struct texture_atlas {
+	int width;
+	int height;
+	int padding;
+	struct atlas_page* pages;
+	int page_count;
+};
+
+struct atlas_image {
+	int index;
+	int width;
+	int height;
+	GLubyte* pixels;
+};
+
+// the lowest y at which a w wide rectangle fits starting at node i, -1 if none
+static int skyline_fit(const struct atlas_page* page, int i, int w, int h, int width, int height)
+{
+	int x = page->nodes[i].x;
+	if (x + w > width) {
+		return -1;
+	}
+	int y = 0;
+	int left = w;
+	for (; left > 0; i++) {
+		if (page->nodes[i].y > y) {
+			y = page->nodes[i].y;
+		}
+		if (y + h > height) {
+			return -1;
+		}
+		left -= page->nodes[i].width;
+	}
+	return y;
+}
+
+static int skyline_insert(struct atlas_page* page, int width, int height, int w, int h, int* px, int* py)
+{
+	int best = -1;
+	int best_bottom = height + 1;
+	int best_width = width + 1;
+	int i;
+	for (i = 0; i < page->node_count; i++) {
+		int y = skyline_fit(page, i, w, h, width, height);
+		if (y < 0) {
+			continue;
+		}
+		if ((y + h < best_bottom) || ((y + h == best_bottom) && (page->nodes[i].width < best_width))) {
+			best = i;
+			best_bottom = y + h;
+			best_width = page->nodes[i].width;
+		}
+	}
+	if (best < 0) {
+		return -1;
+	}
+
+	// at most one node is added
+	struct skyline_node* nodes = (struct skyline_node*)realloc(page->nodes, sizeof(struct skyline_node) * (page->node_count + 1));
+	if (nodes == NULL) {
+		return -1;
+	}
+	page->nodes = nodes;
+
+	*px = nodes[best].x;
+	*py = best_bottom - h;
+
+	memmove(&nodes[best + 1], &nodes[best], sizeof(struct skyline_node) * (page->node_count - best));
+	page->node_count++;
+	nodes[best].y = best_bottom;
+	nodes[best].width = w;
+
+	// the nodes now under the new one shrink or go away
+	int right = nodes[best].x + w;
+	i = best + 1;
+	while ((i < page->node_count) && (nodes[i].x < right)) {
+		int end = nodes[i].x + nodes[i].width;
+		if (end <= right) {
+			memmove(&nodes[i], &nodes[i + 1], sizeof(struct skyline_node) * (page->node_count - i - 1));
+			page->node_count--;
+		} else {
+			nodes[i].width = end - right;
+			nodes[i].x = right;
+			break;
+		}
+	}
+
+	// neighbours at the same height merge
+	for (i = 0; i + 1 < page->node_count; ) {
+		if (nodes[i].y == nodes[i + 1].y) {
+			nodes[i].width += nodes[i + 1].width;
+			memmove(&nodes[i + 1], &nodes[i + 2], sizeof(struct skyline_node) * (page->node_count - i - 2));
+			page->node_count--;
+		} else {
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+static struct atlas_page* add_atlas_page(struct texture_atlas* atlas, int staged)
+{
+	struct atlas_page* pages = (struct atlas_page*)realloc(atlas->pages, sizeof(struct atlas_page) * (atlas->page_count + 1));
+	if (pages == NULL) {
+		return NULL;
+	}
+	atlas->pages = pages;
+
+	struct atlas_page* page = &pages[atlas->page_count];
+	memset(page, 0, sizeof(*page));
+	page->nodes = (struct skyline_node*)malloc(sizeof(struct skyline_node));
+	GLubyte* zero = (GLubyte*)calloc((size_t)atlas->width * atlas->height, 4);
+	if ((page->nodes == NULL) || (zero == NULL)) {
+		free(page->nodes);
+		free(zero);
+		return NULL;
+	}
+	page->nodes[0].x = 0;
+	page->nodes[0].y = 0;
+	page->nodes[0].width = atlas->width;
+	page->node_count = 1;
+
+	// the padding between images stays transparent
+	glGenTextures(1, &page->texture);
+	glBindTexture(GL_TEXTURE_2D, page->texture);
+	if (staged) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas->width, atlas->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		page->staging = zero;
+	} else {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas->width, atlas->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, zero);
+		free(zero);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	atlas->page_count++;
+	return page;
+}
+
+static int place_atlas_image(struct texture_atlas* atlas, const GLubyte* pixels, int width, int height
+	, int staged, struct ugles2_atlas_region* region)
+{
+	int w = width + atlas->padding;
+	int h = height + atlas->padding;
+	if ((width <= 0) || (height <= 0) || (w > atlas->width) || (h > atlas->height)) {
+		return -1;
+	}
+
+	int x, y;
+	int i;
+	struct atlas_page* page = NULL;
+	for (i = 0; i < atlas->page_count; i++) {
+		if (skyline_insert(&atlas->pages[i], atlas->width, atlas->height, w, h, &x, &y) == 0) {
+			page = &atlas->pages[i];
+			break;
+		}
+	}
+	if (page == NULL) {
+		page = add_atlas_page(atlas, staged);
+		if ((page == NULL) || (skyline_insert(page, atlas->width, atlas->height, w, h, &x, &y) != 0)) {
+			return -1;
+		}
+		i = atlas->page_count - 1;
+	}
+
+	if (page->staging != NULL) {
+		int row;
+		for (row = 0; row < height; row++) {
+			memcpy(&page->staging[((size_t)(y + row) * atlas->width + x) * 4], &pixels[(size_t)row * width * 4], width * 4);
+		}
+	} else {
+		glBindTexture(GL_TEXTURE_2D, page->texture);
+		GLint unpack_alignment;
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+	}
+
+	region->texture = page->texture;
+	region->page    = i;
+	region->x       = x;
+	region->y       = y;
+	region->width   = width;
+	region->height  = height;
+	region->s0      = x / (float)atlas->width;
+	region->t0      = y / (float)atlas->height;
+	region->s1      = (x + width) / (float)atlas->width;
+	region->t1      = (y + height) / (float)atlas->height;
+
+	return 0;
+}
+
+void* ugles2_create_texture_atlas(int width, int height, int padding)
+{
+	GLint max_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	if (width <= 0) {
+		width = ATLAS_DEFAULT_SIZE;
+	}
+	if (height <= 0) {
+		height = ATLAS_DEFAULT_SIZE;
+	}
+	if ((max_size > 0) && (width > max_size)) {
+		width = max_size;
+	}
+	if ((max_size > 0) && (height > max_size)) {
+		height = max_size;
+	}
+
+	struct texture_atlas* atlas = (struct texture_atlas*)malloc(sizeof(struct texture_atlas));
+	if (atlas == NULL) {
+		return NULL;
+	}
+	memset(atlas, 0, sizeof(*atlas));
+	atlas->width   = width;
+	atlas->height  = height;
+	atlas->padding = (padding > 0)? padding : 0;
+
+	return atlas;
+}
+
+void ugles2_destroy_texture_atlas(void* atlas)
+{
+	struct texture_atlas* a = (struct texture_atlas*)atlas;
+	if (a == NULL) {
+		return;
+	}
+	int i;
+	for (i = 0; i < a->page_count; i++) {
+		glDeleteTextures(1, &a->pages[i].texture);
+		free(a->pages[i].nodes);
+		free(a->pages[i].staging);
+	}
+	free(a->pages);
+	free(a);
+}
+
+int ugles2_atlas_add_pixels(void* atlas, const GLubyte* pixels, int width, int height, struct ugles2_atlas_region* region)
+{
+	return place_atlas_image((struct texture_atlas*)atlas, pixels, width, height, 0, region);
+}
+
+int ugles2_atlas_add_image(void* atlas, const char file[], struct ugles2_atlas_region* region)
+{
+	void* image = ugles2_open_image(file);
+	if (image == NULL) {
+		return -1;
+	}
+
+	int width;
+	int height;
+	ugles2_image_size(image, &width, &height);
+
+	int res = -1;
+	GLubyte* pixels = ugles2_decode_image(image, NULL);
+	if (pixels != NULL) {
+		res = ugles2_atlas_add_pixels(atlas, pixels, width, height, region);
+	}
+	ugles2_close_image(image);
+
+	return res;
+}
+
+// tallest first packs a skyline tightly
+static int compare_atlas_images(const void* a, const void* b)
+{
+	const struct atlas_image* p = (const struct atlas_image*)a;
+	const struct atlas_image* q = (const struct atlas_image*)b;
+	if (p->height != q->height) {
+		return q->height - p->height;
+	}
+	if (p->width != q->width) {
+		return q->width - p->width;
+	}
+	return p->index - q->index;
+}
+
+// returns the number of files that could not be added; their regions are zeroed
+int ugles2_atlas_add_images(void* atlas, const char* files[], int count, struct ugles2_atlas_region regions[])
+{
+	struct texture_atlas* a = (struct texture_atlas*)atlas;
+	struct atlas_image* images = (struct atlas_image*)calloc(count, sizeof(struct atlas_image));
+	if (images == NULL) {
+		return count;
+	}
+
+	int failures = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		memset(&regions[i], 0, sizeof(regions[i]));
+		images[i].index = i;
+		void* image = ugles2_open_image(files[i]);
+		if (image == NULL) {
+			continue;
+		}
+		ugles2_image_size(image, &images[i].width, &images[i].height);
+		GLubyte* pixels = (GLubyte*)malloc((size_t)images[i].width * images[i].height * 4);
+		if ((pixels != NULL) && (ugles2_decode_image(image, pixels) == NULL)) {
+			free(pixels);
+			pixels = NULL;
+		}
+		images[i].pixels = pixels;
+		ugles2_close_image(image);
+	}
+
+	qsort(images, count, sizeof(struct atlas_image), compare_atlas_images);
+
+	int first_new_page = a->page_count;
+	for (i = 0; i < count; i++) {
+		struct atlas_image* image = &images[i];
+		if ((image->pixels == NULL)
+			|| (place_atlas_image(a, image->pixels, image->width, image->height, 1, &regions[image->index]) != 0)) {
+			failures++;
+		}
+		free(image->pixels);
+	}
+	free(images);
+
+	// pages opened here go up in one piece
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	for (i = first_new_page; i < a->page_count; i++) {
+		struct atlas_page* page = &a->pages[i];
+		glBindTexture(GL_TEXTURE_2D, page->texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, a->width, a->height, GL_RGBA, GL_UNSIGNED_BYTE, page->staging);
+		free(page->staging);
+		page->staging = NULL;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+
+	return failures;
+}
+
+int ugles2_atlas_pages(void* atlas)
+{
+	return ((struct texture_atlas*)atlas)->page_count;
+}
+
+GLuint ugles2_atlas_page_texture(void* atlas, int page)
+{
+	struct texture_atlas* a = (struct texture_atlas*)atlas;
+	if ((page < 0) || (page >= a->page_count)) {
+		return 0;
+	}
+	return a->pages[page].texture;
+}
+
+// =============================================================================
+// asset pack
+//
+// one file holding many assets, mapped once. layout (little endian):
+//   header   "U2AP", version, entry count, table size, then the offsets of the
+//            entries, the hash table and the names, and the names' size
+//   blobs    each entry's payload, PACK_ALIGN aligned: the original file, or
+//            decoded pixels in a texture format, rows in upload order
+//   names    entry names, not terminated
+//   entries  PACK_ENTRY_SIZE each: hash, name offset and length, type, blob
+//            offset and size, width, height, format
+//   table    open addressing by ugles2_name_hash(), entry index or PACK_EMPTY
+
+#define PACK_VERSION     1
+#define PACK_HEADER_SIZE 48
+#define PACK_ENTRY_SIZE  48
+#define PACK_ALIGN       64
+#define PACK_EMPTY       0xffffffffU
+
+struct asset_pack {
+	const unsigned char* data;
+	size_t size;
+	void* mapping;
+	void* buffer;
+	uint32_t count;
+	uint32_t table_size;	// a power of two
+	const unsigned char* entries;
+	const unsigned char* table;
+	const unsigned char* names;
+	uint64_t names_size;
+};
+
+static uint64_t get_u64(const unsigned char* p)
+{
+	return (uint64_t)get_u32(p + 4, 0) << 32 | get_u32(p, 0);
+}
+
+void* ugles2_open_pack(const char file[])
+{
+	struct asset_pack* pack = (struct asset_pack*)malloc(sizeof(struct asset_pack));
+	if (pack == NULL) {
+		return NULL;
+	}
+	memset(pack, 0, sizeof(*pack));
+
+	pack->data = map_file(file, &pack->size, &pack->mapping, &pack->buffer);
+	if ((pack->data == NULL) || (pack->size < PACK_HEADER_SIZE) || (memcmp(pack->data, "U2AP", 4) != 0)
+		|| (get_u32(pack->data + 4, 0) != PACK_VERSION)) {
+		ugles2_close_pack(pack);
+		return NULL;
+	}
+
+	const unsigned char* h = pack->data;
+	pack->count      = get_u32(h + 8, 0);
+	pack->table_size = get_u32(h + 12, 0);
+	uint64_t entries = get_u64(h + 16);
+	uint64_t table   = get_u64(h + 24);
+	uint64_t names   = get_u64(h + 32);
+	pack->names_size = get_u64(h + 40);
+	if ((pack->table_size == 0) || ((pack->table_size & (pack->table_size - 1)) != 0) || (pack->table_size <= pack->count)
+		|| (entries > pack->size) || ((uint64_t)pack->count * PACK_ENTRY_SIZE > pack->size - entries)
+		|| (table > pack->size) || ((uint64_t)pack->table_size * 4 > pack->size - table)
+		|| (names > pack->size) || (pack->names_size > pack->size - names)) {
+		ugles2_close_pack(pack);
+		return NULL;
+	}
+	pack->entries = pack->data + entries;
+	pack->table   = pack->data + table;
+	pack->names   = pack->data + names;
+
+	return pack;
+}
+
+void ugles2_close_pack(void* pack)
+{
+	struct asset_pack* p = (struct asset_pack*)pack;
+	if (p == NULL) {
+		return;
+	}
+	unmap_file(p->size, p->mapping, p->buffer);
+	free(p);
+}
+
+int ugles2_pack_entries(void* pack)
+{
+	return ((struct asset_pack*)pack)->count;
+}
+
+// returns the entry index, or -1
+int ugles2_pack_find(void* pack, const char name[], struct ugles2_asset* asset)
+{
+	struct asset_pack* p = (struct asset_pack*)pack;
+	uint32_t hash = ugles2_name_hash(name);
+	size_t length = strlen(name);
+	uint32_t mask = p->table_size - 1;
+	uint32_t i = hash & mask;
+	uint32_t probes;
+	for (probes = 0; probes < p->table_size; probes++, i = (i + 1) & mask) {
+		uint32_t index = get_u32(p->table + i * 4, 0);
+		if ((index == PACK_EMPTY) || (index >= p->count)) {
+			return -1;
+		}
+		const unsigned char* e = p->entries + (size_t)index * PACK_ENTRY_SIZE;
+		uint32_t name_offset = get_u32(e + 4, 0);
+		uint32_t name_length = get_u32(e + 8, 0);
+		if ((get_u32(e, 0) != hash) || (name_length != length) || ((uint64_t)name_offset + name_length > p->names_size)
+			|| (memcmp(p->names + name_offset, name, length) != 0)) {
+			continue;
+		}
+
+		uint64_t offset = get_u64(e + 16);
+		uint64_t size   = get_u64(e + 24);
+		if ((offset > p->size) || (size > p->size - offset)) {
+			return -1;
+		}
+		if (asset != NULL) {
+			asset->data   = p->data + offset;
+			asset->size   = (unsigned)size;
+			asset->type   = get_u32(e + 12, 0);
+			asset->width  = get_u32(e + 32, 0);
+			asset->height = get_u32(e + 36, 0);
+			asset->format = get_u32(e + 40, 0);
+		}
+		return (int)index;
+	}
+	return -1;
+}
+
+// pre-decoded RGBA takes every option; other formats are uploaded as stored
+static GLuint create_pixels_texture(const struct ugles2_asset* asset
+	, const struct ugles2_texture_options* options, struct ugles2_texture_info* info)
+{
+	if ((asset->format < 0) || (asset->format >= (int)(sizeof(texture_formats) / sizeof(texture_formats[0])))
+		|| ((unsigned long)asset->width * asset->height * texture_formats[asset->format].bytes > asset->size)) {
+		return 0;
+	}
+	struct ugles2_texture_options o;
+	copy_texture_options(&o, options);
+	if (asset->format == UGLES2_FORMAT_RGBA) {
+		o.format = UGLES2_FORMAT_RGBA;
+		return ugles2_create_texture_with_options((const GLubyte*)asset->data, asset->width, asset->height, &o, info);
+	}
+
+	const struct texture_format* f = &texture_formats[asset->format];
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, f->format, asset->width, asset->height, 0, f->format, f->type, asset->data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+	if (o.mipmap != UGLES2_MIPMAP_NONE) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, o.min_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, o.mag_filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, o.wrap_s);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, o.wrap_t);
+
+	if (info != NULL) {
+		info->width  = asset->width;
+		info->height = asset->height;
+		info->format = f->format;
+		info->type   = f->type;
+		info->bytes  = (unsigned long)asset->width * asset->height * f->bytes;
+	}
+
+	return texture;
+}
+
+static GLuint load_pack_asset(const struct ugles2_asset* asset
+	, const struct ugles2_texture_options* options, struct ugles2_texture_info* info)
+{
+	if (asset->type == UGLES2_ASSET_PIXELS) {
+		return create_pixels_texture(asset, options, info);
+	}
+	return load_memory_texture(asset->data, asset->size, options, info);
+}
+
+GLuint ugles2_load_pack_texture(void* pack, const char name[]
+	, const struct ugles2_texture_options* options, struct ugles2_texture_info* info)
+{
+	struct ugles2_asset asset;
+	if (ugles2_pack_find(pack, name, &asset) < 0) {
+		return 0;
+	}
+	struct texture_cache* cache = current_texture_cache();
+	if (cache == NULL) {
+		return load_pack_asset(&asset, options, info);
+	}
+
+	// by content, so the same asset in another pack or memory is shared too
+	uint64_t key = texture_key(NULL, asset.data, asset.size, options);
+	if (asset.type == UGLES2_ASSET_PIXELS) {
+		int layout[3] = { asset.width, asset.height, asset.format };
+		key = hash_bytes(key, layout, sizeof(layout));
+	}
+	struct cached_texture* t = find_cached_texture(cache, key, NULL, asset.size);
+	if (t != NULL) {
+		return use_cached_texture(cache, t, info);
+	}
+
+	struct ugles2_texture_info i;
+	GLuint texture = load_pack_asset(&asset, options, &i);
+	if (texture != 0) {
+		store_cached_texture(cache, key, NULL, asset.size, options, texture, &i);
+		if (info != NULL) {
+			*info = i;
+		}
+	}
+	return texture;
+}
+
+// payload of one entry for the writer: the file as is, or its decoded pixels converted
+static void* read_pack_entry(const struct ugles2_pack_entry* entry, size_t* size, int* width, int* height, int* format)
+{
+	*width = 0;
+	*height = 0;
+	*format = 0;
+	if (!entry->pixels) {
+		void* mapping;
+		void* buffer;
+		const unsigned char* data = map_file(entry->file, size, &mapping, &buffer);
+		if (data == NULL) {
+			return NULL;
+		}
+		void* copy = malloc(*size);
+		if (copy != NULL) {
+			memcpy(copy, data, *size);
+		}
+		unmap_file(*size, mapping, buffer);
+		return copy;
+	}
+
+	void* image = ugles2_open_image(entry->file);
+	if (image == NULL) {
+		return NULL;
+	}
+	ugles2_image_size(image, width, height);
+	GLubyte* pixels = ugles2_decode_image(image, NULL);
+	void* out = NULL;
+	if (pixels != NULL) {
+		*format = entry->format;
+		if (*format == UGLES2_FORMAT_AUTO) {
+			*format = choose_texture_format(pixels, *width, *height);
+		}
+		if ((*format < 0) || (*format >= (int)(sizeof(texture_formats) / sizeof(texture_formats[0])))) {
+			*format = UGLES2_FORMAT_RGBA;
+		}
+		*size = (size_t)*width * *height * texture_formats[*format].bytes;
+		out = malloc(*size);
+		if ((out != NULL) && (*format == UGLES2_FORMAT_RGBA)) {
+			memcpy(out, pixels, *size);
+		} else if (out != NULL) {
+			convert_pixels(out, pixels, *width, *height, *format, entry->dither);
+		}
+	}
+	ugles2_close_image(image);
+
+	return out;
+}
+
+static int pad_pack(FILE* fp, uint64_t* offset)
+{
+	static const unsigned char zero[PACK_ALIGN];
+	size_t n = (size_t)((PACK_ALIGN - *offset % PACK_ALIGN) % PACK_ALIGN);
+	if ((n > 0) && (fwrite(zero, n, 1, fp) != 1)) {
+		return -1;
+	}
+	*offset += n;
+	return 0;
+}
+
+int ugles2_write_pack(const char file[], const struct ugles2_pack_entry entries[], int count)
+{
+	uint32_t table_size = 16;
+	while (table_size < (uint32_t)count * 2) {
+		table_size <<= 1;
+	}
+	unsigned char* records = (unsigned char*)calloc(count + 1, PACK_ENTRY_SIZE);
+	uint32_t* table = (uint32_t*)malloc(table_size * 4);
+	FILE* fp = fopen(file, "wb");
+	int res = 0;
+	if ((records == NULL) || (table == NULL) || (fp == NULL)) {
+		res = -1;
+	}
+	if (table != NULL) {
+		memset(table, 0xff, table_size * 4);
+	}
+
+	// the header is rewritten at the end
+	unsigned char header[PACK_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	uint64_t offset = PACK_HEADER_SIZE;
+	if ((res == 0) && (fwrite(header, sizeof(header), 1, fp) != 1)) {
+		res = -1;
+	}
+
+	uint64_t name_offset = 0;
+	int i;
+	for (i = 0; (i < count) && (res == 0); i++) {
+		const struct ugles2_pack_entry* entry = &entries[i];
+		uint32_t hash = ugles2_name_hash(entry->name);
+		uint32_t slot = hash & (table_size - 1);
+		while (table[slot] != PACK_EMPTY) {
+			const unsigned char* e = records + (size_t)table[slot] * PACK_ENTRY_SIZE;
+			if ((get_u32(e, 0) == hash) && (strcmp(entries[table[slot]].name, entry->name) == 0)) {
+				res = -2;	// duplicate name
+				break;
+			}
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if (res != 0) {
+			break;
+		}
+		table[slot] = i;
+
+		size_t size;
+		int width, height, format;
+		void* payload = read_pack_entry(entry, &size, &width, &height, &format);
+		if (payload == NULL) {
+			res = -3;
+			break;
+		}
+		if ((pad_pack(fp, &offset) != 0) || (fwrite(payload, size, 1, fp) != 1)) {
+			res = -1;
+		}
+		free(payload);
+
+		unsigned char* e = records + (size_t)i * PACK_ENTRY_SIZE;
+		put_u32(e, hash);
+		put_u32(e + 4, (uint32_t)name_offset);
+		put_u32(e + 8, (uint32_t)strlen(entry->name));
+		put_u32(e + 12, entry->pixels? UGLES2_ASSET_PIXELS : UGLES2_ASSET_FILE);
+		put_u64(e + 16, offset);
+		put_u64(e + 24, size);
+		put_u32(e + 32, width);
+		put_u32(e + 36, height);
+		put_u32(e + 40, format);
+		offset += size;
+		name_offset += strlen(entry->name);
+	}
+
+	uint64_t names = offset;
+	for (i = 0; (i < count) && (res == 0); i++) {
+		if (fwrite(entries[i].name, strlen(entries[i].name), 1, fp) != 1) {
+			res = -1;
+		}
+	}
+	offset += name_offset;
+
+	uint64_t entry_table = 0;
+	uint64_t hash_table = 0;
+	if (res == 0) {
+		pad_pack(fp, &offset);
+		entry_table = offset;
+		if ((count > 0) && (fwrite(records, (size_t)count * PACK_ENTRY_SIZE, 1, fp) != 1)) {
+			res = -1;
+		}
+		offset += (uint64_t)count * PACK_ENTRY_SIZE;
+		hash_table = offset;
+		uint32_t j;
+		for (j = 0; (j < table_size) && (res == 0); j++) {
+			unsigned char v[4];
+			put_u32(v, table[j]);
+			if (fwrite(v, 4, 1, fp) != 1) {
+				res = -1;
+			}
+		}
+	}
+
+	if (res == 0) {
+		memcpy(header, "U2AP", 4);
+		put_u32(header + 4, PACK_VERSION);
+		put_u32(header + 8, count);
+		put_u32(header + 12, table_size);
+		put_u64(header + 16, entry_table);
+		put_u64(header + 24, hash_table);
+		put_u64(header + 32, names);
+		put_u64(header + 40, name_offset);
+		if ((fseek(fp, 0, SEEK_SET) != 0) || (fwrite(header, sizeof(header), 1, fp) != 1)) {
+			res = -1;
+		}
+	}
+	if ((fp != NULL) && (fclose(fp) != 0)) {
+		res = -1;
+	}
+	if ((fp != NULL) && (res != 0)) {
+		remove(file);
+	}
+	free(table);
+	free(records);
+
+	return res;
+}
+
+// =============================================================================
+// streaming texture
+//
+// updates are copied into a CPU shadow of the frame and the rectangle is added
+// to the dirty rectangle of every buffer. committing moves on to the buffer the
+// GPU used longest ago and uploads only its dirty rectangle with glTexSubImage2D
+// (whole rows without GLES 3 or GL_EXT_unpack_subimage), so buffers that missed
+// updates catch up without full uploads.
+
+#define STREAM_MAX_BUFFERS 3
+#define STREAM_MAX_PLANES  3
+
+struct stream_plane {
+	int width;
+	int height;
+	int bytes;				// per pixel
+	int shift;				// subsampling, 1 for the chroma planes
+	GLenum format;
+	GLubyte* shadow;
+};
+
+struct stream_rect {
+	int x0, y0, x1, y1;		// empty when x0 >= x1
+};
+
+struct texture_stream {
+	struct ugles2_context* context;
+	int width;
+	int height;
+	int format;
+	int row_length;			// GL_UNPACK_ROW_LENGTH usable
+	struct stream_plane planes[STREAM_MAX_PLANES];
+	int plane_count;
+	GLuint textures[STREAM_MAX_BUFFERS][STREAM_MAX_PLANES];
+	struct stream_rect dirty[STREAM_MAX_BUFFERS];
+	int buffers;
+	int current;
+};
+
+static void add_stream_plane(struct texture_stream* s, GLenum format, int bytes, int shift, GLubyte fill)
+{
+	struct stream_plane* p = &s->planes[s->plane_count++];
+	p->width  = (s->width + (1 << shift) - 1) >> shift;
+	p->height = (s->height + (1 << shift) - 1) >> shift;
+	p->bytes  = bytes;
+	p->shift  = shift;
+	p->format = format;
+	p->shadow = (GLubyte*)malloc((size_t)p->width * p->height * bytes);
+	if (p->shadow != NULL) {
+		memset(p->shadow, fill, (size_t)p->width * p->height * bytes);
+	}
+}
+
+void* ugles2_create_stream(struct ugles2_context* context, int width, int height, int format, int buffers)
+{
+	if ((width <= 0) || (height <= 0) || (format < UGLES2_STREAM_RGBA) || (format > UGLES2_STREAM_NV12)) {
+		return NULL;
+	}
+	if (buffers <= 0) {
+		buffers = 2;
+	}
+	if (buffers > STREAM_MAX_BUFFERS) {
+		buffers = STREAM_MAX_BUFFERS;
+	}
+
+	struct texture_stream* s = (struct texture_stream*)malloc(sizeof(struct texture_stream));
+	if (s == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	s->context = context;
+	s->width   = width;
+	s->height  = height;
+	s->format  = format;
+	s->buffers = buffers;
+
+	// black: video range luma, neutral chroma
+	if (format == UGLES2_STREAM_RGBA) {
+		add_stream_plane(s, GL_RGBA, 4, 0, 0);
+	} else {
+		add_stream_plane(s, GL_LUMINANCE, 1, 0, 16);
+		if (format == UGLES2_STREAM_I420) {
+			add_stream_plane(s, GL_LUMINANCE, 1, 1, 128);
+			add_stream_plane(s, GL_LUMINANCE, 1, 1, 128);
+		} else {
+			add_stream_plane(s, GL_LUMINANCE_ALPHA, 2, 1, 128);
+		}
+	}
+	int i, j;
+	for (j = 0; j < s->plane_count; j++) {
+		if (s->planes[j].shadow == NULL) {
+			ugles2_destroy_stream(s);
+			return NULL;
+		}
+	}
+
+	const char* version = (const char*)glGetString(GL_VERSION);
+	s->row_length = ((version != NULL) && (strncmp(version, "OpenGL ES ", 10) == 0) && (version[10] >= '3'))
+		|| has_gl_extension("GL_EXT_unpack_subimage");
+
+	for (i = 0; i < buffers; i++) {
+		glGenTextures(s->plane_count, s->textures[i]);
+		for (j = 0; j < s->plane_count; j++) {
+			const struct stream_plane* p = &s->planes[j];
+			ugles2_bind_texture(context, 0, GL_TEXTURE_2D, s->textures[i][j]);
+			glTexImage2D(GL_TEXTURE_2D, 0, p->format, p->width, p->height, 0, p->format, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		// the first commit of each buffer uploads the whole shadow
+		s->dirty[i].x1 = width;
+		s->dirty[i].y1 = height;
+	}
+	s->current = buffers - 1;
+
+	return s;
+}
+
+void ugles2_destroy_stream(void* stream)
+{
+	struct texture_stream* s = (struct texture_stream*)stream;
+	if (s == NULL) {
+		return;
+	}
+	int i, j;
+	for (i = 0; i < s->buffers; i++) {
+		for (j = 0; j < s->plane_count; j++) {
+			if (s->textures[i][j] != 0) {
+				glDeleteTextures(1, &s->textures[i][j]);
+			}
+		}
+	}
+	// deleted names come back from glGenTextures, so the cached bindings must go
+	ugles2_invalidate_state(s->context);
+	for (j = 0; j < s->plane_count; j++) {
+		free(s->planes[j].shadow);
+	}
+	free(s);
+}
+
+int ugles2_update_stream(void* stream, const GLubyte* const planes[], const int strides[], int x, int y, int width, int height)
+{
+	struct texture_stream* s = (struct texture_stream*)stream;
+	if ((x < 0) || (y < 0) || (width <= 0) || (height <= 0) || (x + width > s->width) || (y + height > s->height)) {
+		return -1;
+	}
+
+	// chroma covers 2x2 luma pixels, so the rectangle grows to even bounds
+	int x0 = x;
+	int y0 = y;
+	int x1 = x + width;
+	int y1 = y + height;
+	if (s->format != UGLES2_STREAM_RGBA) {
+		x0 &= ~1;
+		y0 &= ~1;
+		x1 = (x1 + 1 < s->width)? (x1 + 1) & ~1 : s->width;
+		y1 = (y1 + 1 < s->height)? (y1 + 1) & ~1 : s->height;
+	}
+
+	int i, j;
+	for (i = 0; i < s->plane_count; i++) {
+		const struct stream_plane* p = &s->planes[i];
+		int stride = (strides != NULL)? strides[i] : p->width * p->bytes;
+		int px0 = x0 >> p->shift;
+		int py0 = y0 >> p->shift;
+		int px1 = (x1 + (1 << p->shift) - 1) >> p->shift;
+		int py1 = (y1 + (1 << p->shift) - 1) >> p->shift;
+		size_t row = (size_t)(px1 - px0) * p->bytes;
+		for (j = py0; j < py1; j++) {
+			memcpy(p->shadow + ((size_t)j * p->width + px0) * p->bytes, planes[i] + (size_t)j * stride + (size_t)px0 * p->bytes, row);
+		}
+	}
+
+	for (i = 0; i < s->buffers; i++) {
+		struct stream_rect* d = &s->dirty[i];
+		if (d->x0 >= d->x1) {
+			d->x0 = x0;
+			d->y0 = y0;
+			d->x1 = x1;
+			d->y1 = y1;
+		} else {
+			d->x0 = (x0 < d->x0)? x0 : d->x0;
+			d->y0 = (y0 < d->y0)? y0 : d->y0;
+			d->x1 = (x1 > d->x1)? x1 : d->x1;
+			d->y1 = (y1 > d->y1)? y1 : d->y1;
+		}
+	}
+
+	return 0;
+}
+
+GLuint ugles2_commit_stream(void* stream)
+{
+	struct texture_stream* s = (struct texture_stream*)stream;
+	int next = (s->current + 1) % s->buffers;
+	struct stream_rect* d = &s->dirty[next];
+	if (s->dirty[s->current].x0 < s->dirty[s->current].x1) {	// updated since the last commit
+		GLint unpack_alignment;
+		glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		int i;
+		for (i = 0; i < s->plane_count; i++) {
+			const struct stream_plane* p = &s->planes[i];
+			int px0 = d->x0 >> p->shift;
+			int py0 = d->y0 >> p->shift;
+			int px1 = (d->x1 + (1 << p->shift) - 1) >> p->shift;
+			int py1 = (d->y1 + (1 << p->shift) - 1) >> p->shift;
+			if (!s->row_length) {
+				px0 = 0;
+				px1 = p->width;
+			}
+			ugles2_bind_texture(s->context, 0, GL_TEXTURE_2D, s->textures[next][i]);
+			if (s->row_length && (px1 - px0 < p->width)) {
+				glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, p->width);
+			}
+			glTexSubImage2D(GL_TEXTURE_2D, 0, px0, py0, px1 - px0, py1 - py0, p->format, GL_UNSIGNED_BYTE
+				, p->shadow + ((size_t)py0 * p->width + px0) * p->bytes);
+			if (s->row_length && (px1 - px0 < p->width)) {
+				glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+			}
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+
+		d->x0 = d->x1 = 0;
+		s->current = next;
+	}
+
+	// chroma planes go to units 1 and 2 for ugles2_yuv_program()
+	int i;
+	for (i = s->plane_count - 1; i >= 0; i--) {
+		ugles2_bind_texture(s->context, i, GL_TEXTURE_2D, s->textures[s->current][i]);
+	}
+
+	return s->textures[s->current][0];
+}
+
+GLuint ugles2_stream_texture(void* stream, int plane)
+{
+	struct texture_stream* s = (struct texture_stream*)stream;
+	if ((plane < 0) || (plane >= s->plane_count)) {
+		return 0;
+	}
+	return s->textures[s->current][plane];
+}
+
+GLuint ugles2_yuv_program(struct ugles2_context* context, int format)
+{
+	const char vshader_src[] =
+		"attribute vec2 a_position;\n"
+		"attribute vec2 a_texture;\n"
+		"attribute vec4 a_color;\n"
+		"varying   vec2 v_texture;\n"
+		"varying   vec4 v_color;\n"
+		"uniform   vec2 u_screen;\n"
+		"\n"
+		"void main(void) {\n"
+		"  v_texture = a_texture;\n"
+		"  v_color = a_color;\n"
+		"  gl_Position = vec4(a_position.x / u_screen.x * 2.0 - 1.0, 1.0 - a_position.y / u_screen.y * 2.0, 0.0, 1.0);\n"
+		"}\n";
+
+	// BT.601, video range
+	const char i420_fshader_src[] =
+		"precision mediump float;\n"
+		"varying   vec2  v_texture;\n"
+		"varying   vec4  v_color;\n"
+		"uniform   sampler2D u_texture;\n"
+		"uniform   sampler2D u_u;\n"
+		"uniform   sampler2D u_v;\n"
+		"void main()\n"
+		"{\n"
+		"  vec3 yuv = vec3(texture2D(u_texture, v_texture).r, texture2D(u_u, v_texture).r, texture2D(u_v, v_texture).r) - vec3(0.0625, 0.5, 0.5);\n"
+		"  vec3 rgb = mat3(1.164, 1.164, 1.164, 0.0, -0.392, 2.017, 1.596, -0.813, 0.0) * yuv;\n"
+		"  gl_FragColor = vec4(rgb, 1.0) * v_color;\n"
+		"}\n";
+
+	const char nv12_fshader_src[] =
+		"precision mediump float;\n"
+		"varying   vec2  v_texture;\n"
+		"varying   vec4  v_color;\n"
+		"uniform   sampler2D u_texture;\n"
+		"uniform   sampler2D u_uv;\n"
+		"void main()\n"
+		"{\n"
+		"  vec4 uv = texture2D(u_uv, v_texture);\n"
+		"  vec3 yuv = vec3(texture2D(u_texture, v_texture).r, uv.r, uv.a) - vec3(0.0625, 0.5, 0.5);\n"
+		"  vec3 rgb = mat3(1.164, 1.164, 1.164, 0.0, -0.392, 2.017, 1.596, -0.813, 0.0) * yuv;\n"
+		"  gl_FragColor = vec4(rgb, 1.0) * v_color;\n"
+		"}\n";
+
+	if ((format != UGLES2_STREAM_I420) && (format != UGLES2_STREAM_NV12)) {
+		return 0;
+	}
+	GLuint program = ugles2_compile_program(vshader_src, (format == UGLES2_STREAM_I420)? i420_fshader_src : nv12_fshader_src);
+	if (program == 0) {
+		return 0;
+	}
+
+	ugles2_use_program(context, program);
+	glUniform1i(glGetUniformLocation(program, "u_texture"), 0);
+	if (format == UGLES2_STREAM_I420) {
+		glUniform1i(glGetUniformLocation(program, "u_u"), 1);
+		glUniform1i(glGetUniformLocation(program, "u_v"), 2);
+	} else {
+		glUniform1i(glGetUniformLocation(program, "u_uv"), 1);
+	}
+
+	return program;
+}
+
+// =============================================================================
+// async texture loader
+
+#define LOADER_DEFAULT_THREADS 2
+
+struct load_job {
+	struct load_job* next;
+	GLuint texture;
+	char* file;
+	int width;
+	int height;
+	GLubyte* pixels;
+};
+
+struct texture_loader {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	pthread_t* threads;
+	int thread_count;
+	int quit;
+
+	struct load_job* queue_head;	// waiting for a worker
+	struct load_job* queue_tail;
+	struct load_job* done_head;		// decoded, waiting for upload on the GL thread
+	struct load_job* done_tail;
+	int pending;
+};
+
+static void free_load_job(struct load_job* job)
+{
+	free(job->pixels);
+	free(job->file);
+	free(job);
+}
+
+static void push_load_job(struct load_job** head, struct load_job** tail, struct load_job* job)
+{
+	job->next = NULL;
+	if (*tail != NULL) {
+		(*tail)->next = job;
+	} else {
+		*head = job;
+	}
+	*tail = job;
+}
+
+static struct load_job* pop_load_job(struct load_job** head, struct load_job** tail)
+{
+	struct load_job* job = *head;
+	if (job != NULL) {
+		*head = job->next;
+		if (*head == NULL) {
+			*tail = NULL;
+		}
+		job->next = NULL;
+	}
+	return job;
+}
+
+static void decode_load_job(struct load_job* job)
+{
+	void* image = ugles2_open_image(job->file);
+	if (image == NULL) {
+		return;
+	}
+
+	ugles2_image_size(image, &job->width, &job->height);
+	size_t size = rgba_size(job->width, job->height);
+	job->pixels = (size != 0)? (GLubyte*)malloc(size) : NULL;
+	if ((job->pixels != NULL) && (ugles2_decode_image(image, job->pixels) == NULL)) {
+		free(job->pixels);
+		job->pixels = NULL;
+	}
+
+	ugles2_close_image(image);
+}
+
+static void* loader_thread(void* arg)
+{
+	struct texture_loader* loader = (struct texture_loader*)arg;
+
+	pthread_mutex_lock(&loader->mutex);
+	while (!loader->quit) {
+		struct load_job* job = pop_load_job(&loader->queue_head, &loader->queue_tail);
+		if (job == NULL) {
+			pthread_cond_wait(&loader->cond, &loader->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&loader->mutex);
+
+		decode_load_job(job);
+
+		pthread_mutex_lock(&loader->mutex);
+		push_load_job(&loader->done_head, &loader->done_tail, job);
+	}
+	pthread_mutex_unlock(&loader->mutex);
+
+	return NULL;
+}
+
+static void stop_loader(struct ugles2_context* context)
+{
+	struct texture_loader* loader = (struct texture_loader*)context->loader;
+	if (loader == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&loader->mutex);
+	loader->quit = 1;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->mutex);
+
+	int i;
+	for (i = 0; i < loader->thread_count; i++) {
+		pthread_join(loader->threads[i], NULL);
+	}
+
+	struct load_job* job;
+	while ((job = pop_load_job(&loader->queue_head, &loader->queue_tail)) != NULL) {
+		free_load_job(job);
+	}
+	while ((job = pop_load_job(&loader->done_head, &loader->done_tail)) != NULL) {
+		free_load_job(job);
+	}
+
+	pthread_cond_destroy(&loader->cond);
+	pthread_mutex_destroy(&loader->mutex);
+	free(loader->threads);
+	free(loader);
+	context->loader = NULL;
+}
+
+int ugles2_start_loader(struct ugles2_context* context, int threads)
+{
+	if (context->loader != NULL) {
+		return 0;
+	}
+	if (threads <= 0) {
+		threads = LOADER_DEFAULT_THREADS;
+	}
+
+	struct texture_loader* loader = (struct texture_loader*)malloc(sizeof(struct texture_loader));
+	if (loader == NULL) {
+		return -1;
+	}
+	memset(loader, 0, sizeof(*loader));
+
+	loader->threads = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+	if (loader->threads == NULL) {
+		free(loader);
+		return -1;
+	}
+	pthread_mutex_init(&loader->mutex, NULL);
+	pthread_cond_init(&loader->cond, NULL);
+	context->loader = loader;
+
+	int i;
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&loader->threads[i], NULL, loader_thread, loader) != 0) {
+			break;
+		}
+		loader->thread_count++;
+	}
+	if (loader->thread_count == 0) {
+		stop_loader(context);
+		return -1;
+	}
+
+	return 0;
+}
+
+GLuint ugles2_load_texture_async(struct ugles2_context* context, const char file[])
+{
+	if ((file == NULL) || (ugles2_start_loader(context, 0) != 0)) {
+		return 0;
+	}
+	struct texture_loader* loader = (struct texture_loader*)context->loader;
+
+	struct load_job* job = (struct load_job*)malloc(sizeof(struct load_job));
+	if (job == NULL) {
+		return 0;
+	}
+	memset(job, 0, sizeof(*job));
+
+	job->file = strdup(file);
+	if (job->file == NULL) {
+		free(job);
+		return 0;
+	}
+
+	// placeholder until ugles2_pump_uploads() replaces the contents
+	static const GLubyte placeholder[] = { 0, 0, 0, 0 };
+	job->texture = ugles2_create_texture(placeholder, 1, 1);
+	forget_texture_bindings(context);
+
+	pthread_mutex_lock(&loader->mutex);
+	push_load_job(&loader->queue_head, &loader->queue_tail, job);
+	loader->pending++;
+	pthread_cond_signal(&loader->cond);
+	pthread_mutex_unlock(&loader->mutex);
+
+	return job->texture;
+}
+
+static long elapsed_us(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000L;
+}
+
+int ugles2_pump_uploads(struct ugles2_context* context, int budget_us)
+{
+	struct texture_loader* loader = (struct texture_loader*)context->loader;
+	if (loader == NULL) {
+		return 0;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int uploaded = 0;
+	for (;;) {
+		pthread_mutex_lock(&loader->mutex);
+		struct load_job* job = pop_load_job(&loader->done_head, &loader->done_tail);
+		if (job != NULL) {
+			loader->pending--;
+		}
+		pthread_mutex_unlock(&loader->mutex);
+
+		if (job == NULL) {
+			break;
+		}
+
+		if (job->pixels != NULL) {
+			glBindTexture(GL_TEXTURE_2D, job->texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, job->width, job->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, job->pixels);
+			forget_texture_bindings(context);
+			uploaded++;
+		}
+		free_load_job(job);
+
+		if ((budget_us > 0) && (elapsed_us(&start) >= budget_us)) {
+			break;
+		}
+	}
+
+	return uploaded;
+}
+
+int ugles2_loader_pending(struct ugles2_context* context)
+{
+	struct texture_loader* loader = (struct texture_loader*)context->loader;
+	if (loader == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&loader->mutex);
+	int pending = loader->pending;
+	pthread_mutex_unlock(&loader->mutex);
+
+	return pending;
+}
+
+
+// =============================================================================
+// dump
+
+void ugles2_init_dump_options(struct ugles2_dump_options* options)
+{
+	options->format    = UGLES2_DUMP_PNG;
+	options->level     = -1;
+	options->filters   = 0;
+	options->strategy  = -1;
+	options->bottom_up = 0;
+}
+
+// row i of the output; pixels are bottom-up RGBA as returned by glReadPixels
+static const unsigned char* dump_row(const unsigned char* pixels, int width, int height, int i, const struct ugles2_dump_options* options)
+{
+	int j = options->bottom_up? i : height - i - 1;
+	return pixels + width*4*j;
+}
+
+static int write_raw(const char filename[], const unsigned char* pixels, int width, int height, const struct ugles2_dump_options* options)
+{
+	FILE* fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		return -2;
+	}
+
+	int res = 0;
+	if (options->bottom_up) {
+		if (fwrite(pixels, width*4, height, fp) != (size_t)height) {
+			res = -8;
+		}
+	} else {
+		int i;
+		for (i = 0; (i < height) && (res == 0); i++) {
+			if (fwrite(dump_row(pixels, width, height, i, options), width*4, 1, fp) != 1) {
+				res = -8;
+			}
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		res = -8;
+	}
+	return res;
+}
+
+static int write_ppm(const char filename[], const unsigned char* pixels, int width, int height, const struct ugles2_dump_options* options)
+{
+	unsigned char* line = (unsigned char*)malloc(width*3);
+	if (line == NULL) {
+		return -3;
+	}
+	FILE* fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		free(line);
+		return -2;
+	}
+
+	int res = 0;
+	fprintf(fp, "P6\n%d %d\n255\n", width, height);
+	int i;
+	for (i = 0; (i < height) && (res == 0); i++) {
+		const unsigned char* src = dump_row(pixels, width, height, i, options);
+		int k;
+		for (k = 0; k < width; k++) {
+			line[k*3 + 0] = src[k*4 + 0];
+			line[k*3 + 1] = src[k*4 + 1];
+			line[k*3 + 2] = src[k*4 + 2];
+		}
+		if (fwrite(line, width*3, 1, fp) != 1) {
+			res = -8;
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		res = -8;
+	}
+	free(line);
+	return res;
+}
+
+#if defined(USE_PNG)
+static int write_png(const char filename[], const unsigned char* pixels, int width, int height, const struct ugles2_dump_options* options)
+{
+	FILE* fp = NULL;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+	png_bytep* rows = NULL;
+	int res = -2;
+
+	fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		res = -2;
+		goto finish;
+	}
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL) {
+		res = -4;
+		goto finish;
+	}
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		res = -5;
+		goto finish;
+	}
+
+	png_init_io(png_ptr, fp);
+
+	png_set_IHDR(png_ptr, info_ptr, width, height
+				, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE
+				, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	if (options->level >= 0) {
+		png_set_compression_level(png_ptr, options->level);
+	}
+	if (options->strategy >= 0) {
+		png_set_compression_strategy(png_ptr, options->strategy);
+	}
+	if (options->filters != 0) {
+		int filters = 0;
+		filters |= (options->filters & UGLES2_DUMP_FILTER_NONE )? PNG_FILTER_NONE  : 0;
+		filters |= (options->filters & UGLES2_DUMP_FILTER_SUB  )? PNG_FILTER_SUB   : 0;
+		filters |= (options->filters & UGLES2_DUMP_FILTER_UP   )? PNG_FILTER_UP    : 0;
+		filters |= (options->filters & UGLES2_DUMP_FILTER_AVG  )? PNG_FILTER_AVG   : 0;
+		filters |= (options->filters & UGLES2_DUMP_FILTER_PAETH)? PNG_FILTER_PAETH : 0;
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	// flipping is only a matter of row order
+	rows = (png_bytep*)malloc(height * sizeof(png_bytep));
+	if (rows == NULL) {
+		res = -6;
+		goto finish;
+	}
+	int i;
+	for (i = 0; i < height; i++) {
+		rows[i] = (png_bytep)dump_row(pixels, width, height, i, options);
+	}
+	png_write_rows(png_ptr, rows, height);
+	png_write_end(png_ptr, info_ptr);
+
+	res = 0;
+
+finish:
+	if (rows != NULL) {
+		free(rows);
+	}
+	if (png_ptr != NULL) {
+		if (info_ptr != NULL) {
+			png_destroy_write_struct(&png_ptr, &info_ptr);
+		} else {
+			png_destroy_write_struct(&png_ptr, NULL);
+		}
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	return res;
+}
+#endif
+
+static int write_dump(const char filename[], const unsigned char* pixels, int width, int height, const struct ugles2_dump_options* options)
+{
+	switch (options->format) {
+	case UGLES2_DUMP_RAW:
+		return write_raw(filename, pixels, width, height, options);
+	case UGLES2_DUMP_PPM:
+		return write_ppm(filename, pixels, width, height, options);
+#if defined(USE_PNG)
+	case UGLES2_DUMP_PNG:
+		return write_png(filename, pixels, width, height, options);
+#endif
+	default:
+		return -1;
+	}
+}
+
+int ugles2_dump(struct ugles2_context* context, const char filename[], const struct ugles2_dump_options* options)
+{
+	struct ugles2_dump_options defaults;
+	if (options == NULL) {
+		ugles2_init_dump_options(&defaults);
+		options = &defaults;
+	}
+
+	int width  = context->width;
+	int height = context->height;
+
+	unsigned char* pixels = (unsigned char*)malloc(width*height*4);
+	if (pixels == NULL) {
+		return -3;
+	}
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+	int res = write_dump(filename, pixels, width, height, options);
+	free(pixels);
+
+	return res;
+}
+
+int ugles2_dump_png(struct ugles2_context* context, const char filename[])
+{
+	return ugles2_dump(context, filename, NULL);
+}
+
+// =============================================================================
+// async capture
+
+#define CAPTURE_DEFAULT_BUFFERS 3
+
+struct capture_frame {
+	struct capture_frame* next;
+	char* file;
+	struct ugles2_dump_options options;
+	struct frame_recorder* recorder;	// appended to a recording instead of written to file
+	int width;
+	int height;
+	int capacity;	// bytes allocated in pixels
+	unsigned char* pixels;
+};
+
+struct frame_capture {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;		// frame queued or quit, for the encoder
+	pthread_cond_t  idle;		// frame released, for the render thread
+	pthread_t thread;
+	int running;
+	int quit;
+	int policy;
+
+	struct capture_frame* free_list;
+	struct capture_frame* queue_head;	// read back, waiting for the encoder
+	struct capture_frame* queue_tail;
+	int encoding;
+
+	int written;
+	int dropped;
+	int failed;
+};
+
+static void push_capture_frame(struct frame_capture* capture, struct capture_frame* frame)
+{
+	frame->next = NULL;
+	if (capture->queue_tail != NULL) {
+		capture->queue_tail->next = frame;
+	} else {
+		capture->queue_head = frame;
+	}
+	capture->queue_tail = frame;
+}
+
+static struct capture_frame* pop_capture_frame(struct frame_capture* capture)
+{
+	struct capture_frame* frame = capture->queue_head;
+	if (frame != NULL) {
+		capture->queue_head = frame->next;
+		if (capture->queue_head == NULL) {
+			capture->queue_tail = NULL;
+		}
+		frame->next = NULL;
+	}
+	return frame;
+}
+
+static void release_capture_frame(struct frame_capture* capture, struct capture_frame* frame)
+{
+	free(frame->file);
+	frame->file = NULL;
+	frame->next = capture->free_list;
+	capture->free_list = frame;
+	pthread_cond_broadcast(&capture->idle);
+}
+
+struct frame_recorder;
+static int append_recorded_frame(struct frame_recorder* recorder, struct capture_frame* frame);
+
+static int encode_capture_frame(struct capture_frame* frame)
+{
+	if (frame->recorder != NULL) {
+		return append_recorded_frame(frame->recorder, frame);
+	}
+	return write_dump(frame->file, frame->pixels, frame->width, frame->height, &frame->options);
+}
+
+static void* capture_thread(void* arg)
+{
+	struct frame_capture* capture = (struct frame_capture*)arg;
+
+	pthread_mutex_lock(&capture->mutex);
+	for (;;) {
+		struct capture_frame* frame = pop_capture_frame(capture);
+		if (frame == NULL) {
+			if (capture->quit) {
+				break;
+			}
+			pthread_cond_wait(&capture->cond, &capture->mutex);
+			continue;
+		}
+		capture->encoding++;
+		pthread_mutex_unlock(&capture->mutex);
+
+		int res = encode_capture_frame(frame);
+
+		pthread_mutex_lock(&capture->mutex);
+		capture->encoding--;
+		if (res == 0) {
+			capture->written++;
+		} else {
+			capture->failed++;
+		}
+		release_capture_frame(capture, frame);
+	}
+	pthread_mutex_unlock(&capture->mutex);
+
+	return NULL;
+}
+
+// queued frames are still written before the encoder exits
+static void stop_capture(struct ugles2_context* context)
+{
+	struct frame_capture* capture = (struct frame_capture*)context->capture;
+	if (capture == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture->mutex);
+	capture->quit = 1;
+	pthread_cond_broadcast(&capture->cond);
+	pthread_mutex_unlock(&capture->mutex);
+
+	if (capture->running) {
+		pthread_join(capture->thread, NULL);
+	}
+
+	while (capture->free_list != NULL) {
+		struct capture_frame* next = capture->free_list->next;
+		free(capture->free_list->pixels);
+		free(capture->free_list);
+		capture->free_list = next;
+	}
+
+	pthread_cond_destroy(&capture->idle);
+	pthread_cond_destroy(&capture->cond);
+	pthread_mutex_destroy(&capture->mutex);
+	free(capture);
+	context->capture = NULL;
+}
+
+int ugles2_start_capture(struct ugles2_context* context, int buffers, int policy)
+{
+	if (context->capture != NULL) {
+		return 0;
+	}
+	if (buffers <= 0) {
+		buffers = CAPTURE_DEFAULT_BUFFERS;
+	}
+
+	struct frame_capture* capture = (struct frame_capture*)malloc(sizeof(struct frame_capture));
+	if (capture == NULL) {
+		return -1;
+	}
+	memset(capture, 0, sizeof(*capture));
+	capture->policy = policy;
+
+	int i;
+	for (i = 0; i < buffers; i++) {
+		struct capture_frame* frame = (struct capture_frame*)malloc(sizeof(struct capture_frame));
+		if (frame == NULL) {
+			break;
+		}
+		memset(frame, 0, sizeof(*frame));
+		frame->next = capture->free_list;
+		capture->free_list = frame;
+	}
+
+	pthread_mutex_init(&capture->mutex, NULL);
+	pthread_cond_init(&capture->cond, NULL);
+	pthread_cond_init(&capture->idle, NULL);
+	context->capture = capture;
+
+	if ((capture->free_list == NULL) || (pthread_create(&capture->thread, NULL, capture_thread, capture) != 0)) {
+		stop_capture(context);
+		return -1;
+	}
+	capture->running = 1;
+
+	return 0;
+}
+
+void ugles2_stop_capture(struct ugles2_context* context)
+{
+	stop_capture(context);
+}
+
+// takes a free buffer, or per policy waits for the encoder or recycles the oldest queued frame
+static struct capture_frame* acquire_capture_frame(struct frame_capture* capture)
+{
+	for (;;) {
+		struct capture_frame* frame = capture->free_list;
+		if (frame != NULL) {
+			capture->free_list = frame->next;
+			frame->next = NULL;
+			return frame;
+		}
+
+		if ((capture->policy == UGLES2_CAPTURE_DROP_OLDEST) && (capture->queue_head != NULL)) {
+			frame = pop_capture_frame(capture);
+			free(frame->file);
+			frame->file = NULL;
+			capture->dropped++;
+			return frame;
+		}
+
+		pthread_cond_wait(&capture->idle, &capture->mutex);
+	}
+}
+
+// reads the framebuffer into a pooled buffer; the caller fills in what to do with it and queues it
+static struct capture_frame* read_back_frame(struct ugles2_context* context, struct frame_capture* capture)
+{
+	pthread_mutex_lock(&capture->mutex);
+	struct capture_frame* frame = acquire_capture_frame(capture);
+	pthread_mutex_unlock(&capture->mutex);
+
+	// buffers are reused and only grow when the surface does
+	int width  = context->width;
+	int height = context->height;
+	if (frame->capacity < width*height*4) {
+		unsigned char* pixels = (unsigned char*)realloc(frame->pixels, width*height*4);
+		if (pixels == NULL) {
+			pthread_mutex_lock(&capture->mutex);
+			release_capture_frame(capture, frame);
+			pthread_mutex_unlock(&capture->mutex);
+			return NULL;
+		}
+		frame->pixels = pixels;
+		frame->capacity = width*height*4;
+	}
+	frame->width  = width;
+	frame->height = height;
+	frame->recorder = NULL;
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frame->pixels);
+
+	return frame;
+}
+
+static void queue_capture_frame(struct frame_capture* capture, struct capture_frame* frame)
+{
+	pthread_mutex_lock(&capture->mutex);
+	push_capture_frame(capture, frame);
+	pthread_cond_signal(&capture->cond);
+	pthread_mutex_unlock(&capture->mutex);
+}
+
+int ugles2_capture(struct ugles2_context* context, const char filename[], const struct ugles2_dump_options* options)
+{
+	if ((filename == NULL) || (ugles2_start_capture(context, 0, UGLES2_CAPTURE_BLOCK) != 0)) {
+		return -1;
+	}
+	struct frame_capture* capture = (struct frame_capture*)context->capture;
+
+	char* file = strdup(filename);
+	if (file == NULL) {
+		return -1;
+	}
+
+	struct capture_frame* frame = read_back_frame(context, capture);
+	if (frame == NULL) {
+		free(file);
+		return -3;
+	}
+	frame->file = file;
+	if (options != NULL) {
+		frame->options = *options;
+	} else {
+		ugles2_init_dump_options(&frame->options);
+	}
+	queue_capture_frame(capture, frame);
+
+	return 0;
+}
+
+int ugles2_capture_png(struct ugles2_context* context, const char filename[])
+{
+	return ugles2_capture(context, filename, NULL);
+}
+
+int ugles2_capture_flush(struct ugles2_context* context)
+{
+	struct frame_capture* capture = (struct frame_capture*)context->capture;
+	if (capture == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&capture->mutex);
+	while ((capture->queue_head != NULL) || (capture->encoding > 0)) {
+		pthread_cond_wait(&capture->idle, &capture->mutex);
+	}
+	int failed = capture->failed;
+	pthread_mutex_unlock(&capture->mutex);
+
+	return (failed > 0)? -1 : 0;
+}
+
+int ugles2_capture_stats(struct ugles2_context* context, int* written, int* dropped, int* failed)
+{
+	struct frame_capture* capture = (struct frame_capture*)context->capture;
+	if (capture == NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&capture->mutex);
+	if (written != NULL) {
+		*written = capture->written;
+	}
+	if (dropped != NULL) {
+		*dropped = capture->dropped;
+	}
+	if (failed != NULL) {
+		*failed = capture->failed;
+	}
+	pthread_mutex_unlock(&capture->mutex);
+
+	return 0;
+}
+
+
+// =============================================================================
+// frame recorder
+//
+// one file per recording, integers little-endian:
+//   header  "U2SQ", u32 version, u32 width, u32 height, u32 flags, u32 frames, u64 index offset
+//   frame   u32 type, u32 payload bytes, payload
+//             UGLES2_RECORD_KEY:   width*height RGBA pixels, bottom-up as read back
+//             UGLES2_RECORD_DELTA: spans of u32 first pixel, u32 pixels, RGBA pixels
+//                                  that changed since the previous frame, none if unchanged
+//   index   u64 offset of each frame
+// frames are encoded on the capture thread, so the recorder shares its buffers and policy.
+
+#define RECORDER_VERSION      1
+#define RECORDER_HEADER_SIZE  32
+#define RECORDER_KEY_INTERVAL 60	// bounds how far a reader seeks back for a key frame
+#define RECORDER_SPAN_GAP     4		// unchanged pixels merged into a span rather than starting a new one
+
+struct frame_recorder {
+	FILE* fp;
+	int width;
+	int height;
+	int flags;
+	int failed;
+
+	int frames;
+	int index_capacity;
+	uint64_t* index;
+	uint64_t position;
+
+	unsigned char* previous;	// last frame appended, for deltas
+	unsigned char* delta;
+};
+
+static int write_recorder_header(struct frame_recorder* recorder, uint64_t index_offset)
+{
+	unsigned char header[RECORDER_HEADER_SIZE];
+	memcpy(header, "U2SQ", 4);
+	put_u32(header +  4, RECORDER_VERSION);
+	put_u32(header +  8, recorder->width);
+	put_u32(header + 12, recorder->height);
+	put_u32(header + 16, recorder->flags);
+	put_u32(header + 20, recorder->frames);
+	put_u64(header + 24, index_offset);
+
+	if ((fseek(recorder->fp, 0, SEEK_SET) != 0) || (fwrite(header, sizeof(header), 1, recorder->fp) != 1)) {
+		return -1;
+	}
+	return 0;
+}
+
+// returns the payload size (0 when nothing changed), or -1 when a key frame would be no larger
+static int encode_delta(unsigned char* out, const uint32_t* current, const uint32_t* previous, int n)
+{
+	int limit = n * 4;
+	int size = 0;
+	int i = 0;
+	while (i < n) {
+		if (current[i] == previous[i]) {
+			i++;
+			continue;
+		}
+
+		int start = i;
+		int end = i + 1;	// one past the last changed pixel
+		int j;
+		for (j = end; (j < n) && (j - end <= RECORDER_SPAN_GAP); j++) {
+			if (current[j] != previous[j]) {
+				end = j + 1;
+			}
+		}
+
+		int count = end - start;
+		if (size + 8 + count*4 >= limit) {
+			return -1;
+		}
+		put_u32(out + size, start);
+		put_u32(out + size + 4, count);
+		memcpy(out + size + 8, &current[start], count*4);
+		size += 8 + count*4;
+		i = end;
+	}
+	return size;
+}
+
+static int append_recorded_frame(struct frame_recorder* recorder, struct capture_frame* frame)
+{
+	if (recorder->failed) {
+		return -1;
+	}
+	if ((frame->width != recorder->width) || (frame->height != recorder->height)) {
+		recorder->failed = 1;
+		return -1;
+	}
+
+	if (recorder->frames >= recorder->index_capacity) {
+		int capacity = (recorder->index_capacity == 0)? 256 : recorder->index_capacity * 2;
+		uint64_t* index = (uint64_t*)realloc(recorder->index, sizeof(uint64_t) * capacity);
+		if (index == NULL) {
+			recorder->failed = 1;
+			return -1;
+		}
+		recorder->index = index;
+		recorder->index_capacity = capacity;
+	}
+
+	int n = frame->width * frame->height;
+	uint32_t type = UGLES2_RECORD_KEY;
+	const unsigned char* payload = frame->pixels;
+	int size = n * 4;
+	if ((recorder->flags & UGLES2_RECORD_DELTA) && (recorder->frames % RECORDER_KEY_INTERVAL != 0)) {
+		int delta = encode_delta(recorder->delta, (const uint32_t*)frame->pixels, (const uint32_t*)recorder->previous, n);
+		if (delta >= 0) {
+			type = UGLES2_RECORD_DELTA;
+			payload = recorder->delta;
+			size = delta;
+		}
+	}
+
+	unsigned char header[8];
+	put_u32(header, type);
+	put_u32(header + 4, size);
+	if ((fwrite(header, sizeof(header), 1, recorder->fp) != 1)
+			|| ((size > 0) && (fwrite(payload, size, 1, recorder->fp) != 1))) {
+		recorder->failed = 1;
+		return -1;
+	}
+	recorder->index[recorder->frames++] = recorder->position;
+	recorder->position += sizeof(header) + size;
+
+	// keep this frame as the reference by trading buffers with the pool
+	if (recorder->flags & UGLES2_RECORD_DELTA) {
+		unsigned char* previous = recorder->previous;
+		recorder->previous = frame->pixels;
+		frame->pixels = previous;
+		frame->capacity = n * 4;
+	}
+
+	return 0;
+}
+
+static void free_recorder(struct frame_recorder* recorder)
+{
+	if (recorder->fp != NULL) {
+		fclose(recorder->fp);
+	}
+	free(recorder->previous);
+	free(recorder->delta);
+	free(recorder->index);
+	free(recorder);
+}
+
+void* ugles2_begin_recording(struct ugles2_context* context, const char filename[], int flags)
+{
+	if ((filename == NULL) || (ugles2_start_capture(context, 0, UGLES2_CAPTURE_BLOCK) != 0)) {
+		return NULL;
+	}
+
+	struct frame_recorder* recorder = (struct frame_recorder*)malloc(sizeof(struct frame_recorder));
+	if (recorder == NULL) {
+		return NULL;
+	}
+	memset(recorder, 0, sizeof(*recorder));
+	recorder->width  = context->width;
+	recorder->height = context->height;
+	recorder->flags  = flags & UGLES2_RECORD_DELTA;
+
+	int bytes = recorder->width * recorder->height * 4;
+	if (recorder->flags & UGLES2_RECORD_DELTA) {
+		// previous is swapped into the capture pool, so it is as large as a pool buffer
+		recorder->previous = (unsigned char*)malloc(bytes);
+		recorder->delta    = (unsigned char*)malloc(bytes);
+		if ((recorder->previous == NULL) || (recorder->delta == NULL)) {
+			free_recorder(recorder);
+			return NULL;
+		}
+	}
+
+	recorder->fp = fopen(filename, "wb");
+	if ((recorder->fp == NULL) || (write_recorder_header(recorder, 0) != 0)) {
+		free_recorder(recorder);
+		return NULL;
+	}
+	recorder->position = RECORDER_HEADER_SIZE;
+
+	return recorder;
+}
+
+int ugles2_record_frame(struct ugles2_context* context, void* recorder)
+{
+	struct frame_capture* capture = (struct frame_capture*)context->capture;
+	struct frame_recorder* r = (struct frame_recorder*)recorder;
+	if ((capture == NULL) || (r == NULL)) {
+		return -1;
+	}
+	if ((context->width != r->width) || (context->height != r->height)) {
+		return -1;
+	}
+
+	struct capture_frame* frame = read_back_frame(context, capture);
+	if (frame == NULL) {
+		return -3;
+	}
+	frame->recorder = r;
+	queue_capture_frame(capture, frame);
+
+	return 0;
+}
+
+int ugles2_end_recording(struct ugles2_context* context, void* recorder)
+{
+	struct frame_recorder* r = (struct frame_recorder*)recorder;
+	if (r == NULL) {
+		return -1;
+	}
+
+	// the capture thread must be done with every frame of this recording
+	ugles2_capture_flush(context);
+
+	int res = r->failed? -1 : r->frames;
+	if (res >= 0) {
+		uint64_t index_offset = r->position;
+		unsigned char entry[8];
+		int i;
+		for (i = 0; (i < r->frames) && (res >= 0); i++) {
+			put_u64(entry, r->index[i]);
+			if (fwrite(entry, sizeof(entry), 1, r->fp) != 1) {
+				res = -1;
+			}
+		}
+		if ((res >= 0) && (write_recorder_header(r, index_offset) != 0)) {
+			res = -1;
+		}
+	}
+	if ((fclose(r->fp) != 0) && (res >= 0)) {
+		res = -1;
+	}
+	r->fp = NULL;
+	free_recorder(r);
+
+	return res;
+}
+
+
+// =============================================================================
+// program cache
+//
+// ugles2_compile_program() looks up the cache of the current EGL context, so
+// existing callers pick it up without passing the context around. on disk a
+// program is one file named by its key:
+//   "U2PB", u32 binary format, u32 binary bytes, u32 compile time (us), binary
+
+struct program_reflection;
+
+struct cached_program {
+	struct cached_program* next;
+	uint64_t key;
+	char* vshader_src;		// kept to rule out key collisions
+	char* fshader_src;
+	GLuint program;
+	int refs;
+	long compile_us;
+	struct program_reflection* reflection;	// shared by every user of the program
+};
+
+struct program_cache {
+	struct program_cache* next;
+	EGLContext egl_context;
+	char* dir;
+	uint64_t driver_key;
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+
+	struct cached_program* programs;
+	struct ugles2_program_cache_stats stats;
+	int parallel_compile;	// glMaxShaderCompilerThreadsKHR applied, under program_caches_mutex
+};
+
+static pthread_mutex_t program_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct program_cache* program_caches = NULL;
+
+static uint64_t hash_string(uint64_t h, const char s[])
+{
+	// FNV-1a; a NULL string still changes the hash so ("a", NULL) != (NULL, "a")
+	if (s == NULL) {
+		return (h ^ 0xffU) * 0x100000001b3ULL;
+	}
+	for (; *s != '\0'; s++) {
+		h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+	}
+	return h * 0x100000001b3ULL;	// the terminator, so ("ab", "c") != ("a", "bc")
+}
+
+static struct program_cache* current_program_cache()
+{
+	EGLContext egl_context = eglGetCurrentContext();
+	pthread_mutex_lock(&program_caches_mutex);
+	struct program_cache* cache;
+	for (cache = program_caches; cache != NULL; cache = cache->next) {
+		if (cache->egl_context == egl_context) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&program_caches_mutex);
+
+	return cache;
+}
+
+static GLuint compile_program_source(const char vshader_src[], const char fshader_src[])
+{
+	GLuint program = glCreateProgram();
+
+	GLuint vshader = ugles2_compile_vertex_shader(vshader_src);
+	GLuint fshader = ugles2_compile_fragment_shader(fshader_src);
+
+	if (ugles2_link_shaders(program, vshader, fshader) != 0) {
+		glDeleteProgram(program);
+		program = 0;
+	}
+
+	glDeleteShader(fshader);
+	glDeleteShader(vshader);
+
+	return program;
+}
+
+static char* program_cache_path(struct program_cache* cache, uint64_t key)
+{
+	size_t n = strlen(cache->dir) + 32;
+	char* path = (char*)malloc(n);
+	if (path != NULL) {
+		snprintf(path, n, "%s/%016llx.bin", cache->dir, (unsigned long long)key);
+	}
+	return path;
+}
+
+static GLuint load_program_binary(struct program_cache* cache, uint64_t key, long* compile_us)
+{
+	char* path = program_cache_path(cache, key);
+	if (path == NULL) {
+		return 0;
+	}
+	FILE* fp = fopen(path, "rb");
+	free(path);
+	if (fp == NULL) {
+		return 0;
+	}
+
+	GLuint program = 0;
+	unsigned char header[16];
+	void* binary = NULL;
+	if ((fread(header, sizeof(header), 1, fp) != 1) || (memcmp(header, "U2PB", 4) != 0)) {
+		goto finish;
+	}
+	GLenum format = header[4] | (header[5] << 8) | (header[6] << 16) | ((GLenum)header[7] << 24);
+	GLsizei length = header[8] | (header[9] << 8) | (header[10] << 16) | ((GLsizei)header[11] << 24);
+	*compile_us = header[12] | (header[13] << 8) | (header[14] << 16) | ((long)header[15] << 24);
+
+	binary = malloc(length);
+	if ((binary == NULL) || (fread(binary, length, 1, fp) != 1)) {
+		goto finish;
+	}
+
+	program = glCreateProgram();
+	cache->program_binary(program, format, binary, length);
+
+	// a driver update may reject the binary; the caller then compiles from source
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		glDeleteProgram(program);
+		program = 0;
+	}
+
+finish:
+	free(binary);
+	fclose(fp);
+	return program;
+}
+
+static void save_program_binary(struct program_cache* cache, uint64_t key, GLuint program, long compile_us)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0) {
+		return;
+	}
+
+	unsigned char* data = (unsigned char*)malloc(16 + length);
+	char* path = program_cache_path(cache, key);
+	size_t temp_size = (path != NULL)? strlen(path) + 1 + 11 + 1 : 0;	// ".", an int, NUL
+	char* temp = (path != NULL)? (char*)malloc(temp_size) : NULL;
+	if ((data == NULL) || (temp == NULL)) {
+		goto finish;
+	}
+
+	GLenum format = 0;
+	GLsizei written = 0;
+	cache->get_program_binary(program, length, &written, &format, data + 16);
+	if (written <= 0) {
+		goto finish;
+	}
+	memcpy(data, "U2PB", 4);
+	put_u32(data +  4, format);
+	put_u32(data +  8, written);
+	put_u32(data + 12, (uint32_t)compile_us);
+
+	// written aside and renamed, so a concurrent process never reads half a file
+	snprintf(temp, temp_size, "%s.%d", path, (int)getpid());
+	FILE* fp = fopen(temp, "wb");
+	if (fp == NULL) {
+		goto finish;
+	}
+	int ok = (fwrite(data, 16 + written, 1, fp) == 1);
+	if ((fclose(fp) != 0) || !ok || (rename(temp, path) != 0)) {
+		remove(temp);
+	}
+
+finish:
+	free(temp);
+	free(path);
+	free(data);
+}
+
+static uint64_t program_key(struct program_cache* cache, const char vshader_src[], const char fshader_src[])
+{
+	return hash_string(hash_string(cache->driver_key, vshader_src), fshader_src);
+}
+
+static GLuint find_cached_program(struct program_cache* cache, uint64_t key, const char vshader_src[], const char fshader_src[])
+{
+	struct cached_program* p;
+	for (p = cache->programs; p != NULL; p = p->next) {
+		if ((p->key == key) && (strcmp(p->vshader_src, vshader_src) == 0) && (strcmp(p->fshader_src, fshader_src) == 0)) {
+			p->refs++;
+			cache->stats.hits++;
+			cache->stats.saved_us += p->compile_us;
+			return p->program;
+		}
+	}
+	return 0;
+}
+
+static void detach_reflection(struct program_reflection* reflection);
+
+static void free_cached_program(struct cached_program* p)
+{
+	if (p->reflection != NULL) {
+		detach_reflection(p->reflection);
+	}
+	free(p->vshader_src);
+	free(p->fshader_src);
+	free(p);
+}
+
+static struct cached_program* new_cached_program(uint64_t key, const char vshader_src[], const char fshader_src[])
+{
+	struct cached_program* p = (struct cached_program*)malloc(sizeof(struct cached_program));
+	if (p == NULL) {
+		return NULL;
+	}
+	memset(p, 0, sizeof(*p));
+	p->key = key;
+	p->vshader_src = strdup(vshader_src);
+	p->fshader_src = strdup(fshader_src);
+	if ((p->vshader_src == NULL) || (p->fshader_src == NULL)) {
+		free_cached_program(p);
+		return NULL;
+	}
+	return p;
+}
+
+static void add_cached_program(struct program_cache* cache, struct cached_program* p)
+{
+	p->refs = 1;
+	p->next = cache->programs;
+	cache->programs = p;
+}
+
+static GLuint load_cached_program(struct program_cache* cache, struct cached_program* p)
+{
+	if ((cache->dir == NULL) || (cache->program_binary == NULL)) {
+		return 0;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	p->program = load_program_binary(cache, p->key, &p->compile_us);
+	if (p->program != 0) {
+		cache->stats.disk_hits++;
+		long load_us = elapsed_us(&start);
+		if (p->compile_us > load_us) {
+			cache->stats.saved_us += p->compile_us - load_us;
+		}
+	}
+	return p->program;
+}
+
+// p->program was compiled from source in p->compile_us
+static void store_compiled_program(struct program_cache* cache, struct cached_program* p)
+{
+	cache->stats.misses++;
+	if ((cache->dir != NULL) && (cache->get_program_binary != NULL)) {
+		save_program_binary(cache, p->key, p->program, p->compile_us);
+	}
+	add_cached_program(cache, p);
+}
+
+static GLuint compile_cached_program(struct program_cache* cache, const char vshader_src[], const char fshader_src[])
+{
+	uint64_t key = program_key(cache, vshader_src, fshader_src);
+	GLuint program = find_cached_program(cache, key, vshader_src, fshader_src);
+	if (program != 0) {
+		return program;
+	}
+
+	struct cached_program* p = new_cached_program(key, vshader_src, fshader_src);
+	if (p == NULL) {
+		return compile_program_source(vshader_src, fshader_src);
+	}
+
+	if (load_cached_program(cache, p) != 0) {
+		add_cached_program(cache, p);
+		return p->program;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	p->program = compile_program_source(vshader_src, fshader_src);
+	p->compile_us = elapsed_us(&start);
+	if (p->program == 0) {
+		free_cached_program(p);
+		return 0;
+	}
+	store_compiled_program(cache, p);
+
+	return p->program;
+}
+
+GLuint ugles2_compile_program(const char vshader_src[], const char fshader_src[])
+{
+	struct program_cache* cache = current_program_cache();
+	if ((cache == NULL) || (vshader_src == NULL) || (fshader_src == NULL)) {
+		return compile_program_source(vshader_src, fshader_src);
+	}
+	return compile_cached_program(cache, vshader_src, fshader_src);
+}
+
+void ugles2_delete_program(GLuint program)
+{
+	struct program_cache* cache = current_program_cache();
+	if (cache != NULL) {
+		struct cached_program** p;
+		for (p = &cache->programs; *p != NULL; p = &(*p)->next) {
+			if ((*p)->program == program) {
+				if (--(*p)->refs > 0) {
+					return;
+				}
+				struct cached_program* found = *p;
+				*p = found->next;
+				free_cached_program(found);
+				break;
+			}
+		}
+	}
+	glDeleteProgram(program);
+}
+
+static void disable_program_cache(struct ugles2_context* context)
+{
+	struct program_cache* cache = (struct program_cache*)context->programs;
+	if (cache == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&program_caches_mutex);
+	struct program_cache** c;
+	for (c = &program_caches; *c != NULL; c = &(*c)->next) {
+		if (*c == cache) {
+			*c = cache->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&program_caches_mutex);
+
+	// programs still referenced go away with the GL context
+	while (cache->programs != NULL) {
+		struct cached_program* next = cache->programs->next;
+		free_cached_program(cache->programs);
+		cache->programs = next;
+	}
+	free(cache->dir);
+	free(cache);
+	context->programs = NULL;
+}
+
+int ugles2_enable_program_cache(struct ugles2_context* context, const char dir[])
+{
+	if (context->programs != NULL) {
+		return 0;
+	}
+
+	struct program_cache* cache = (struct program_cache*)malloc(sizeof(struct program_cache));
+	if (cache == NULL) {
+		return -1;
+	}
+	memset(cache, 0, sizeof(*cache));
+	cache->egl_context = context->context;
+
+	if (dir != NULL) {
+		cache->dir = strdup(dir);
+		if (cache->dir == NULL) {
+			free(cache);
+			return -1;
+		}
+	}
+
+	// binaries are only valid for the driver that produced them
+	uint64_t key = 0xcbf29ce484222325ULL;
+	key = hash_string(key, (const char*)glGetString(GL_VENDOR));
+	key = hash_string(key, (const char*)glGetString(GL_RENDERER));
+	key = hash_string(key, (const char*)glGetString(GL_VERSION));
+	cache->driver_key = key;
+
+	GLint formats = 0;
+	if (has_gl_extension("GL_OES_get_program_binary")) {
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	}
+	if (formats > 0) {
+		cache->get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+		cache->program_binary     = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+		if ((cache->get_program_binary == NULL) || (cache->program_binary == NULL)) {
+			cache->get_program_binary = NULL;
+			cache->program_binary     = NULL;
+		}
+	}
+	cache->stats.binary_supported = (cache->program_binary != NULL);
+
+	pthread_mutex_lock(&program_caches_mutex);
+	cache->next = program_caches;
+	program_caches = cache;
+	pthread_mutex_unlock(&program_caches_mutex);
+	context->programs = cache;
+
+	return 0;
+}
+
+int ugles2_program_cache_stats(struct ugles2_context* context, struct ugles2_program_cache_stats* stats)
+{
+	struct program_cache* cache = (struct program_cache*)context->programs;
+	if ((cache == NULL) || (stats == NULL)) {
+		return -1;
+	}
+	*stats = cache->stats;
+	return 0;
+}
+
+// =============================================================================
+// batch program compile
+//
+// every compile and link is issued before the first status query, so drivers
+// that compile on their own threads (KHR_parallel_shader_compile) overlap them.
+
+struct batch_program {
+	GLuint vshader;
+	GLuint fshader;
+	struct cached_program* cached;	// to be stored once linked
+	int same;			// 1 + index of an earlier entry compiling the same sources
+};
+
+// the thread count is context state: set once per program cache, or on every
+// batch for contexts without one
+static void enable_parallel_compile(struct program_cache* cache)
+{
+	if (cache != NULL) {
+		pthread_mutex_lock(&program_caches_mutex);
+		int done = cache->parallel_compile;
+		cache->parallel_compile = 1;
+		pthread_mutex_unlock(&program_caches_mutex);
+		if (done) {
+			return;
+		}
+	}
+
+	if (has_gl_extension("GL_KHR_parallel_shader_compile")) {
+		typedef void (GL_APIENTRYP max_threads_proc)(GLuint count);
+		max_threads_proc max_threads = (max_threads_proc)eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+		if (max_threads != NULL) {
+			max_threads(0xffffffffU);	// as many as the driver likes
+		}
+	}
+}
+
+static char* append_info_log(char* log, const char title[], GLuint object, int is_program)
+{
+	GLint length = 0;
+	if (is_program) {
+		glGetProgramiv(object, GL_INFO_LOG_LENGTH, &length);
+	} else {
+		glGetShaderiv(object, GL_INFO_LOG_LENGTH, &length);
+	}
+	if (length <= 1) {
+		return log;
+	}
+
+	size_t used = (log != NULL)? strlen(log) : 0;
+	size_t title_length = strlen(title);
+	char* p = (char*)realloc(log, used + title_length + length + 2);
+	if (p == NULL) {
+		return log;
+	}
+	memcpy(p + used, title, title_length);
+	used += title_length;
+	if (is_program) {
+		glGetProgramInfoLog(object, length, NULL, p + used);
+	} else {
+		glGetShaderInfoLog(object, length, NULL, p + used);
+	}
+	used += strlen(p + used);
+	if ((used > 0) && (p[used - 1] != '\n')) {
+		p[used++] = '\n';
+	}
+	p[used] = '\0';
+
+	return p;
+}
+
+int ugles2_compile_programs(const struct ugles2_program_source sources[], struct ugles2_program_result results[], int count)
+{
+	if (count <= 0) {
+		return 0;
+	}
+	struct batch_program* batch = (struct batch_program*)malloc(sizeof(struct batch_program) * count);
+	if (batch == NULL) {
+		return -1;
+	}
+	memset(batch, 0, sizeof(struct batch_program) * count);
+	memset(results, 0, sizeof(struct ugles2_program_result) * count);
+
+	struct program_cache* cache = current_program_cache();
+	enable_parallel_compile(cache);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int i;
+	int compiled = 0;
+	for (i = 0; i < count; i++) {
+		const char* vshader_src = sources[i].vshader_src;
+		const char* fshader_src = sources[i].fshader_src;
+		if ((vshader_src == NULL) || (fshader_src == NULL)) {
+			continue;
+		}
+
+		if (cache != NULL) {
+			// the same sources earlier in the batch share its program once it is stored
+			int j;
+			for (j = 0; j < i; j++) {
+				if ((batch[j].cached != NULL) && (strcmp(sources[j].vshader_src, vshader_src) == 0)
+					&& (strcmp(sources[j].fshader_src, fshader_src) == 0)) {
+					break;
+				}
+			}
+			if (j < i) {
+				batch[i].same = j + 1;
+				continue;
+			}
+
+			uint64_t key = program_key(cache, vshader_src, fshader_src);
+			results[i].program = find_cached_program(cache, key, vshader_src, fshader_src);
+			if (results[i].program != 0) {
+				continue;
+			}
+			batch[i].cached = new_cached_program(key, vshader_src, fshader_src);
+			if ((batch[i].cached != NULL) && (load_cached_program(cache, batch[i].cached) != 0)) {
+				add_cached_program(cache, batch[i].cached);
+				results[i].program = batch[i].cached->program;
+				batch[i].cached = NULL;
+				continue;
+			}
+		}
+
+		batch[i].vshader = glCreateShader(GL_VERTEX_SHADER);
+		batch[i].fshader = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(batch[i].vshader, 1, &vshader_src, NULL);
+		glShaderSource(batch[i].fshader, 1, &fshader_src, NULL);
+		glCompileShader(batch[i].vshader);
+		glCompileShader(batch[i].fshader);
+		compiled++;
+	}
+
+	// links only wait for their own shaders
+	for (i = 0; i < count; i++) {
+		if (batch[i].vshader != 0) {
+			results[i].program = glCreateProgram();
+			glAttachShader(results[i].program, batch[i].vshader);
+			glAttachShader(results[i].program, batch[i].fshader);
+			glLinkProgram(results[i].program);
+		}
+	}
+
+	int failed = 0;
+	for (i = 0; i < count; i++) {
+		if ((sources[i].vshader_src == NULL) || (sources[i].fshader_src == NULL)) {
+			results[i].status = -1;
+			failed++;
+			continue;
+		}
+		if (batch[i].same != 0) {
+			const struct ugles2_program_result* first = &results[batch[i].same - 1];
+			if (first->status == 0) {
+				uint64_t key = program_key(cache, sources[i].vshader_src, sources[i].fshader_src);
+				results[i].program = find_cached_program(cache, key, sources[i].vshader_src, sources[i].fshader_src);
+			}
+			if (results[i].program == 0) {
+				results[i].status = -1;
+				results[i].log = (first->log != NULL)? strdup(first->log) : NULL;
+				failed++;
+			}
+			continue;
+		}
+		if (batch[i].vshader == 0) {
+			continue;	// from the cache
+		}
+
+		GLint linked = 0;
+		glGetProgramiv(results[i].program, GL_LINK_STATUS, &linked);
+		results[i].log = append_info_log(results[i].log, "vertex shader:\n", batch[i].vshader, 0);
+		results[i].log = append_info_log(results[i].log, "fragment shader:\n", batch[i].fshader, 0);
+		results[i].log = append_info_log(results[i].log, "program:\n", results[i].program, 1);
+
+		glDetachShader(results[i].program, batch[i].vshader);
+		glDetachShader(results[i].program, batch[i].fshader);
+		glDeleteShader(batch[i].vshader);
+		glDeleteShader(batch[i].fshader);
+
+		if (!linked) {
+			glDeleteProgram(results[i].program);
+			results[i].program = 0;
+			results[i].status = -1;
+			failed++;
+			if (batch[i].cached != NULL) {
+				free_cached_program(batch[i].cached);
+			}
+		} else if (batch[i].cached != NULL) {
+			// compiles overlapped, so each is charged an equal share of the batch
+			batch[i].cached->program = results[i].program;
+			batch[i].cached->compile_us = elapsed_us(&start) / compiled;
+			store_compiled_program(cache, batch[i].cached);
+		}
+	}
+
+	free(batch);
+	return failed;
+}
+
+void ugles2_release_program_results(struct ugles2_program_result results[], int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		free(results[i].log);
+		results[i].log = NULL;
+	}
+}
+
+// =============================================================================
+// program reflection
+//
+// built once from glGetActiveUniform/glGetActiveAttrib. variables are found by
+// a precomputed name hash in an open-addressed table; uniform values set through
+// ugles2_set_uniform() are shadowed so unchanged values are not sent again.
+
+struct reflected_variable {
+	char* name;			// without a trailing "[0]"
+	unsigned hash;
+	GLint location;
+	GLenum type;
+	GLint size;			// array elements
+	int components;		// 32-bit values per element
+	int has_value;
+	void* value;		// shadow, components * size values
+};
+
+struct program_reflection {
+	GLuint program;
+	int refs;
+	struct cached_program* cached;
+
+	int uniform_count;
+	struct reflected_variable* uniforms;
+	int* uniform_table;		// index + 1, 0 for an empty bucket
+	int attrib_count;
+	struct reflected_variable* attribs;
+	int* attrib_table;
+	int buckets;
+};
+
+unsigned ugles2_name_hash(const char name[])
+{
+	unsigned h = 2166136261U;
+	for (; *name != '\0'; name++) {
+		h = (h ^ (unsigned char)*name) * 16777619U;
+	}
+	return h;
+}
+
+static int uniform_components(GLenum type)
+{
+	switch (type) {
+	case GL_FLOAT:
+	case GL_INT:
+	case GL_BOOL:
+	case GL_SAMPLER_2D:
+	case GL_SAMPLER_CUBE:
+		return 1;
+	case GL_FLOAT_VEC2:
+	case GL_INT_VEC2:
+	case GL_BOOL_VEC2:
+		return 2;
+	case GL_FLOAT_VEC3:
+	case GL_INT_VEC3:
+	case GL_BOOL_VEC3:
+		return 3;
+	case GL_FLOAT_VEC4:
+	case GL_INT_VEC4:
+	case GL_BOOL_VEC4:
+	case GL_FLOAT_MAT2:
+		return 4;
+	case GL_FLOAT_MAT3:
+		return 9;
+	case GL_FLOAT_MAT4:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+// lookups go by hash alone, so two names sharing one cannot be told apart
+static int insert_variable(int table[], int buckets, const struct reflected_variable variables[], int index)
+{
+	const struct reflected_variable* v = &variables[index];
+	unsigned h = v->hash & (buckets - 1);
+	while (table[h] != 0) {
+		const struct reflected_variable* other = &variables[table[h] - 1];
+		if (other->hash == v->hash) {
+			printf("\"%s\" and \"%s\" have the same name hash %08x\n", other->name, v->name, v->hash);
+			return -1;
+		}
+		h = (h + 1) & (buckets - 1);
+	}
+	table[h] = index + 1;
+	return 0;
+}
+
+static struct reflected_variable* find_variable(struct reflected_variable variables[], const int table[], int buckets, unsigned hash)
+{
+	unsigned h = hash & (buckets - 1);
+	while (table[h] != 0) {
+		struct reflected_variable* v = &variables[table[h] - 1];
+		if (v->hash == hash) {
+			return v;
+		}
+		h = (h + 1) & (buckets - 1);
+	}
+	return NULL;
+}
+
+static int reflect_variables(struct program_reflection* r, int uniforms)
+{
+	GLuint program = r->program;
+	GLint count = 0;
+	GLint max_length = 0;
+	if (uniforms) {
+		glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+	} else {
+		glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+		glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_length);
+	}
+
+	struct reflected_variable* variables = (struct reflected_variable*)malloc(sizeof(struct reflected_variable) * (count + 1));
+	int* table = (int*)malloc(sizeof(int) * r->buckets);
+	if ((variables == NULL) || (table == NULL)) {
+		free(variables);
+		free(table);
+		return -1;
+	}
+	memset(variables, 0, sizeof(struct reflected_variable) * (count + 1));
+	memset(table, 0, sizeof(int) * r->buckets);
+	if (uniforms) {
+		r->uniforms = variables;
+		r->uniform_table = table;
+	} else {
+		r->attribs = variables;
+		r->attrib_table = table;
+	}
+
+	int i;
+	for (i = 0; i < count; i++) {
+		struct reflected_variable* v = &variables[i];
+		v->name = (char*)malloc(max_length + 1);
+		if (v->name == NULL) {
+			return -1;
+		}
+		if (uniforms) {
+			r->uniform_count++;
+		} else {
+			r->attrib_count++;
+		}
+
+		if (uniforms) {
+			glGetActiveUniform(program, i, max_length + 1, NULL, &v->size, &v->type, v->name);
+			v->location = glGetUniformLocation(program, v->name);
+		} else {
+			glGetActiveAttrib(program, i, max_length + 1, NULL, &v->size, &v->type, v->name);
+			v->location = glGetAttribLocation(program, v->name);
+		}
+
+		size_t n = strlen(v->name);
+		if ((n > 3) && (strcmp(&v->name[n - 3], "[0]") == 0)) {
+			v->name[n - 3] = '\0';
+		}
+		v->hash = ugles2_name_hash(v->name);
+		v->components = uniform_components(v->type);
+
+		if (uniforms) {
+			v->value = malloc(sizeof(GLfloat) * v->components * v->size);
+			if (v->value == NULL) {
+				return -1;
+			}
+		}
+		if (insert_variable(table, r->buckets, variables, i) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void free_reflection(struct program_reflection* r)
+{
+	int i;
+	for (i = 0; i < r->uniform_count; i++) {
+		free(r->uniforms[i].name);
+		free(r->uniforms[i].value);
+	}
+	for (i = 0; i < r->attrib_count; i++) {
+		free(r->attribs[i].name);
+	}
+	free(r->uniforms);
+	free(r->uniform_table);
+	free(r->attribs);
+	free(r->attrib_table);
+	free(r);
+}
+
+static void detach_reflection(struct program_reflection* reflection)
+{
+	reflection->cached = NULL;
+}
+
+static struct cached_program* find_cached_entry(GLuint program)
+{
+	struct program_cache* cache = current_program_cache();
+	if (cache != NULL) {
+		struct cached_program* p;
+		for (p = cache->programs; p != NULL; p = p->next) {
+			if (p->program == program) {
+				return p;
+			}
+		}
+	}
+	return NULL;
+}
+
+void* ugles2_reflect_program(GLuint program)
+{
+	if (program == 0) {
+		return NULL;
+	}
+
+	// a program shared through the cache has one reflection; other programs get a new one each call
+	struct cached_program* cached = find_cached_entry(program);
+	if ((cached != NULL) && (cached->reflection != NULL)) {
+		cached->reflection->refs++;
+		return cached->reflection;
+	}
+
+	struct program_reflection* r = (struct program_reflection*)malloc(sizeof(struct program_reflection));
+	if (r == NULL) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->program = program;
+	r->refs = 1;
+
+	GLint uniforms = 0;
+	GLint attribs = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &uniforms);
+	glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &attribs);
+	int max = (uniforms > attribs)? uniforms : attribs;
+	r->buckets = 8;
+	while (r->buckets < max * 2) {
+		r->buckets *= 2;
+	}
+
+	if ((reflect_variables(r, 1) != 0) || (reflect_variables(r, 0) != 0)) {
+		free_reflection(r);
+		return NULL;
+	}
+
+	if (cached != NULL) {
+		cached->reflection = r;
+		r->cached = cached;
+	}
+
+	return r;
+}
+
+void ugles2_destroy_reflection(void* reflection)
+{
+	struct program_reflection* r = (struct program_reflection*)reflection;
+	if ((r == NULL) || (--r->refs > 0)) {
+		return;
+	}
+	if (r->cached != NULL) {
+		r->cached->reflection = NULL;
+	}
+	free_reflection(r);
+}
+
+GLuint ugles2_compile_reflected_program(const char vshader_src[], const char fshader_src[], void** reflection)
+{
+	GLuint program = ugles2_compile_program(vshader_src, fshader_src);
+	if (reflection != NULL) {
+		*reflection = ugles2_reflect_program(program);
+	}
+	return program;
+}
+
+GLint ugles2_uniform_location(void* reflection, unsigned hash)
+{
+	struct program_reflection* r = (struct program_reflection*)reflection;
+	struct reflected_variable* v = find_variable(r->uniforms, r->uniform_table, r->buckets, hash);
+	return (v != NULL)? v->location : -1;
+}
+
+GLint ugles2_attrib_location(void* reflection, unsigned hash)
+{
+	struct program_reflection* r = (struct program_reflection*)reflection;
+	struct reflected_variable* v = find_variable(r->attribs, r->attrib_table, r->buckets, hash);
+	return (v != NULL)? v->location : -1;
+}
+
+int ugles2_set_uniform(void* reflection, unsigned hash, const void* values, int count)
+{
+	struct program_reflection* r = (struct program_reflection*)reflection;
+	struct reflected_variable* v = find_variable(r->uniforms, r->uniform_table, r->buckets, hash);
+	if ((v == NULL) || (v->components == 0) || (count <= 0)) {
+		return -1;
+	}
+	if (count > v->size) {
+		count = v->size;
+	}
+
+	size_t bytes = sizeof(GLfloat) * v->components * count;
+	if (v->has_value && (memcmp(v->value, values, bytes) == 0)) {
+		return 0;
+	}
+	memcpy(v->value, values, bytes);
+	v->has_value = 1;	// elements past count are left as they were
+
+	const GLfloat* f = (const GLfloat*)values;
+	const GLint* i = (const GLint*)values;
+	switch (v->type) {
+	case GL_FLOAT:      glUniform1fv(v->location, count, f); break;
+	case GL_FLOAT_VEC2: glUniform2fv(v->location, count, f); break;
+	case GL_FLOAT_VEC3: glUniform3fv(v->location, count, f); break;
+	case GL_FLOAT_VEC4: glUniform4fv(v->location, count, f); break;
+	case GL_FLOAT_MAT2: glUniformMatrix2fv(v->location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT3: glUniformMatrix3fv(v->location, count, GL_FALSE, f); break;
+	case GL_FLOAT_MAT4: glUniformMatrix4fv(v->location, count, GL_FALSE, f); break;
+	case GL_INT_VEC2:
+	case GL_BOOL_VEC2:  glUniform2iv(v->location, count, i); break;
+	case GL_INT_VEC3:
+	case GL_BOOL_VEC3:  glUniform3iv(v->location, count, i); break;
+	case GL_INT_VEC4:
+	case GL_BOOL_VEC4:  glUniform4iv(v->location, count, i); break;
+	default:            glUniform1iv(v->location, count, i); break;
+	}
+
+	return 1;
+}
+
+void ugles2_invalidate_uniforms(void* reflection)
+{
+	struct program_reflection* r = (struct program_reflection*)reflection;
+	int i;
+	for (i = 0; i < r->uniform_count; i++) {
+		r->uniforms[i].has_value = 0;
+	}
+}
+
+// =============================================================================
+// blend
+
+// coverage over RGBA, straight alpha (default):
+//   out_a = sa + (da * (255 - sa)) / 255
+//   out_c = (sa * c * 255 + da * dc * (255 - sa)) / (out_a * 255)
+// premultiplied (UGLES2_BLEND_PREMULTIPLIED):
+//   out_c = (sa * c + dc * (255 - sa)) / 255
+// all divisions truncate (DIV255).
+#define SATURATE8(v) (((v) > 255)? 255 : (v))
+
+static void blend_row_scalar(GLubyte dst[], const unsigned char src[], int n
+	, GLubyte red, GLubyte green, GLubyte blue, int flags)
+{
+	int i;
+	for (i = 0; i < n; i++, dst += 4) {
+		unsigned src_a = src[i];
+		unsigned inv   = 255 - src_a;
+		unsigned t     = dst[3] * inv;
+		unsigned out_a = src_a + DIV255(t);
+
+		if (flags & UGLES2_BLEND_PREMULTIPLIED) {
+			dst[0] = DIV255(src_a * red   + dst[0] * inv);
+			dst[1] = DIV255(src_a * green + dst[1] * inv);
+			dst[2] = DIV255(src_a * blue  + dst[2] * inv);
+			dst[3] = out_a;
+		} else if (out_a == 0) {
+			dst[0] = dst[1] = dst[2] = dst[3] = 0;
+		} else if (src_a == 255) {
+			dst[0] = red;
+			dst[1] = green;
+			dst[2] = blue;
+			dst[3] = 255;
+		} else if (src_a != 0) {
+			unsigned d = out_a * 255;
+			unsigned r = (src_a * red   * 255 + t * dst[0]) / d;
+			unsigned g = (src_a * green * 255 + t * dst[1]) / d;
+			unsigned b = (src_a * blue  * 255 + t * dst[2]) / d;
+			dst[0] = SATURATE8(r);
+			dst[1] = SATURATE8(g);
+			dst[2] = SATURATE8(b);
+			dst[3] = out_a;
+		}
+	}
+}
+
+// only premultiplied blending has kernels: the straight alpha divide by out_a
+// was no faster vectorized than the scalar loop with its 0/255 shortcuts.
+#if defined(__SSE2__) && !defined(UGLES2_NO_SIMD)
+#include <emmintrin.h>
+#define BLEND_KERNEL "sse2"
+
+static inline __m128i div255_epi32(__m128i v)
+{
+	return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(v, _mm_set1_epi32(1)), _mm_srli_epi32(v, 8)), 8);
+}
+
+static int blend_row_simd(GLubyte dst[], const unsigned char src[], int n
+	, GLubyte red, GLubyte green, GLubyte blue)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i c255 = _mm_set1_epi32(255);
+	const __m128i cr   = _mm_set1_epi32(red);
+	const __m128i cg   = _mm_set1_epi32(green);
+	const __m128i cb   = _mm_set1_epi32(blue);
+	const __m128i solid = _mm_set1_epi32(red | green << 8 | blue << 16 | 0xff000000U);
+
+	int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		uint32_t coverage;
+		memcpy(&coverage, &src[i], 4);
+		if (coverage == 0) {
+			continue;
+		}
+		if (coverage == 0xffffffffU) {
+			_mm_storeu_si128((__m128i*)&dst[i*4], solid);
+			continue;
+		}
+
+		__m128i d  = _mm_loadu_si128((const __m128i*)&dst[i*4]);
+		__m128i sa = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(coverage), zero), zero);
+		__m128i dr = _mm_and_si128(d, mask);
+		__m128i dg = _mm_and_si128(_mm_srli_epi32(d,  8), mask);
+		__m128i db = _mm_and_si128(_mm_srli_epi32(d, 16), mask);
+		__m128i da = _mm_srli_epi32(d, 24);
+
+		__m128i inv   = _mm_sub_epi32(c255, sa);
+		__m128i out_a = _mm_add_epi32(sa, div255_epi32(_mm_mullo_epi16(da, inv)));
+		__m128i r = div255_epi32(_mm_add_epi32(_mm_mullo_epi16(sa, cr), _mm_mullo_epi16(dr, inv)));
+		__m128i g = div255_epi32(_mm_add_epi32(_mm_mullo_epi16(sa, cg), _mm_mullo_epi16(dg, inv)));
+		__m128i b = div255_epi32(_mm_add_epi32(_mm_mullo_epi16(sa, cb), _mm_mullo_epi16(db, inv)));
+
+		__m128i out = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(out_a, 24)));
+		_mm_storeu_si128((__m128i*)&dst[i*4], out);
+	}
+
+	return i;
+}
+
+#elif defined(__ARM_NEON__) && !defined(UGLES2_NO_SIMD)
+#include <arm_neon.h>
+#define BLEND_KERNEL "neon"
+
+static inline uint16x8_t div255_u16(uint16x8_t v)
+{
+	return vshrq_n_u16(vaddq_u16(vaddq_u16(v, vdupq_n_u16(1)), vshrq_n_u16(v, 8)), 8);
+}
+
+static int blend_row_simd(GLubyte dst[], const unsigned char src[], int n
+	, GLubyte red, GLubyte green, GLubyte blue)
+{
+	const GLubyte color[3] = { red, green, blue };
+
+	int i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint8x8x4_t d = vld4_u8(&dst[i*4]);
+		uint8x8_t sa  = vld1_u8(&src[i]);
+		uint8x8_t inv = vmvn_u8(sa);
+		uint16x8_t out_a = vaddw_u8(div255_u16(vmull_u8(d.val[3], inv)), sa);
+		int c;
+		for (c = 0; c < 3; c++) {
+			uint16x8_t v = vmlal_u8(vmull_u8(sa, vdup_n_u8(color[c])), d.val[c], inv);
+			d.val[c] = vmovn_u16(div255_u16(v));
+		}
+		d.val[3] = vmovn_u16(out_a);
+		vst4_u8(&dst[i*4], d);
+	}
+
+	return i;
+}
+
+#else
+#define BLEND_KERNEL "scalar"
+
+static int blend_row_simd(GLubyte dst[], const unsigned char src[], int n
+	, GLubyte red, GLubyte green, GLubyte blue)
+{
+	return 0;
+}
+#endif
+
+void ugles2_blend_coverage(GLubyte pixels[], int width, int height, int x, int y
+					, GLubyte red, GLubyte green, GLubyte blue
+					, const unsigned char coverage[], int coverage_width, int coverage_pitch, int coverage_height, int flags)
+{
+	// clip once; rows of pixels are bottom-up, y counts from the top
+	int i0 = (x < 0)? -x : 0;
+	int j0 = (y < 0)? -y : 0;
+	int i1 = (x + coverage_width  > width )? width  - x : coverage_width;
+	int j1 = (y + coverage_height > height)? height - y : coverage_height;
+	if ((i0 >= i1) || (j0 >= j1)) {
+		return;
+	}
+
+	int n = i1 - i0;
+	int j;
+	for (j = j0; j < j1; j++) {
+		GLubyte* dst = &pixels[((height - (y + j) - 1)*width + (x + i0))*4];
+		const unsigned char* src = &coverage[j*coverage_pitch + i0];
+		int done = 0;
+		if ((flags & (UGLES2_BLEND_PREMULTIPLIED | UGLES2_BLEND_SCALAR)) == UGLES2_BLEND_PREMULTIPLIED) {
+			done = blend_row_simd(dst, src, n, red, green, blue);
+		}
+		blend_row_scalar(&dst[done*4], &src[done], n - done, red, green, blue, flags);
+	}
+}
+
+const char* ugles2_blend_kernel(void)
+{
+	return BLEND_KERNEL;
+}
+
+
+// =============================================================================
+// text
+
+#if defined(USE_FREETYPE)
+static void print_slot(FT_GlyphSlot slot)
+{
+	FT_Bitmap *bitmap = &slot->bitmap;
+
+	printf("left:%d top:%d width:%d height:%d pitch:%d\n"
+			, slot->bitmap_left, slot->bitmap_top
+			, bitmap->width, bitmap->rows, bitmap->pitch);
+
+	int i, j;
+	unsigned char* p = (unsigned char*)bitmap->buffer;
+	printf("+");
+	for (i = 0; i < bitmap->width; i++) {
+		printf("---");
+	}
+	printf("+\n");
+	for (j = 0; j < bitmap->rows; j++) {
+		printf("|");
+		for (i = 0; i < bitmap->width; i++) {
+			unsigned char byte = p[j*bitmap->pitch+i];
+			if (byte != 0) {
+				printf("%02x ", byte);
+			} else {
+				printf("   ");
+			}
+		}
+		printf("|\n");
+	}
+	printf("+");
+	for (i = 0; i < bitmap->width; i++) {
+		printf("---");
+	}
+	printf("+\n");
+}
+
+static FT_ULong get_charcode(const char str[], const char** next)
+{
+	const unsigned char* s = (const unsigned char*)str;
+
+	if (s[0] == '\0') {
+		*next = NULL;
+		return 0;
+	}
+
+	if (s[0] < 0x80UL) {
+		*next = &str[1];
+		return s[0];
+	}
+
+	if (s[1] == '\0') {
+		*next = NULL;
+		return 0;
+	}
+
+	if ((0xc2 <= s[0]) && (s[0] <= 0xdf)) {
+		*next = &str[2];
+		return (s[0] & 0x3f) << 6 | s[1] & 0x3f;
+	}
+
+	if (s[2] == '\0') {
+		*next = NULL;
+		return 0;
+	}
+
+	if ((0xe0 <= s[0]) && (s[0] <= 0xef)) {
+		*next = &str[3];
+		return (s[0] & 0x0f) << 12 | (s[1] & 0x3f) << 6 | s[2] & 0x3f;
+	}
+
+	if (s[3] == '\0') {
+		*next = NULL;
+		return 0;
+	}
+
+	if ((0xf0 <= s[0]) && (s[0] <= 0xf7)) {
+		*next = &str[4];
+		return (s[0] & 0x0f) << 18 | (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6 | s[3] & 0x3f;
+	}
+
+#if 0
+	if (s[4] == '\0') {
+		*next = NULL;
+		return 0;
+	}
+
+	if ((0xf8 <= s[0]) && (s[0] <= 0xfb)) {
+		*next = &str[5];
+		return (s[0] & 0x07) << 24 | (s[1] & 0x3f) << 18 | (s[2] & 0x3f) << 12 | (s[3] & 0x3f << 6) | s[4] & 0x3f;
+	}
+#endif
+
+	*next = NULL;
+	return 0;
+}
+
+static unsigned glyph_hash(FT_Face face, int size, FT_UInt index)
+{
+	unsigned h = (unsigned)((uintptr_t)face >> 4);
+	h = h * 31U + (unsigned)size;
+	h = h * 2654435761U + (unsigned)index;
+	return h ^ (h >> 16);
+}
+
+static void clear_glyph_cache(struct freetype_context* ft)
+{
+	int i;
+	for (i = 0; i < ft->glyph_buckets; i++) {
+		struct glyph* glyph = ft->glyphs[i];
+		while (glyph != NULL) {
+			struct glyph* next = glyph->next;
+			free(glyph->bitmap);
+			free(glyph);
+			glyph = next;
+		}
+		ft->glyphs[i] = NULL;
+	}
+	ft->glyph_count = 0;
+	ft->pixel_size  = 0;
+	ft->cache_generation++;
+
+	while (ft->sizes != NULL) {
+		struct font_size* next = ft->sizes->next;
+		free(ft->sizes->pairs);
+		free(ft->sizes);
+		ft->sizes = next;
+	}
+
+	// packed glyphs are gone, so the atlas starts over
+	ft->atlas.shelf_x = 0;
+	ft->atlas.shelf_y = 0;
+	ft->atlas.shelf_h = 0;
+}
+
+static int grow_glyph_cache(struct freetype_context* ft)
+{
+	int buckets = (ft->glyph_buckets == 0)? GLYPH_CACHE_BUCKETS : ft->glyph_buckets * 2;
+	struct glyph** glyphs = (struct glyph**)malloc(sizeof(struct glyph*) * buckets);
+	if (glyphs == NULL) {
+		return -1;
+	}
+	memset(glyphs, 0, sizeof(struct glyph*) * buckets);
+
+	int i;
+	for (i = 0; i < ft->glyph_buckets; i++) {
+		struct glyph* glyph = ft->glyphs[i];
+		while (glyph != NULL) {
+			struct glyph* next = glyph->next;
+			unsigned h = glyph_hash(glyph->face, glyph->size, glyph->index) & (buckets - 1);
+			glyph->next = glyphs[h];
+			glyphs[h] = glyph;
+			glyph = next;
+		}
+	}
+
+	free(ft->glyphs);
+	ft->glyphs = glyphs;
+	ft->glyph_buckets = buckets;
+
+	return 0;
+}
+
+static void set_pixel_size(struct freetype_context* ft, int font_size)
+{
+	if (ft->pixel_size != font_size) {
+		//FT_Set_Char_Size(ft->face, 0, 16*64, width, height);
+		FT_Set_Pixel_Sizes(ft->face, 0, font_size);
+		ft->pixel_size = font_size;
+	}
+}
+
+static struct font_size* get_font_size(struct freetype_context* ft, int font_size)
+{
+	struct font_size* size;
+	for (size = ft->sizes; size != NULL; size = size->next) {
+		if ((size->size == font_size) && (size->face == ft->face)) {
+			return size;
+		}
+	}
+
+	size = (struct font_size*)malloc(sizeof(struct font_size));
+	if (size == NULL) {
+		return NULL;
+	}
+	memset(size, 0, sizeof(*size));
+
+	set_pixel_size(ft, font_size);
+	FT_Size_Metrics* metrics = &ft->face->size->metrics;
+	size->face      = ft->face;
+	size->size      = font_size;
+	size->ascender  = (metrics->ascender + 63) >> 6;
+	size->descender = (-metrics->descender + 63) >> 6;
+	size->height    = (metrics->height + 63) >> 6;
+	size->has_kerning = FT_HAS_KERNING(ft->face)? 1 : 0;
+
+	size->next = ft->sizes;
+	ft->sizes = size;
+
+	return size;
+}
+
+static unsigned kerning_hash(FT_UInt left, FT_UInt right)
+{
+	unsigned h = (unsigned)left * 2654435761U ^ (unsigned)right * 40503U;
+	return h ^ (h >> 15);
+}
+
+static int grow_kerning_table(struct font_size* size)
+{
+	int buckets = (size->pair_buckets == 0)? KERNING_BUCKETS : size->pair_buckets * 2;
+	struct kerning_pair* pairs = (struct kerning_pair*)malloc(sizeof(struct kerning_pair) * buckets);
+	if (pairs == NULL) {
+		return -1;
+	}
+	memset(pairs, 0, sizeof(struct kerning_pair) * buckets);
+
+	int i;
+	for (i = 0; i < size->pair_buckets; i++) {
+		struct kerning_pair* pair = &size->pairs[i];
+		if (pair->left != 0) {
+			unsigned h = kerning_hash(pair->left, pair->right) & (buckets - 1);
+			while (pairs[h].left != 0) {
+				h = (h + 1) & (buckets - 1);
+			}
+			pairs[h] = *pair;
+		}
+	}
+
+	free(size->pairs);
+	size->pairs = pairs;
+	size->pair_buckets = buckets;
+
+	return 0;
+}
+
+// horizontal kerning in 26.6, unfitted so it accumulates with the pen.
+// each pair asks FreeType once per (face, size); later lookups hit the table.
+static FT_Pos get_kerning(struct freetype_context* ft, struct font_size* size, FT_UInt left, FT_UInt right)
+{
+	if (!size->has_kerning || (left == 0) || (right == 0)) {
+		return 0;
+	}
+
+	if ((size->pair_count + 1) * 2 > size->pair_buckets) {
+		if (grow_kerning_table(size) != 0) {
+			return 0;
+		}
+	}
+
+	unsigned mask = size->pair_buckets - 1;
+	unsigned h = kerning_hash(left, right) & mask;
+	while (size->pairs[h].left != 0) {
+		if ((size->pairs[h].left == left) && (size->pairs[h].right == right)) {
+			return size->pairs[h].delta;
+		}
+		h = (h + 1) & mask;
+	}
+
+	FT_Vector delta;
+	set_pixel_size(ft, size->size);
+	if (FT_Get_Kerning(ft->face, left, right, FT_KERNING_UNFITTED, &delta) != 0) {
+		delta.x = 0;
+	}
+
+	size->pairs[h].left  = left;
+	size->pairs[h].right = right;
+	size->pairs[h].delta = delta.x;
+	size->pair_count++;
+
+	return delta.x;
+}
+
+// need_bitmap == 0 only loads the outline for metrics; the glyph is rendered
+// the first time a caller actually needs coverage.
+static struct glyph* get_glyph(struct freetype_context* ft, int font_size, FT_UInt index, int need_bitmap)
+{
+	FT_Face face = ft->face;
+	unsigned h = glyph_hash(face, font_size, index);
+	struct glyph* glyph = NULL;
+
+	if (ft->glyph_buckets > 0) {
+		for (glyph = ft->glyphs[h & (ft->glyph_buckets - 1)]; glyph != NULL; glyph = glyph->next) {
+			if ((glyph->index == index) && (glyph->size == font_size) && (glyph->face == face)) {
+				break;
+			}
+		}
+	}
+	if ((glyph != NULL) && (glyph->has_bitmap || !need_bitmap)) {
+		return glyph;
+	}
+
+	set_pixel_size(ft, font_size);
+
+	FT_GlyphSlot slot = face->glyph;
+	if (FT_Load_Glyph(face, index, FT_LOAD_DEFAULT) != 0) {
+		printf("FT_Load_Glyph() failed. \n");
+		return NULL;
+	}
+	if (need_bitmap && (FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL) != 0)) {
+		printf("FT_Render_Glyph() failed. \n");
+		return NULL;
+	}
+
+	//print_slot(slot);
+
+	if (glyph == NULL) {
+		if (ft->glyph_count >= ft->glyph_buckets * 2) {
+			if (grow_glyph_cache(ft) != 0) {
+				return NULL;
+			}
+		}
+
+		glyph = (struct glyph*)malloc(sizeof(struct glyph));
+		if (glyph == NULL) {
+			return NULL;
+		}
+		memset(glyph, 0, sizeof(*glyph));
+		glyph->face    = face;
+		glyph->size    = font_size;
+		glyph->index   = index;
+		glyph->advance = slot->advance.x;
+		glyph->ascent  = (slot->metrics.horiBearingY + 63) >> 6;
+		glyph->descent = (slot->metrics.height - slot->metrics.horiBearingY + 63) >> 6;
+		glyph->atlas_x = -1;
+		glyph->atlas_y = -1;
+
+		h &= ft->glyph_buckets - 1;
+		glyph->next = ft->glyphs[h];
+		ft->glyphs[h] = glyph;
+		ft->glyph_count++;
+	}
+
+	if (!need_bitmap) {
+		return glyph;
+	}
+
+	FT_Bitmap* bitmap = &slot->bitmap;
+	glyph->left   = slot->bitmap_left;
+	glyph->top    = slot->bitmap_top;
+	glyph->width  = bitmap->width;
+	glyph->rows   = bitmap->rows;
+
+	if (glyph->width * glyph->rows > 0) {
+		glyph->bitmap = (unsigned char*)malloc(glyph->width * glyph->rows);
+		if (glyph->bitmap == NULL) {
+			return NULL;
+		}
+		int pitch = (bitmap->pitch < 0)? -bitmap->pitch : bitmap->pitch;
+		int j;
+		for (j = 0; j < glyph->rows; j++) {
+			memcpy(&glyph->bitmap[j*glyph->width], &bitmap->buffer[j*pitch], glyph->width);
+		}
+	}
+	glyph->has_bitmap = 1;
+
+	return glyph;
+}
+
+static int open_glyph_atlas(struct glyph_atlas* atlas)
+{
+	const char vshader_src[] =
+		"attribute vec2 a_position;\n"
+		"attribute vec2 a_texture;\n"
+		"varying   vec2 v_texture;\n"
+		"uniform   vec2 u_screen;\n"
+		"uniform   vec2 u_offset;\n"
+		"\n"
+		"void main(void) {\n"
+		"  vec2 p = a_position + u_offset;\n"
+		"  v_texture = a_texture;\n"
+		"  gl_Position = vec4(p.x / u_screen.x * 2.0 - 1.0, 1.0 - p.y / u_screen.y * 2.0, 0.0, 1.0);\n"
+		"}\n";
+
+	const char fshader_src[] =
+		"precision mediump float;\n"
+		"varying   vec2  v_texture;\n"
+		"uniform   vec4  u_color;\n"
+		"uniform   sampler2D u_texture;\n"
+		"void main()\n"
+		"{\n"
+		"  gl_FragColor = vec4(u_color.rgb, u_color.a * texture2D(u_texture, v_texture).a);\n"
+		"}\n";
+
+	atlas->program = ugles2_compile_program(vshader_src, fshader_src);
+	if (atlas->program == 0) {
+		return -1;
+	}
+	atlas->a_position = glGetAttribLocation(atlas->program, "a_position");
+	atlas->a_texture  = glGetAttribLocation(atlas->program, "a_texture");
+	atlas->u_screen   = glGetUniformLocation(atlas->program, "u_screen");
+	atlas->u_offset   = glGetUniformLocation(atlas->program, "u_offset");
+	atlas->u_color    = glGetUniformLocation(atlas->program, "u_color");
+	atlas->u_texture  = glGetUniformLocation(atlas->program, "u_texture");
+
+	int i;
+	for (i = 0; i < GLYPH_ATLAS_QUADS; i++) {
+		atlas->indices[i*6  ] = i*4;
+		atlas->indices[i*6+1] = i*4+1;
+		atlas->indices[i*6+2] = i*4+2;
+		atlas->indices[i*6+3] = i*4+2;
+		atlas->indices[i*6+4] = i*4+1;
+		atlas->indices[i*6+5] = i*4+3;
+	}
+
+	atlas->width  = GLYPH_ATLAS_SIZE;
+	atlas->height = GLYPH_ATLAS_SIZE;
+	glGenTextures(1, &atlas->texture);
+	glBindTexture(GL_TEXTURE_2D, atlas->texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, atlas->width, atlas->height, 0, GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	return 0;
+}
+
+static void close_glyph_atlas(struct glyph_atlas* atlas)
+{
+	if (atlas->texture != 0) {
+		glDeleteTextures(1, &atlas->texture);
+		atlas->texture = 0;
+	}
+	if (atlas->program != 0) {
+		ugles2_delete_program(atlas->program);
+		atlas->program = 0;
+	}
+}
+
+// shelf packing: glyphs are placed left to right on the current shelf,
+// a new shelf starts below the tallest glyph when the row is full.
+static int pack_glyph(struct glyph_atlas* atlas, struct glyph* glyph)
+{
+	int w = glyph->width + 1;
+	int h = glyph->rows + 1;
+	if (atlas->shelf_x + w > atlas->width) {
+		atlas->shelf_y += atlas->shelf_h;
+		atlas->shelf_x = 0;
+		atlas->shelf_h = 0;
+	}
+	if ((w > atlas->width) || (atlas->shelf_y + h > atlas->height)) {
+		return -1;
+	}
+
+	glyph->atlas_x = atlas->shelf_x;
+	glyph->atlas_y = atlas->shelf_y;
+	glyph->atlas_generation = atlas->generation;
+	atlas->shelf_x += w;
+	if (atlas->shelf_h < h) {
+		atlas->shelf_h = h;
+	}
+
+	// the atlas texture is bound by bind_glyph_atlas()
+	GLint unpack_alignment;
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, glyph->atlas_x, glyph->atlas_y, glyph->width, glyph->rows, GL_ALPHA, GL_UNSIGNED_BYTE, glyph->bitmap);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
+
+	return 0;
+}
+
+static void reset_glyph_atlas(struct glyph_atlas* atlas)
+{
+	atlas->shelf_x = 0;
+	atlas->shelf_y = 0;
+	atlas->shelf_h = 0;
+	atlas->generation++;
+}
+
+static int is_glyph_packed(struct glyph_atlas* atlas, struct glyph* glyph)
+{
+	return (glyph->atlas_x >= 0) && (glyph->atlas_generation == atlas->generation);
+}
+
+static void draw_glyph_quads(struct glyph_atlas* atlas, const float vertices[], int quads)
+{
+	int i;
+	for (i = 0; i < quads; i += GLYPH_ATLAS_QUADS) {
+		int n = (quads - i < GLYPH_ATLAS_QUADS)? quads - i : GLYPH_ATLAS_QUADS;
+		glVertexAttribPointer(atlas->a_position, 2, GL_FLOAT, GL_FALSE, 16, &vertices[i*16  ]);
+		glVertexAttribPointer(atlas->a_texture , 2, GL_FLOAT, GL_FALSE, 16, &vertices[i*16+2]);
+		glDrawElements(GL_TRIANGLES, n * 6, GL_UNSIGNED_SHORT, atlas->indices);
+	}
+}
+
+static void flush_glyph_quads(struct glyph_atlas* atlas)
+{
+	draw_glyph_quads(atlas, atlas->vertices, atlas->quads);
+	atlas->quads = 0;
+}
+
+static void write_glyph_quad(struct glyph_atlas* atlas, struct glyph* glyph, float v[], float x, float y)
+{
+	float s0 = glyph->atlas_x / (float)atlas->width;
+	float t0 = glyph->atlas_y / (float)atlas->height;
+	float s1 = (glyph->atlas_x + glyph->width) / (float)atlas->width;
+	float t1 = (glyph->atlas_y + glyph->rows ) / (float)atlas->height;
+	float x1 = x + glyph->width;
+	float y1 = y + glyph->rows;
+
+	v[ 0] = x ; v[ 1] = y ; v[ 2] = s0; v[ 3] = t0;
+	v[ 4] = x1; v[ 5] = y ; v[ 6] = s1; v[ 7] = t0;
+	v[ 8] = x ; v[ 9] = y1; v[10] = s0; v[11] = t1;
+	v[12] = x1; v[13] = y1; v[14] = s1; v[15] = t1;
+}
+
+static int emit_glyph_quad(struct glyph_atlas* atlas, struct glyph* glyph, float x, float y)
+{
+	if ((glyph->width == 0) || (glyph->rows == 0)) {
+		return 0;
+	}
+
+	if (!is_glyph_packed(atlas, glyph) && (pack_glyph(atlas, glyph) != 0)) {
+		// atlas is full: draw what refers to the current contents, then start over
+		flush_glyph_quads(atlas);
+		reset_glyph_atlas(atlas);
+		if (pack_glyph(atlas, glyph) != 0) {
+			return -1;
+		}
+	}
+
+	if (atlas->quads == GLYPH_ATLAS_QUADS) {
+		flush_glyph_quads(atlas);
+	}
+
+	write_glyph_quad(atlas, glyph, &atlas->vertices[atlas->quads * 16], x, y);
+	atlas->quads++;
+
+	return 0;
+}
+
+static int bind_glyph_atlas(struct ugles2_context* context, struct glyph_atlas* atlas
+		, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha, float x, float y)
+{
+	if (atlas->program == 0) {
+		if (open_glyph_atlas(atlas) != 0) {
+			return -1;
+		}
+		forget_texture_bindings(context);
+	}
+
+	ugles2_use_program(context, atlas->program);
+	glUniform2f(atlas->u_screen, (float)context->width, (float)context->height);
+	glUniform2f(atlas->u_offset, x, y);
+	glUniform4f(atlas->u_color, red / 255.0f, green / 255.0f, blue / 255.0f, alpha / 255.0f);
+	glUniform1i(atlas->u_texture, 0);
+	ugles2_bind_texture(context, 0, GL_TEXTURE_2D, atlas->texture);
+	ugles2_bind_buffer(context, GL_ARRAY_BUFFER, 0);
+	ugles2_bind_buffer(context, GL_ELEMENT_ARRAY_BUFFER, 0);
+	ugles2_enable_vertex_attrib(context, atlas->a_position);
+	ugles2_enable_vertex_attrib(context, atlas->a_texture);
+
+	// quads are drawn from client memory that moves between calls
+	forget_attrib_pointer(context, atlas->a_position);
+	forget_attrib_pointer(context, atlas->a_texture);
 
 	return 0;
 }
 
-int ugles2_load_pixels(GLubyte* pixels, int width, int height, const char file[])
+static void release_text_resources(struct ugles2_context* context)
+{
+	if (context->freetype == NULL) {
+		return;
+	}
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
+	close_glyph_atlas(&ft->atlas);
+}
+
+#endif
+
+int ugles2_set_font(struct ugles2_context* context, const char file[])
+{
+#if defined(USE_FREETYPE)
+	if (context->freetype == NULL) {
+		return -1;
+	}
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
+
+	clear_glyph_cache(ft);
+	if (ft->face != NULL) {
+		FT_Done_Face(ft->face);
+		ft->face = NULL;
+	}
+
+	FT_Face face;
+	int res = FT_New_Face(ft->library, file, 0, &face);
+	if (res == 0) {
+		ft->face = face;
+		return 0;
+	} else if (res == FT_Err_Unknown_File_Format) {
+		return -2;
+	} else {
+		return -3;
+	}
+#else
+	return -1;
+#endif
+}
+
+int ugles2_set_memory_font(struct ugles2_context* context, void* buf, unsigned size)
+{
+#if defined(USE_FREETYPE)
+	if (context->freetype == NULL) {
+		return -1;
+	}
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
+
+	clear_glyph_cache(ft);
+	if (ft->face != NULL) {
+		FT_Done_Face(ft->face);
+		ft->face = NULL;
+	}
+
+	FT_Face face;
+	int res = FT_New_Memory_Face(ft->library, buf, size, 0, &face);
+	if (res == 0) {
+		ft->face = face;
+		return 0;
+	} else if (res == FT_Err_Unknown_File_Format) {
+		return -2;
+	} else {
+		return -3;
+	}
+#else
+	return -1;
+#endif
+}
+
+#if defined(USE_FREETYPE)
+static int draw_text(struct ugles2_context* context
+		, GLubyte pixels[], int width, int height
+		, int* draw_width, int* char_count
+		, const char text[], int font_size
+		, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+		, int x, int y)
 {
-	if (strlen(file) < 4) {
-		return 0;
+	if (context->freetype == NULL) {
+		return -1;
 	}
 
-	load_func load_image = get_load_func(filename_ext(file));
-	if (load_image == NULL) {
-		return 0;
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
+
+	if (ft->face == NULL) {
+		return -1;
 	}
 
-	int org_width  = width;
-	int org_height = height;
-	if (load_image(file, &width, &height, pixels) != 0) {
+	struct font_size* size = get_font_size(ft, font_size);
+	if (size == NULL) {
 		return -1;
 	}
 
-	return 0;
-}
+	const char *s = text;
+	int count = 0;
+	FT_Pos pen = 0;		// 26.6
+	FT_UInt prev = 0;
+	while ((s != NULL) && (*s != '\0')) {
+		FT_ULong charcode = get_charcode(s, &s);
+		if (charcode == 0) {
+			break;
+		}
 
-GLuint ugles2_create_texture(const GLubyte pixels[], int width, int height)
-{
-	GLuint texture;
-	glGenTextures(1, &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
+		FT_UInt index = FT_Get_Char_Index(ft->face, charcode);
+		struct glyph* glyph = get_glyph(ft, font_size, index, 1);
+		if (glyph == NULL) {
+			break;
+		}
+		pen += get_kerning(ft, size, prev, index);
 
-	GLenum format = GL_RGBA;
-	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+		int pos_x = x + (int)((pen + 32) >> 6) + glyph->left;
+		int pos_y = y + size->ascender - glyph->top;
+		if (pixels != NULL) {
+			ugles2_blend_coverage(pixels, width, height, pos_x, pos_y
+							, red, green, blue, glyph->bitmap, glyph->width, glyph->width, glyph->rows, ft->blend_flags);
+		}
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		pen += glyph->advance;
+		prev = index;
+		++count;
+	}
 
-	return texture;
+	if (char_count != NULL) {
+		*char_count = count;
+	}
+	if (draw_width != NULL) {
+		*draw_width = (int)((pen + 32) >> 6);
+	}
+
+	return 0;
 }
+#endif
 
+#if defined(USE_FREETYPE)
+// advances only: glyphs are loaded for metrics and never rasterized.
+// stops before the first character that would make the width exceed max_width (> 0).
+static int measure_text(struct ugles2_context* context
+		, struct ugles2_text_metrics* metrics, int advances[], int max_advances
+		, const char text[], int font_size, int max_width, const char** end)
+{
+	if (context->freetype == NULL) {
+		return -1;
+	}
 
-// =============================================================================
-// dump
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
 
-int ugles2_dump_png(struct ugles2_context* context, const char filename[])
-{
-#if defined(USE_PNG)
-	FILE* fp = NULL;
-	unsigned char* pixels = NULL;
-	png_structp png_ptr = NULL;
-	png_infop info_ptr = NULL;
-	int res = -2;
+	if (ft->face == NULL) {
+		return -1;
+	}
 
-	fp = fopen(filename, "wb");
-	if (fp == NULL) {
-		res = -2;
-		goto finish;
+	struct font_size* size = get_font_size(ft, font_size);
+	if (size == NULL) {
+		return -1;
 	}
 
-	int width  = context->width;
-	int height = context->height;
+	struct ugles2_text_metrics m;
+	memset(&m, 0, sizeof(m));
+	m.line_ascender  = size->ascender;
+	m.line_descender = size->descender;
+	m.line_height    = size->height;
 
-	pixels = (unsigned char*)malloc(width*height*4);
-	if (pixels == NULL) {
-		res = -3;
-		goto finish;
+	const char *s = text;
+	FT_Pos pen = 0;		// 26.6
+	FT_UInt prev = 0;
+	while ((s != NULL) && (*s != '\0')) {
+		const char* next;
+		FT_ULong charcode = get_charcode(s, &next);
+		if (charcode == 0) {
+			break;
+		}
+
+		FT_UInt index = FT_Get_Char_Index(ft->face, charcode);
+		struct glyph* glyph = get_glyph(ft, font_size, index, 0);
+		if (glyph == NULL) {
+			break;
+		}
+
+		// rounded pen positions, so the advances always add up to the width
+		FT_Pos end_pen = pen + get_kerning(ft, size, prev, index) + glyph->advance;
+		int advance = (int)((end_pen + 32) >> 6) - m.width;
+		if ((max_width > 0) && (m.width + advance > max_width)) {
+			break;
+		}
+		pen = end_pen;
+		prev = index;
+
+		if (m.count < max_advances) {
+			advances[m.count] = advance;
+		}
+		if (m.ascent < glyph->ascent) {
+			m.ascent = glyph->ascent;
+		}
+		if (m.descent < glyph->descent) {
+			m.descent = glyph->descent;
+		}
+		m.width += advance;
+		m.count++;
+		s = next;
 	}
-	memset(pixels, 0, width*height*4);
-	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (png_ptr == NULL) {
-		res = -4;
-		goto finish;
+	if (metrics != NULL) {
+		*metrics = m;
 	}
-	info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL) {
-		res = -5;
-		goto finish;
+	if (end != NULL) {
+		*end = s;
 	}
 
-	png_init_io(png_ptr, fp);
+	return 0;
+}
+#endif
 
-	png_set_IHDR(png_ptr, info_ptr, width, height
-				, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE
-				, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+int ugles2_text_size(struct ugles2_context* context, int* width, int* count, const char text[], int font_size)
+{
+#if defined(USE_FREETYPE)
+	struct ugles2_text_metrics metrics;
+	if (measure_text(context, &metrics, NULL, 0, text, font_size, 0, NULL) != 0) {
+		return -1;
+	}
+	if (width != NULL) {
+		*width = metrics.width;
+	}
+	if (count != NULL) {
+		*count = metrics.count;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
 
-	png_write_info(png_ptr, info_ptr);
+int ugles2_text_metrics(struct ugles2_context* context, struct ugles2_text_metrics* metrics
+					, int advances[], int max_advances, const char text[], int font_size)
+{
+#if defined(USE_FREETYPE)
+	return measure_text(context, metrics, advances, max_advances, text, font_size, 0, NULL);
+#else
+	return -1;
+#endif
+}
 
-	void** rows = malloc(height * sizeof(void*));
-	if (rows == NULL) {
-		res = -6;
-		goto finish;
+int ugles2_text_fit(struct ugles2_context* context, int* width, const char text[], int font_size, int max_width)
+{
+#if defined(USE_FREETYPE)
+	struct ugles2_text_metrics metrics;
+	const char* end = text;
+	if (measure_text(context, &metrics, NULL, 0, text, font_size, (max_width > 0)? max_width : 1, &end) != 0) {
+		return -1;
 	}
-	int i;
-	for (i = 0; i < height; i++) {
-		rows[i] = pixels + width*4*(height - i -1);
+	if (width != NULL) {
+		*width = metrics.width;
 	}
-	png_write_rows(png_ptr, rows, height);
+	return (end != NULL)? (int)(end - text) : (int)strlen(text);
+#else
+	return -1;
+#endif
+}
 
-	res = 0;
+int ugles2_draw_text(struct ugles2_context* context
+					, GLubyte* pixels, int width, int height
+					, const char text[], int font_size, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y)
+{
+#if defined(USE_FREETYPE)
+	return draw_text(context, pixels, width, height
+			, NULL, NULL
+			, text, font_size, red, green, blue, alpha
+			, x, y);
+#else
+	return -1;
+#endif
+}
 
-finish:
-	if (rows != NULL) {
-		free(rows);
+int ugles2_draw_text_atlas(struct ugles2_context* context
+					, const char text[], int font_size, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y)
+{
+#if defined(USE_FREETYPE)
+	if (context->freetype == NULL) {
+		return -1;
 	}
-	if (png_ptr != NULL) {
-		if (info_ptr != NULL) {
-			png_destroy_write_struct(&png_ptr, &info_ptr);
-		} else {
-			png_destroy_write_struct(&png_ptr, NULL);
-		}
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
+	if (ft->face == NULL) {
+		return -1;
 	}
-	if (pixels != NULL) {
-		free(pixels);
+
+	struct glyph_atlas* atlas = &ft->atlas;
+	if (bind_glyph_atlas(context, atlas, red, green, blue, alpha, 0.0f, 0.0f) != 0) {
+		return -1;
 	}
-	if (fp != NULL) {
-		fclose(fp);
+
+	struct font_size* size = get_font_size(ft, font_size);
+	if (size == NULL) {
+		return -1;
+	}
+
+	const char *s = text;
+	FT_Pos pen = 0;		// 26.6
+	FT_UInt prev = 0;
+	int res = 0;
+	while ((s != NULL) && (*s != '\0')) {
+		FT_ULong charcode = get_charcode(s, &s);
+		if (charcode == 0) {
+			break;
+		}
+
+		FT_UInt index = FT_Get_Char_Index(ft->face, charcode);
+		struct glyph* glyph = get_glyph(ft, font_size, index, 1);
+		if (glyph == NULL) {
+			break;
+		}
+		pen += get_kerning(ft, size, prev, index);
+
+		int pos_x = x + (int)((pen + 32) >> 6) + glyph->left;
+		int pos_y = y + size->ascender - glyph->top;
+		if (emit_glyph_quad(atlas, glyph, (float)pos_x, (float)pos_y) != 0) {
+			res = -1;
+			break;
+		}
+
+		pen += glyph->advance;
+		prev = index;
 	}
+	flush_glyph_quads(atlas);
 
 	return res;
 #else
@@ -840,284 +7646,743 @@ finish:
 #endif
 }
 
-
-
 // =============================================================================
-// text
+// text layout
 
 #if defined(USE_FREETYPE)
-static void blend_glyph_bitmap(
-	  GLubyte pixels[], int x, int y, int width, int height
-	, GLubyte red, GLubyte green, GLubyte blue
-	, unsigned char bitmap_buffer[], int bitmap_width, int bitmap_pitch, int bitmap_height)
+struct layout_item {
+	FT_UInt index;
+	struct glyph* glyph;
+	FT_Pos x;	// pen position in the box, 26.6
+	int y;		// baseline
+};
+
+struct text_layout {
+	struct freetype_context* ft;
+	FT_Face face;
+	int font_size;
+	int cache_generation;
+
+	struct layout_item* items;
+	int count;
+	int lines;
+	int width;
+	int height;
+
+	// atlas quads relative to the box origin, valid while the atlas generation is unchanged
+	float* vertices;
+	int quads;
+	int atlas_generation;
+};
+
+static int is_cjk(FT_ULong c)
 {
-	int i, j;
-	for (j = 0; j < bitmap_height; j++) {
-		for (i = 0; i < bitmap_width; i++) {
-			if ((x+i) < 0 || width <= (x+i) || (y+j) < 0 || height <= (y+j)) {
-				continue;
-			}
-			GLubyte dst_r = pixels[(height-(y+j)-1)*width*4 + (x+i)*4  ];
-			GLubyte dst_g = pixels[(height-(y+j)-1)*width*4 + (x+i)*4+1];
-			GLubyte dst_b = pixels[(height-(y+j)-1)*width*4 + (x+i)*4+2];
-			GLubyte dst_a = pixels[(height-(y+j)-1)*width*4 + (x+i)*4+3];
-
-			GLubyte src_a = bitmap_buffer[j*bitmap_pitch + i];
-			GLubyte out_a = (src_a * 255 + dst_a * (255 - src_a))/255;
-
-			if (out_a == 0) {
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4  ] = 0;
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4+1] = 0;
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4+2] = 0;
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4+3] = out_a;
-			} else {
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4  ] = (src_a * red   * 255 + dst_a * dst_r * (255 - src_a)) / (out_a * 255);
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4+1] = (src_a * green * 255 + dst_a * dst_g * (255 - src_a)) / (out_a * 255);
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4+2] = (src_a * blue  * 255 + dst_a * dst_b * (255 - src_a)) / (out_a * 255);
-				pixels[(height-(y+j)-1)*width*4 + (x+i)*4+3] = out_a;
-			}
+	return ((0x2e80 <= c) && (c <= 0x9fff))
+		|| ((0xac00 <= c) && (c <= 0xd7af))
+		|| ((0xf900 <= c) && (c <= 0xfaff))
+		|| ((0xff00 <= c) && (c <= 0xffef));
+}
+
+static void align_line(struct layout_item items[], int start, int end, FT_Pos line_width, int box_width, int align)
+{
+	FT_Pos offset = 0;
+	if (align == UGLES2_ALIGN_CENTER) {
+		offset = (((FT_Pos)box_width << 6) - line_width) / 2;
+	} else if (align == UGLES2_ALIGN_RIGHT) {
+		offset = ((FT_Pos)box_width << 6) - line_width;
+	}
+	if (offset != 0) {
+		int i;
+		for (i = start; i < end; i++) {
+			items[i].x += offset;
 		}
 	}
 }
 
-static void print_slot(FT_GlyphSlot slot)
+// resolves cached glyph pointers again after the glyph cache was cleared
+static int refresh_layout(struct text_layout* layout, int need_bitmap)
 {
-	FT_Bitmap *bitmap = &slot->bitmap;
-
-	printf("left:%d top:%d width:%d height:%d pitch:%d\n"
-			, slot->bitmap_left, slot->bitmap_top
-			, bitmap->width, bitmap->rows, bitmap->pitch);
-
-	int i, j;
-	unsigned char* p = (unsigned char*)bitmap->buffer;
-	printf("+");
-	for (i = 0; i < bitmap->width; i++) {
-		printf("---");
+	struct freetype_context* ft = layout->ft;
+	if (ft->face != layout->face) {
+		return -1;
 	}
-	printf("+\n");
-	for (j = 0; j < bitmap->rows; j++) {
-		printf("|");
-		for (i = 0; i < bitmap->width; i++) {
-			unsigned char byte = p[j*bitmap->pitch+i];
-			if (byte != 0) {
-				printf("%02x ", byte);
-			} else {
-				printf("   ");
+
+	int stale = (layout->cache_generation != ft->cache_generation);
+	int i;
+	for (i = 0; i < layout->count; i++) {
+		struct layout_item* item = &layout->items[i];
+		if (stale || (need_bitmap && !item->glyph->has_bitmap)) {
+			item->glyph = get_glyph(ft, layout->font_size, item->index, need_bitmap);
+			if (item->glyph == NULL) {
+				return -1;
 			}
 		}
-		printf("|\n");
 	}
-	printf("+");
-	for (i = 0; i < bitmap->width; i++) {
-		printf("---");
+	if (stale) {
+		layout->cache_generation = ft->cache_generation;
+		layout->atlas_generation = -1;
+	}
+
+	return 0;
+}
+
+// packs every glyph of the layout into the atlas and keeps the quads; -1 if they do not fit at once
+static int build_layout_quads(struct glyph_atlas* atlas, struct text_layout* layout)
+{
+	if (layout->vertices == NULL) {
+		layout->vertices = (float*)malloc(sizeof(float) * 16 * layout->count);
+		if (layout->vertices == NULL) {
+			return -1;
+		}
+	}
+
+	int retry;
+	for (retry = 0; retry < 2; retry++) {
+		int generation = atlas->generation;
+		int quads = 0;
+		int i;
+		for (i = 0; i < layout->count; i++) {
+			struct layout_item* item = &layout->items[i];
+			struct glyph* glyph = item->glyph;
+			if ((glyph->width == 0) || (glyph->rows == 0)) {
+				continue;
+			}
+			if (!is_glyph_packed(atlas, glyph) && (pack_glyph(atlas, glyph) != 0)) {
+				reset_glyph_atlas(atlas);
+				break;
+			}
+			float x = (float)((int)((item->x + 32) >> 6) + glyph->left);
+			float y = (float)(item->y - glyph->top);
+			write_glyph_quad(atlas, glyph, &layout->vertices[quads * 16], x, y);
+			quads++;
+		}
+		if ((i == layout->count) && (generation == atlas->generation)) {
+			layout->quads = quads;
+			layout->atlas_generation = generation;
+			return 0;
+		}
 	}
-	printf("+\n");
+
+	return -1;
 }
+#endif
 
-static FT_ULong get_charcode(const unsigned char s[], const char** next)
+void* ugles2_create_text_layout(struct ugles2_context* context, const char text[], int font_size, int box_width, int align)
 {
-	int len = strlen(s);
-	if (len == 0) {
-		*next = NULL;
-		return 0;
+#if defined(USE_FREETYPE)
+	if ((context->freetype == NULL) || (text == NULL)) {
+		return NULL;
 	}
-
-	if (s[0] < 0x80UL) {
-		*next = &s[1];
-		return s[0];
+	struct freetype_context* ft = (struct freetype_context*)context->freetype;
+	if (ft->face == NULL) {
+		return NULL;
 	}
 
-	if (len < 2) {
-		*next = NULL;
-		return 0;
+	struct font_size* size = get_font_size(ft, font_size);
+	if (size == NULL) {
+		return NULL;
 	}
 
-	if ((0xc2 <= s[0]) && (s[0] <= 0xdf)) {
-		*next = &s[2];
-		return (s[0] & 0x3f) << 6 | s[1] & 0x3f;
+	struct text_layout* layout = (struct text_layout*)malloc(sizeof(struct text_layout));
+	if (layout == NULL) {
+		return NULL;
 	}
-
-	if (len < 3) {
-		*next = NULL;
-		return 0;
+	memset(layout, 0, sizeof(*layout));
+	layout->ft = ft;
+	layout->face = ft->face;
+	layout->font_size = font_size;
+	layout->cache_generation = ft->cache_generation;
+	layout->atlas_generation = -1;
+
+	layout->items = (struct layout_item*)malloc(sizeof(struct layout_item) * (strlen(text) + 1));
+	if (layout->items == NULL) {
+		free(layout);
+		return NULL;
 	}
 
-	if ((0xe0 <= s[0]) && (s[0] <= 0xef)) {
-		*next = &s[3];
-		return (s[0] & 0x0f) << 12 | (s[1] & 0x3f) << 6 | s[2] & 0x3f;
-	}
+	// widths and the pen are 26.6 until the line is finished
+	int line_height = size->height;
+	int line_start  = 0;	// first item of the current line
+	FT_Pos line_width  = 0;	// up to the last non-space item
+	int break_item  = -1;	// first item after the last break opportunity
+	FT_Pos break_width = 0;	// line width before that item
+	FT_Pos max_width = 0;
+	FT_Pos pen = 0;
+	FT_Pos box = (FT_Pos)box_width << 6;
+	int y = size->ascender;
+	int count = 0;
+	FT_ULong prev = 0;
+	FT_UInt prev_index = 0;
 
-	if (len < 4) {
-		*next = NULL;
-		return 0;
-	}
+	const char* s = text;
+	while ((s != NULL) && (*s != '\0')) {
+		FT_ULong charcode = get_charcode(s, &s);
+		if (charcode == 0) {
+			break;
+		}
 
-	if ((0xf0 <= s[0]) && (s[0] <= 0xf7)) {
-		*next = &s[4];
-		return (s[0] & 0x0f) << 18 | (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6 | s[3] & 0x3f;
-	}
+		if (charcode == '\n') {
+			align_line(layout->items, line_start, count, line_width, box_width, align);
+			if (max_width < line_width) {
+				max_width = line_width;
+			}
+			layout->lines++;
+			y += line_height;
+			line_start = count;
+			line_width = 0;
+			break_item = -1;
+			pen = 0;
+			prev = 0;
+			prev_index = 0;
+			continue;
+		}
 
-#if 0
-	if (len < 5) {
-		*next = NULL;
-		return 0;
+		FT_UInt index = FT_Get_Char_Index(ft->face, charcode);
+		struct glyph* glyph = get_glyph(ft, font_size, index, 0);
+		if (glyph == NULL) {
+			break;
+		}
+		FT_Pos kerning = get_kerning(ft, size, prev_index, index);
+
+		if ((count > line_start) && (is_cjk(charcode) || is_cjk(prev)) && (prev != ' ')) {
+			break_item  = count;
+			break_width = line_width;
+		}
+
+		if ((box_width > 0) && (charcode != ' ') && (pen + kerning + glyph->advance > box + 32) && (count > line_start)) {
+			// wrap at the last opportunity, or before this character if the word fills the line
+			int next = ((break_item > line_start) && (break_item <= count))? break_item : count;
+			FT_Pos width = (next == break_item)? break_width : line_width;
+			align_line(layout->items, line_start, next, width, box_width, align);
+			if (max_width < width) {
+				max_width = width;
+			}
+			layout->lines++;
+			y += line_height;
+
+			// no kerning across the break
+			FT_Pos shift = (next < count)? layout->items[next].x : pen + kerning;
+			int i;
+			for (i = next; i < count; i++) {
+				layout->items[i].x -= shift;
+				layout->items[i].y  = y;
+			}
+			// the carried-over word holds no spaces, so it ends at the pen
+			pen -= shift;
+			line_width = pen;
+			line_start = next;
+			break_item = -1;
+		}
+
+		struct layout_item* item = &layout->items[count++];
+		item->index = index;
+		item->glyph = glyph;
+		item->x = pen + kerning;
+		item->y = y;
+		pen += kerning + glyph->advance;
+
+		if (charcode == ' ') {
+			break_item  = count;
+			break_width = line_width;
+		} else {
+			line_width = pen;
+		}
+		prev = charcode;
+		prev_index = index;
 	}
 
-	if ((0xf8 <= s[0]) && (s[0] <= 0xfb)) {
-		*next = &s[5];
-		return (s[0] & 0x07) << 24 | (s[1] & 0x3f) << 18 | (s[2] & 0x3f) << 12 | (s[3] & 0x3f << 6) | s[4] & 0x3f;
+	align_line(layout->items, line_start, count, line_width, box_width, align);
+	if (max_width < line_width) {
+		max_width = line_width;
 	}
+	layout->width = (int)((max_width + 32) >> 6);
+	layout->lines++;
+	layout->count  = count;
+	layout->height = layout->lines * line_height;
+
+	return layout;
+#else
+	return NULL;
 #endif
+}
 
-	*next = NULL;
-	return 0;
+void ugles2_destroy_text_layout(void* layout)
+{
+#if defined(USE_FREETYPE)
+	struct text_layout* l = (struct text_layout*)layout;
+	if (l == NULL) {
+		return;
+	}
+	free(l->vertices);
+	free(l->items);
+	free(l);
+#endif
 }
 
+int ugles2_text_layout_size(void* layout, int* width, int* height, int* lines)
+{
+#if defined(USE_FREETYPE)
+	struct text_layout* l = (struct text_layout*)layout;
+	if (l == NULL) {
+		return -1;
+	}
+	if (width != NULL) {
+		*width = l->width;
+	}
+	if (height != NULL) {
+		*height = l->height;
+	}
+	if (lines != NULL) {
+		*lines = l->lines;
+	}
+	return 0;
+#else
+	return -1;
 #endif
+}
 
-int ugles2_set_font(struct ugles2_context* context, const char file[])
+int ugles2_draw_text_layout(struct ugles2_context* context, void* layout
+					, GLubyte* pixels, int width, int height
+					, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y)
 {
 #if defined(USE_FREETYPE)
-	if (context->freetype == NULL) {
+	struct text_layout* l = (struct text_layout*)layout;
+	if ((l == NULL) || (context->freetype != l->ft) || (refresh_layout(l, 1) != 0)) {
 		return -1;
 	}
-	struct freetype_context* ft = (struct freetype_context*)context->freetype;
 
-	if (ft->face != NULL) {
-		FT_Done_Face(ft->face);
-		ft->face = NULL;
+	// alpha scales the coverage of each glyph, in a scratch as large as the largest one
+	unsigned char* scaled = NULL;
+	int i;
+	if (alpha != 255) {
+		size_t size = 0;
+		for (i = 0; i < l->count; i++) {
+			size_t glyph_size = (size_t)l->items[i].glyph->width * l->items[i].glyph->rows;
+			if (glyph_size > size) {
+				size = glyph_size;
+			}
+		}
+		scaled = (unsigned char*)malloc((size > 0)? size : 1);
+		if (scaled == NULL) {
+			return -1;
+		}
 	}
 
-	FT_Face face;
-	int res = FT_New_Face(ft->library, file, 0, &face);
-	if (res == 0) {
-		ft->face = face;
-		return 0;
-	} else if (res == FT_Err_Unknown_File_Format) {
-		return -2;
-	} else {
-		return -3;
+	for (i = 0; i < l->count; i++) {
+		struct layout_item* item = &l->items[i];
+		struct glyph* glyph = item->glyph;
+		int pos_x = x + (int)((item->x + 32) >> 6) + glyph->left;
+		int pos_y = y + item->y - glyph->top;
+		const unsigned char* coverage = glyph->bitmap;
+		if (scaled != NULL) {
+			size_t k;
+			size_t n = (size_t)glyph->width * glyph->rows;
+			for (k = 0; k < n; k++) {
+				unsigned v = glyph->bitmap[k] * alpha;
+				scaled[k] = (unsigned char)DIV255(v);
+			}
+			coverage = scaled;
+		}
+		ugles2_blend_coverage(pixels, width, height, pos_x, pos_y
+							, red, green, blue, coverage, glyph->width, glyph->width, glyph->rows, l->ft->blend_flags);
 	}
+	free(scaled);
+
+	return 0;
 #else
 	return -1;
 #endif
 }
 
-int ugles2_set_memory_font(struct ugles2_context* context, void* buf, unsigned size)
+int ugles2_draw_text_layout_atlas(struct ugles2_context* context, void* layout
+					, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y)
 {
 #if defined(USE_FREETYPE)
-	if (context->freetype == NULL) {
+	struct text_layout* l = (struct text_layout*)layout;
+	if ((l == NULL) || (refresh_layout(l, 1) != 0)) {
 		return -1;
 	}
-	struct freetype_context* ft = (struct freetype_context*)context->freetype;
 
-	if (ft->face != NULL) {
-		FT_Done_Face(ft->face);
-		ft->face = NULL;
+	struct glyph_atlas* atlas = &l->ft->atlas;
+	if (bind_glyph_atlas(context, atlas, red, green, blue, alpha, (float)x, (float)y) != 0) {
+		return -1;
 	}
 
-	FT_Face face;
-	int res = FT_New_Memory_Face(ft->library, buf, size, 0, &face);
-	if (res == 0) {
-		ft->face = face;
+	if ((l->atlas_generation != atlas->generation) && (build_layout_quads(atlas, l) != 0)) {
+		// larger than the atlas: stream it glyph by glyph
+		int i;
+		for (i = 0; i < l->count; i++) {
+			struct layout_item* item = &l->items[i];
+			struct glyph* glyph = item->glyph;
+			float pos_x = (float)((int)((item->x + 32) >> 6) + glyph->left);
+			float pos_y = (float)(item->y - glyph->top);
+			if (emit_glyph_quad(atlas, glyph, pos_x, pos_y) != 0) {
+				break;
+			}
+		}
+		flush_glyph_quads(atlas);
 		return 0;
-	} else if (res == FT_Err_Unknown_File_Format) {
-		return -2;
-	} else {
-		return -3;
 	}
+
+	draw_glyph_quads(atlas, l->vertices, l->quads);
+
+	return 0;
 #else
 	return -1;
 #endif
 }
 
-#if defined(USE_FREETYPE)
-static int draw_text(struct ugles2_context* context
-		, GLubyte pixels[], int width, int height
-		, int* draw_width, int* char_count
-		, const char text[], int font_size
-		, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
-		, int x, int y)
+// =============================================================================
+// text settings
+
+int ugles2_set_text_flags(struct ugles2_context* context, int flags)
 {
+#if defined(USE_FREETYPE)
 	if (context->freetype == NULL) {
 		return -1;
 	}
+	((struct freetype_context*)context->freetype)->blend_flags = flags;
+	return 0;
+#else
+	return -1;
+#endif
+}
 
-	struct freetype_context* ft = (struct freetype_context*)context->freetype;
-
-	if (ft->face == NULL) {
-		return -1;
+void ugles2_clear_glyph_cache(struct ugles2_context* context)
+{
+#if defined(USE_FREETYPE)
+	if (context->freetype != NULL) {
+		clear_glyph_cache((struct freetype_context*)context->freetype);
 	}
+#endif
+}
 
-	//FT_Set_Char_Size(ft->face, 0, 16*64, width, height);
-	FT_Set_Pixel_Sizes(ft->face, 0, font_size);
+// =============================================================================
+// sprite batch
+//
+// sprites are queued during the frame, sorted by (layer, program, texture) and
+// written into a streaming vertex buffer used as a ring: each upload goes after
+// the previous one and the buffer is orphaned when it wraps, so the driver never
+// waits for a draw still reading older vertices. runs of sprites sharing program
+// and texture become one glDrawElements over a shared quad index buffer.
+
+#define SPRITE_DEFAULT_QUADS 1024
+#define SPRITE_MAX_QUADS     16384	// unsigned short indices
+#define SPRITE_VERTEX_SIZE   20		// x, y, s, t, rgba
+
+struct queued_sprite {
+	GLuint program;
+	GLuint texture;
+	int layer;
+	int order;		// submission order, keeps the sort stable
+	float x, y, width, height;
+	float s0, t0, s1, t1;
+	GLubyte color[4];
+};
 
-	FT_GlyphSlot slot = ft->face->glyph;
-	const char *s = text;
-	int count = 0;
-	int w = 0;
-	while ((s != NULL) && (strlen(s) > 0)) {
-		FT_ULong charcode = get_charcode(s, &s);
-		if (charcode == 0) {
-			break;
-		}
+struct sprite_program {
+	GLuint program;
+	GLint a_position;
+	GLint a_texture;
+	GLint a_color;
+	GLint u_screen;
+	GLint u_texture;
+};
 
-		int glyph_index = FT_Get_Char_Index(ft->face, charcode);
-		FT_Load_Glyph(ft->face, glyph_index, FT_LOAD_DEFAULT);
-		if (FT_Render_Glyph(ft->face->glyph, FT_RENDER_MODE_NORMAL) != 0) {
-			printf("FT_Render_Glyph() failed. \n");
-			break;
-		}
+struct sprite_batch {
+	struct ugles2_context* context;
+	GLuint program;			// for the next sprites
+	GLuint default_program;
+	struct sprite_program programs[8];	// locations of the programs seen
+	int program_count;
 
-		//print_slot(slot);
+	struct queued_sprite* sprites;
+	int count;
+	int capacity;
 
-		FT_Bitmap* bitmap = &slot->bitmap;
+	GLuint vbuffer;
+	GLuint ibuffer;
+	int ring_quads;
+	int ring_position;		// in quads
+	unsigned char* vertices;
 
-		int pos_x = x + w + slot->bitmap_left;
-		int pos_y = y + (font_size - slot->bitmap_top - 1);
-		if (pixels != NULL) {
-			blend_glyph_bitmap(pixels, pos_x, pos_y, width, height
-							, red, green, blue, bitmap->buffer, bitmap->width, bitmap->pitch, bitmap->rows);
+	int draw_calls;
+};
+
+static struct sprite_program* get_sprite_program(struct sprite_batch* batch, GLuint program)
+{
+	int i;
+	for (i = 0; i < batch->program_count; i++) {
+		if (batch->programs[i].program == program) {
+			return &batch->programs[i];
 		}
+	}
 
-		//x += slot->advance.x >> 6;
-		w += slot->advance.x >> 6;
-		++count;
+	// a small table: the oldest entry makes room for a new program
+	if (batch->program_count == (int)(sizeof(batch->programs) / sizeof(batch->programs[0]))) {
+		memmove(&batch->programs[0], &batch->programs[1], sizeof(batch->programs[0]) * (batch->program_count - 1));
+		batch->program_count--;
 	}
+	struct sprite_program* p = &batch->programs[batch->program_count++];
+	p->program    = program;
+	p->a_position = glGetAttribLocation(program, "a_position");
+	p->a_texture  = glGetAttribLocation(program, "a_texture");
+	p->a_color    = glGetAttribLocation(program, "a_color");
+	p->u_screen   = glGetUniformLocation(program, "u_screen");
+	p->u_texture  = glGetUniformLocation(program, "u_texture");
+	return p;
+}
 
-	if (char_count != NULL) {
-		*char_count = count;
+void* ugles2_create_sprite_batch(struct ugles2_context* context, int quads)
+{
+	const char vshader_src[] =
+		"attribute vec2 a_position;\n"
+		"attribute vec2 a_texture;\n"
+		"attribute vec4 a_color;\n"
+		"varying   vec2 v_texture;\n"
+		"varying   vec4 v_color;\n"
+		"uniform   vec2 u_screen;\n"
+		"\n"
+		"void main(void) {\n"
+		"  v_texture = a_texture;\n"
+		"  v_color = a_color;\n"
+		"  gl_Position = vec4(a_position.x / u_screen.x * 2.0 - 1.0, 1.0 - a_position.y / u_screen.y * 2.0, 0.0, 1.0);\n"
+		"}\n";
+
+	const char fshader_src[] =
+		"precision mediump float;\n"
+		"varying   vec2  v_texture;\n"
+		"varying   vec4  v_color;\n"
+		"uniform   sampler2D u_texture;\n"
+		"void main()\n"
+		"{\n"
+		"  gl_FragColor = texture2D(u_texture, v_texture) * v_color;\n"
+		"}\n";
+
+	if (quads <= 0) {
+		quads = SPRITE_DEFAULT_QUADS;
 	}
-	if (draw_width != NULL) {
-		*draw_width = w;
+	if (quads > SPRITE_MAX_QUADS) {
+		quads = SPRITE_MAX_QUADS;
+	}
+
+	struct sprite_batch* batch = (struct sprite_batch*)malloc(sizeof(struct sprite_batch));
+	if (batch == NULL) {
+		return NULL;
+	}
+	memset(batch, 0, sizeof(*batch));
+	batch->context = context;
+	batch->ring_quads = quads;
+
+	unsigned short* indices = (unsigned short*)malloc(sizeof(unsigned short) * 6 * quads);
+	batch->vertices = (unsigned char*)malloc(SPRITE_VERTEX_SIZE * 4 * quads);
+	batch->default_program = ugles2_compile_program(vshader_src, fshader_src);
+	if ((indices == NULL) || (batch->vertices == NULL) || (batch->default_program == 0)) {
+		free(indices);
+		ugles2_destroy_sprite_batch(batch);
+		return NULL;
+	}
+	batch->program = batch->default_program;
+
+	int i;
+	for (i = 0; i < quads; i++) {
+		indices[i*6  ] = i*4;
+		indices[i*6+1] = i*4+1;
+		indices[i*6+2] = i*4+2;
+		indices[i*6+3] = i*4+2;
+		indices[i*6+4] = i*4+1;
+		indices[i*6+5] = i*4+3;
+	}
+
+	glGenBuffers(1, &batch->ibuffer);
+	glGenBuffers(1, &batch->vbuffer);
+	ugles2_bind_buffer(context, GL_ELEMENT_ARRAY_BUFFER, batch->ibuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned short) * 6 * quads, indices, GL_STATIC_DRAW);
+	ugles2_bind_buffer(context, GL_ARRAY_BUFFER, batch->vbuffer);
+	glBufferData(GL_ARRAY_BUFFER, SPRITE_VERTEX_SIZE * 4 * quads, NULL, GL_STREAM_DRAW);
+	free(indices);
+
+	return batch;
+}
+
+void ugles2_destroy_sprite_batch(void* batch)
+{
+	struct sprite_batch* b = (struct sprite_batch*)batch;
+	if (b == NULL) {
+		return;
+	}
+	if (b->vbuffer != 0) {
+		glDeleteBuffers(1, &b->vbuffer);
+	}
+	if (b->ibuffer != 0) {
+		glDeleteBuffers(1, &b->ibuffer);
+	}
+	// deleting bound buffers unbinds them
+	ugles2_invalidate_state(b->context);
+	if (b->default_program != 0) {
+		ugles2_delete_program(b->default_program);
+	}
+	free(b->vertices);
+	free(b->sprites);
+	free(b);
+}
+
+void ugles2_begin_sprites(void* batch)
+{
+	struct sprite_batch* b = (struct sprite_batch*)batch;
+	b->count = 0;
+	b->draw_calls = 0;
+	b->program = b->default_program;
+}
+
+// program 0 restores the built-in one
+void ugles2_set_sprite_program(void* batch, GLuint program)
+{
+	struct sprite_batch* b = (struct sprite_batch*)batch;
+	b->program = (program != 0)? program : b->default_program;
+}
+
+int ugles2_draw_sprite(void* batch, const struct ugles2_sprite* sprite)
+{
+	struct sprite_batch* b = (struct sprite_batch*)batch;
+	if (b->count == b->capacity) {
+		int capacity = (b->capacity == 0)? b->ring_quads : b->capacity * 2;
+		struct queued_sprite* sprites = (struct queued_sprite*)realloc(b->sprites, sizeof(struct queued_sprite) * capacity);
+		if (sprites == NULL) {
+			return -1;
+		}
+		b->sprites = sprites;
+		b->capacity = capacity;
 	}
 
+	struct queued_sprite* q = &b->sprites[b->count];
+	q->program = b->program;
+	q->texture = sprite->texture;
+	q->layer   = sprite->layer;
+	q->order   = b->count;
+	q->x       = sprite->x;
+	q->y       = sprite->y;
+	q->width   = sprite->width;
+	q->height  = sprite->height;
+	q->s0      = sprite->s0;
+	q->t0      = sprite->t0;
+	q->s1      = sprite->s1;
+	q->t1      = sprite->t1;
+	memcpy(q->color, sprite->color, 4);
+	b->count++;
+
 	return 0;
 }
-#endif
 
-int ugles2_text_size(struct ugles2_context* context, int* width, int* count, const char text[], int font_size)
+static int compare_sprites(const void* a, const void* b)
 {
-#if defined(USE_FREETYPE)
-	return draw_text(context, NULL, 0x7fffffff, 0x7fffffff, width, count, text, font_size, 0, 0, 0, 0, 0, 0);
-#else
-	return -1;
-#endif
+	const struct queued_sprite* p = (const struct queued_sprite*)a;
+	const struct queued_sprite* q = (const struct queued_sprite*)b;
+	if (p->layer != q->layer) {
+		return (p->layer < q->layer)? -1 : 1;
+	}
+	if (p->program != q->program) {
+		return (p->program < q->program)? -1 : 1;
+	}
+	if (p->texture != q->texture) {
+		return (p->texture < q->texture)? -1 : 1;
+	}
+	return p->order - q->order;
 }
 
-int ugles2_draw_text(struct ugles2_context* context
-					, GLubyte* pixels, int width, int height
-					, const char text[], int font_size, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
-					, int x, int y)
+static void write_sprite_vertices(unsigned char* out, const struct queued_sprite* q)
 {
-#if defined(USE_FREETYPE)
-	return draw_text(context, pixels, width, height
-			, NULL, NULL
-			, text, font_size, red, green, blue, alpha
-			, x, y);
-#else
-	return -1;
-#endif
+	float x1 = q->x + q->width;
+	float y1 = q->y + q->height;
+	float v[4][4] = {
+		{ q->x, q->y, q->s0, q->t0 },
+		{ x1  , q->y, q->s1, q->t0 },
+		{ q->x, y1  , q->s0, q->t1 },
+		{ x1  , y1  , q->s1, q->t1 },
+	};
+	int i;
+	for (i = 0; i < 4; i++) {
+		memcpy(out, v[i], sizeof(v[i]));
+		memcpy(out + sizeof(v[i]), q->color, 4);
+		out += SPRITE_VERTEX_SIZE;
+	}
+}
+
+static void draw_sprite_run(struct sprite_batch* b, const struct queued_sprite* q, int ring_quad, int quads)
+{
+	struct ugles2_context* context = b->context;
+	struct sprite_program* p = get_sprite_program(b, q->program);
+
+	ugles2_use_program(context, q->program);
+	glUniform2f(p->u_screen, (float)context->width, (float)context->height);
+	glUniform1i(p->u_texture, 0);
+	ugles2_bind_texture(context, 0, GL_TEXTURE_2D, q->texture);
+
+	// indices start at 0, so the attribute pointers carry the ring offset
+	const char* base = (const char*)0 + (size_t)ring_quad * 4 * SPRITE_VERTEX_SIZE;
+	ugles2_enable_vertex_attrib(context, p->a_position);
+	ugles2_vertex_attrib_pointer(context, p->a_position, 2, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_SIZE, base);
+	if (p->a_texture >= 0) {
+		ugles2_enable_vertex_attrib(context, p->a_texture);
+		ugles2_vertex_attrib_pointer(context, p->a_texture, 2, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_SIZE, base + 8);
+	}
+	if (p->a_color >= 0) {
+		ugles2_enable_vertex_attrib(context, p->a_color);
+		ugles2_vertex_attrib_pointer(context, p->a_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, SPRITE_VERTEX_SIZE, base + 16);
+	}
+
+	glDrawElements(GL_TRIANGLES, quads * 6, GL_UNSIGNED_SHORT, 0);
+	b->draw_calls++;
+}
+
+int ugles2_end_sprites(void* batch)
+{
+	struct sprite_batch* b = (struct sprite_batch*)batch;
+	struct ugles2_context* context = b->context;
+	if (b->count == 0) {
+		return 0;
+	}
+
+	qsort(b->sprites, b->count, sizeof(struct queued_sprite), compare_sprites);
+
+	ugles2_bind_buffer(context, GL_ARRAY_BUFFER, b->vbuffer);
+	ugles2_bind_buffer(context, GL_ELEMENT_ARRAY_BUFFER, b->ibuffer);
+
+	int i = 0;
+	while (i < b->count) {
+		if (b->ring_position == b->ring_quads) {
+			glBufferData(GL_ARRAY_BUFFER, SPRITE_VERTEX_SIZE * 4 * b->ring_quads, NULL, GL_STREAM_DRAW);
+			b->ring_position = 0;
+		}
+
+		// one upload for as many sprites as fit before the ring wraps
+		int n = b->count - i;
+		if (n > b->ring_quads - b->ring_position) {
+			n = b->ring_quads - b->ring_position;
+		}
+		int k;
+		for (k = 0; k < n; k++) {
+			write_sprite_vertices(&b->vertices[k * 4 * SPRITE_VERTEX_SIZE], &b->sprites[i + k]);
+		}
+		glBufferSubData(GL_ARRAY_BUFFER, b->ring_position * 4 * SPRITE_VERTEX_SIZE, n * 4 * SPRITE_VERTEX_SIZE, b->vertices);
+
+		int start = 0;
+		for (k = 1; k <= n; k++) {
+			const struct queued_sprite* q = &b->sprites[i + start];
+			if ((k == n) || (b->sprites[i + k].program != q->program) || (b->sprites[i + k].texture != q->texture)) {
+				draw_sprite_run(b, q, b->ring_position + start, k - start);
+				start = k;
+			}
+		}
+
+		b->ring_position += n;
+		i += n;
+	}
+	b->count = 0;
+
+	return b->draw_calls;
 }
 
 // =============================================================================
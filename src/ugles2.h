@@ -1,6 +1,7 @@
 #ifndef _UGLES2_H_
 #define _UGLES2_H_
 
+#include <stddef.h>
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
 
@@ -32,6 +33,11 @@ struct ugles2_context {
 	int height;
 
 	void* freetype;
+	void* loader;
+	void* capture;
+	void* programs;
+	void* state;
+	void* textures;
 };
 
 typedef int (*ugles2_open_platform)(struct ugles2_platform* platform, void* arg);
@@ -43,7 +49,7 @@ int ugles2_attr_set_color_size(void* attr, int red, int green, int blue);
 int ugles2_attr_set_alpha_size(void* attr, int alpha);
 int ugles2_attr_set_depth_size(void* attr, int depth);
 int ugles2_attr_set_pbuffer_size(void* attr, int width, int height);
-int ugles2_attr_set_es_attr(void* attr, EGLint name, EGLint value);
+int ugles2_attr_set_config_attr(void* attr, EGLint name, EGLint value);
 int ugles2_attr_set_pbuffer_attr(void* attr, EGLint name, EGLint value);
 
 // initialize / finalize
@@ -55,10 +61,110 @@ GLuint ugles2_compile_vertex_shader(const char src[]);
 GLuint ugles2_compile_fragment_shader(const char src[]);
 int    ugles2_link_shaders(GLuint program, GLuint vshader, GLuint fshader);
 GLuint ugles2_compile_program(const char vshader_src[], const char fshader_src[]);
+void   ugles2_delete_program(GLuint program);
+
+// program cache: identical programs are compiled once per context and, with a directory and
+// GL_OES_get_program_binary, reloaded from disk on later runs. cached programs are shared,
+// so release them with ugles2_delete_program() rather than glDeleteProgram().
+struct ugles2_program_cache_stats {
+	int  binary_supported;
+	int  hits;			// found in this process
+	int  disk_hits;		// loaded from a program binary
+	int  misses;		// compiled from source
+	long saved_us;		// compile time avoided by hits
+};
+int ugles2_enable_program_cache(struct ugles2_context* context, const char dir[]);	// dir may be NULL
+int ugles2_program_cache_stats(struct ugles2_context* context, struct ugles2_program_cache_stats* stats);
+
+// batch compile: all compiles and links are issued before any status is queried
+struct ugles2_program_source {
+	const char* vshader_src;
+	const char* fshader_src;
+};
+struct ugles2_program_result {
+	GLuint program;		// 0 on failure
+	int    status;		// 0 or -1
+	char*  log;			// vertex, fragment and link info logs, NULL if all empty
+};
+int  ugles2_compile_programs(const struct ugles2_program_source sources[], struct ugles2_program_result results[], int count);	// returns failures
+void ugles2_release_program_results(struct ugles2_program_result results[], int count);	// frees the logs only
+
+// program reflection: locations by precomputed ugles2_name_hash(), uniform values shadowed
+// so ugles2_set_uniform() skips unchanged ones. the program must be current when setting,
+// and values set with glUniform*() directly need ugles2_invalidate_uniforms(). reflecting
+// fails when two active names of a kind share a hash. keep one reflection per program:
+// each has its own shadow, so setting through one leaves the others stale. with the
+// program cache enabled, reflecting a cached program again returns its reflection.
+unsigned ugles2_name_hash(const char name[]);
+void*  ugles2_reflect_program(GLuint program);
+void   ugles2_destroy_reflection(void* reflection);
+GLuint ugles2_compile_reflected_program(const char vshader_src[], const char fshader_src[], void** reflection);
+GLint  ugles2_uniform_location(void* reflection, unsigned hash);
+GLint  ugles2_attrib_location(void* reflection, unsigned hash);
+int    ugles2_set_uniform(void* reflection, unsigned hash, const void* values, int count);	// 1 sent, 0 skipped, -1 unknown
+void   ugles2_invalidate_uniforms(void* reflection);
 
 // buffer
 GLuint ugles2_gen_buffer(GLenum target, void* p, unsigned size, GLenum usage);
-GLuint ugles2_gen_vertex_buffer(GLenum target, void* p, unsigned size, GLenum usage);
+GLuint ugles2_gen_vertex_buffer(void* layout, const float* vertices, int count, GLenum usage);	// packed with a vertex layout
+
+// vertex layout: interleaved attributes packed from float source vertices, offsets and
+// stride computed as attributes are added. half floats fall back to floats without
+// GL_OES_vertex_half_float or GLES 3, so layouts are created with a current context.
+#define UGLES2_VERTEX_FLOAT       0
+#define UGLES2_VERTEX_HALF        1
+#define UGLES2_VERTEX_SHORT_NORM  2	// [-1, 1]
+#define UGLES2_VERTEX_USHORT_NORM 3	// [0, 1]
+#define UGLES2_VERTEX_BYTE_NORM   4	// [-1, 1]
+#define UGLES2_VERTEX_UBYTE_NORM  5	// [0, 1]
+void*  ugles2_create_vertex_layout();
+void   ugles2_destroy_vertex_layout(void* layout);
+int    ugles2_vertex_layout_add(void* layout, GLint location, int components, int type);	// returns the offset
+int    ugles2_vertex_layout_stride(void* layout);
+void   ugles2_pack_vertices(void* layout, const float* vertices, int count, void* out);
+void   ugles2_apply_vertex_layout(struct ugles2_context* context, void* layout, GLuint buffer);
+
+// image (decoder session: the file is mapped and parsed once; memory images are
+// recognized by their signature and read in place, so buf must outlive the session)
+void*    ugles2_open_image(const char file[]);
+void*    ugles2_open_memory_image(const void* buf, unsigned size);
+int      ugles2_image_size(void* image, int* width, int* height);
+GLubyte* ugles2_decode_image(void* image, GLubyte* pixels);	// pixels == NULL: decode into a buffer owned by image
+void     ugles2_close_image(void* image);
+
+// state cache: wrappers skip calls that would not change the context's GL state.
+// GL calls made around them (including ugles2_gen_buffer() and the texture loaders,
+// which bind what they create) need ugles2_invalidate_state() afterwards.
+void ugles2_use_program(struct ugles2_context* context, GLuint program);
+void ugles2_bind_buffer(struct ugles2_context* context, GLenum target, GLuint buffer);
+void ugles2_bind_texture(struct ugles2_context* context, int unit, GLenum target, GLuint texture);
+void ugles2_enable(struct ugles2_context* context, GLenum cap);
+void ugles2_disable(struct ugles2_context* context, GLenum cap);
+void ugles2_blend_func(struct ugles2_context* context, GLenum src, GLenum dst);
+void ugles2_viewport(struct ugles2_context* context, GLint x, GLint y, GLsizei width, GLsizei height);
+void ugles2_enable_vertex_attrib(struct ugles2_context* context, GLuint index);
+void ugles2_disable_vertex_attrib(struct ugles2_context* context, GLuint index);
+void ugles2_vertex_attrib_pointer(struct ugles2_context* context, GLuint index, GLint size, GLenum type
+					, GLboolean normalized, GLsizei stride, const void* pointer);
+void ugles2_invalidate_state(struct ugles2_context* context);
+int  ugles2_state_stats(struct ugles2_context* context, unsigned long* issued, unsigned long* filtered);
+
+// pixel conversion into RGBA rows, by SSSE3 (when the CPU has it) or NEON kernels.
+// UGLES2_CONVERT_FLIP stores the first source row last, bottom-up like the loaders' pixels.
+#define UGLES2_PIXELS_RGB			0
+#define UGLES2_PIXELS_BGR			1
+#define UGLES2_PIXELS_RGBA			2
+#define UGLES2_PIXELS_BGRA			3
+#define UGLES2_PIXELS_ARGB			4
+#define UGLES2_PIXELS_ABGR			5
+#define UGLES2_PIXELS_GRAY			6
+#define UGLES2_PIXELS_GRAY_ALPHA	7
+#define UGLES2_CONVERT_PREMULTIPLY	0x01
+#define UGLES2_CONVERT_FLIP			0x02
+#define UGLES2_CONVERT_SCALAR		0x04	// bypass the SSSE3/NEON kernels
+int ugles2_convert_pixels(GLubyte* dst, const void* src, int src_stride, int width, int height
+					, int layout, int flags);	// src_stride 0 if packed
+const char* ugles2_convert_kernel(void);
 
 // texture
 int ugles2_load_size(int* width, int* height, const char file[]);
@@ -67,16 +173,251 @@ GLuint ugles2_load_texture(const char file[]);
 GLuint ugles2_load_memory_texture(const void* buf, unsigned size);
 GLuint ugles2_create_texture(const GLubyte* pixels, int width, int height);
 
+// texture options. without full NPOT support (GLES 3 or GL_OES_texture_npot), NPOT textures
+// that repeat or are mipmapped get the npot treatment; info returns the size created, so
+// padded images use s, t up to width / info.width, height / info.height.
+#define UGLES2_MIPMAP_NONE	0
+#define UGLES2_MIPMAP_GL	1	// glGenerateMipmap()
+#define UGLES2_MIPMAP_BOX	2	// 2x2 box filter on the CPU
+#define UGLES2_MIPMAP_GAMMA	3	// box filter in linear light, for sRGB images
+#define UGLES2_NPOT_KEEP	0	// upload as is
+#define UGLES2_NPOT_CLAMP	1	// drop mipmaps and repeat
+#define UGLES2_NPOT_PAD		2	// next power of two, edges repeated into the padding
+#define UGLES2_NPOT_RESIZE	3	// resampled to the next power of two
+#define UGLES2_FORMAT_RGBA				0
+#define UGLES2_FORMAT_RGB565			1	// GL_RGB, GL_UNSIGNED_SHORT_5_6_5
+#define UGLES2_FORMAT_RGBA4444			2	// GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4
+#define UGLES2_FORMAT_LUMINANCE_ALPHA	3	// luma of RGB and alpha
+#define UGLES2_FORMAT_LUMINANCE			4
+#define UGLES2_FORMAT_ALPHA				5
+#define UGLES2_FORMAT_AUTO				6	// smallest lossless gray format, RGB565 if opaque, else RGBA
+struct ugles2_texture_options {
+	GLenum min_filter;	// a mipmap filter is chosen when mipmaps are asked for without one
+	GLenum mag_filter;
+	GLenum wrap_s;
+	GLenum wrap_t;
+	int mipmap;			// UGLES2_MIPMAP_*
+	int npot;			// UGLES2_NPOT_*
+	int format;			// UGLES2_FORMAT_*
+	int dither;			// ordered dithering into RGB565 / RGBA4444
+};
+struct ugles2_texture_info {
+	int width;
+	int height;
+	GLenum format;
+	GLenum type;
+	unsigned long bytes;	// uploaded, all levels built on the CPU included
+};
+void   ugles2_init_texture_options(struct ugles2_texture_options* options);	// GL_NEAREST, GL_REPEAT, RGBA, no mipmaps
+GLuint ugles2_create_texture_with_options(const GLubyte* pixels, int width, int height
+					, const struct ugles2_texture_options* options, struct ugles2_texture_info* info);
+GLuint ugles2_load_texture_with_options(const char file[], const struct ugles2_texture_options* options
+					, struct ugles2_texture_info* info);
+
+// etc1: .pkm and .ktx files load with glCompressedTexImage2D (stored mip levels included)
+// when GL_OES_compressed_ETC1_RGB8_texture is there, and are decoded to RGBA otherwise.
+// rows are stored in the order they are uploaded, like the decoded RGBA images.
+size_t ugles2_etc1_size(int width, int height);	// 0 when a size is not positive or the bytes overflow
+void ugles2_encode_etc1(const GLubyte* pixels, int width, int height, void* data);
+void ugles2_decode_etc1(const void* data, int width, int height, GLubyte* pixels);
+int  ugles2_write_pkm(const char file[], const GLubyte* pixels, int width, int height);
+int  ugles2_write_ktx(const char file[], const GLubyte* pixels, int width, int height, int mipmap);	// UGLES2_MIPMAP_NONE, _BOX or _GAMMA
+
+// texture atlas: images packed into shared RGBA pages (skyline packing). regions carry the
+// page texture and its texture coordinates; like the loaders, adding binds page textures.
+struct ugles2_atlas_region {
+	GLuint texture;
+	int    page;
+	int    x, y, width, height;	// in pixels
+	float  s0, t0, s1, t1;
+};
+void*  ugles2_create_texture_atlas(int width, int height, int padding);	// page size, 0 for the default
+void   ugles2_destroy_texture_atlas(void* atlas);
+int    ugles2_atlas_add_pixels(void* atlas, const GLubyte* pixels, int width, int height, struct ugles2_atlas_region* region);
+int    ugles2_atlas_add_image(void* atlas, const char file[], struct ugles2_atlas_region* region);
+int    ugles2_atlas_add_images(void* atlas, const char* files[], int count, struct ugles2_atlas_region regions[]);	// returns failures
+int    ugles2_atlas_pages(void* atlas);
+GLuint ugles2_atlas_page_texture(void* atlas, int page);
+
+// asset pack: many assets in one file, mapped once and looked up by name through a hash
+// index. entries hold the original file, or its pixels decoded (and converted to a
+// UGLES2_FORMAT_*) when packed. asset data stays valid until the pack is closed, so
+// fonts can use it with ugles2_set_memory_font().
+#define UGLES2_ASSET_FILE	0
+#define UGLES2_ASSET_PIXELS	1
+struct ugles2_asset {
+	const void* data;
+	unsigned size;
+	int type;				// UGLES2_ASSET_*
+	int width, height;		// pixels only
+	int format;				// pixels only, UGLES2_FORMAT_*
+};
+struct ugles2_pack_entry {
+	const char* name;
+	const char* file;
+	int pixels;				// store decoded pixels instead of the file
+	int format;				// UGLES2_FORMAT_*, AUTO included
+	int dither;
+};
+void*  ugles2_open_pack(const char file[]);
+void   ugles2_close_pack(void* pack);
+int    ugles2_pack_entries(void* pack);
+int    ugles2_pack_find(void* pack, const char name[], struct ugles2_asset* asset);	// entry index or -1
+GLuint ugles2_load_pack_texture(void* pack, const char name[]
+					, const struct ugles2_texture_options* options, struct ugles2_texture_info* info);
+int    ugles2_write_pack(const char file[], const struct ugles2_pack_entry entries[], int count);
+
+// texture cache: with it enabled, ugles2_load_texture*(), ugles2_load_memory_texture() and
+// ugles2_load_pack_texture() in the current context return the texture already loaded from
+// the same file (or the same bytes) with the same options. cached textures are shared, so
+// release them with ugles2_delete_texture() rather than glDeleteTextures(). released ones
+// stay loaded until the budget needs their memory, least recently used first.
+struct ugles2_texture_cache_stats {
+	int  textures;				// loaded, unused included
+	int  unused;				// released by every user, evicted first
+	unsigned long bytes;		// on the GPU, estimated
+	unsigned long budget;		// 0: none
+	int  hits;
+	int  misses;
+	int  evictions;
+};
+int  ugles2_enable_texture_cache(struct ugles2_context* context, unsigned long budget);	// budget in bytes, 0 for none
+int  ugles2_set_texture_budget(struct ugles2_context* context, unsigned long budget);
+int  ugles2_texture_cache_stats(struct ugles2_context* context, struct ugles2_texture_cache_stats* stats);
+void ugles2_delete_texture(GLuint texture);
+
+// streaming texture: contents replaced while drawing. updates copy rectangles into a CPU
+// shadow, ugles2_commit_stream() uploads what changed into the next of up to 3 buffers
+// (so no draw still reading one is waited for) and returns the texture to draw. YUV
+// frames stay YUV: planes are luminance (NV12 chroma luminance alpha) textures, the
+// committed chroma planes are bound to units 1 and 2, and ugles2_yuv_program() converts
+// (BT.601 video range) with the sprite batch's attributes and uniforms. plane rows are
+// uploaded in order, row 0 at t = 0, and commits bind textures like ugles2_bind_texture().
+#define UGLES2_STREAM_RGBA	0
+#define UGLES2_STREAM_I420	1		// Y, U, V planes, chroma at half width and height
+#define UGLES2_STREAM_NV12	2		// Y plane, interleaved UV plane at half width and height
+void*  ugles2_create_stream(struct ugles2_context* context, int width, int height, int format, int buffers);	// buffers 0 for 2
+void   ugles2_destroy_stream(void* stream);
+int    ugles2_update_stream(void* stream, const GLubyte* const planes[], const int strides[]
+					, int x, int y, int width, int height);	// planes of the whole frame, strides NULL if packed
+GLuint ugles2_commit_stream(void* stream);
+GLuint ugles2_stream_texture(void* stream, int plane);
+GLuint ugles2_yuv_program(struct ugles2_context* context, int format);
+
+// async texture (decoded by worker threads, uploaded by ugles2_pump_uploads() on the GL thread)
+int    ugles2_start_loader(struct ugles2_context* context, int threads);
+GLuint ugles2_load_texture_async(struct ugles2_context* context, const char file[]);
+int    ugles2_pump_uploads(struct ugles2_context* context, int budget_us);
+int    ugles2_loader_pending(struct ugles2_context* context);
+
 // dump
-int ugles2_dump_png(struct ugles2_context* context, const char filename[]);
+#define UGLES2_DUMP_PNG	0
+#define UGLES2_DUMP_RAW	1	// RGBA rows, no header
+#define UGLES2_DUMP_PPM	2	// binary P6, alpha dropped
+#define UGLES2_DUMP_FILTER_NONE		0x01
+#define UGLES2_DUMP_FILTER_SUB		0x02
+#define UGLES2_DUMP_FILTER_UP		0x04
+#define UGLES2_DUMP_FILTER_AVG		0x08
+#define UGLES2_DUMP_FILTER_PAETH	0x10
+struct ugles2_dump_options {
+	int format;		// UGLES2_DUMP_*
+	int level;		// zlib level 0-9, -1 for the libpng default
+	int filters;	// UGLES2_DUMP_FILTER_* set, 0 for the libpng default
+	int strategy;	// zlib strategy (Z_FILTERED, Z_RLE, ...), -1 for the libpng default
+	int bottom_up;	// keep the GL row order instead of writing the image upright
+};
+void ugles2_init_dump_options(struct ugles2_dump_options* options);
+int  ugles2_dump(struct ugles2_context* context, const char filename[], const struct ugles2_dump_options* options);
+int  ugles2_dump_png(struct ugles2_context* context, const char filename[]);
+
+// async capture (read back on the GL thread into pooled buffers, encoded by a background thread)
+#define UGLES2_CAPTURE_BLOCK		0	// wait for the encoder when every buffer is in use
+#define UGLES2_CAPTURE_DROP_OLDEST	1	// recycle the oldest frame not yet encoded
+int  ugles2_start_capture(struct ugles2_context* context, int buffers, int policy);
+void ugles2_stop_capture(struct ugles2_context* context);	// writes queued frames first
+int  ugles2_capture(struct ugles2_context* context, const char filename[], const struct ugles2_dump_options* options);
+int  ugles2_capture_png(struct ugles2_context* context, const char filename[]);
+int  ugles2_capture_flush(struct ugles2_context* context);
+int  ugles2_capture_stats(struct ugles2_context* context, int* written, int* dropped, int* failed);
+
+// frame recorder (one streaming file per sequence, frames go through the capture thread)
+#define UGLES2_RECORD_KEY	0
+#define UGLES2_RECORD_DELTA	1	// flag: store changed spans against the previous frame
+void* ugles2_begin_recording(struct ugles2_context* context, const char filename[], int flags);
+int   ugles2_record_frame(struct ugles2_context* context, void* recorder);
+int   ugles2_end_recording(struct ugles2_context* context, void* recorder);	// returns the number of frames
 
 // text
 int ugles2_set_font(struct ugles2_context* context, const char file[]);
 int ugles2_set_memory_font(struct ugles2_context* context, void* buf, unsigned size);
+struct ugles2_text_metrics {
+	int width;			// sum of advances and kerning
+	int count;			// characters
+	int ascent;			// glyph extent above the baseline
+	int descent;		// glyph extent below the baseline
+	int line_ascender;	// face metrics at this size
+	int line_descender;
+	int line_height;
+};
+
+// (x, y) is the top-left of the line; the baseline sits at y + line_ascender
 int ugles2_text_size(struct ugles2_context* context, int* width, int* count, const char text[], int font_size);
+// measurement never rasterizes; advances[] receives up to max_advances per-character advances
+int ugles2_text_metrics(struct ugles2_context* context, struct ugles2_text_metrics* metrics
+					, int advances[], int max_advances, const char text[], int font_size);
+// returns the number of bytes of text that fit in max_width pixels
+int ugles2_text_fit(struct ugles2_context* context, int* width, const char text[], int font_size, int max_width);
 int ugles2_draw_text(struct ugles2_context* context, GLubyte* pixels, int width, int height
 					, const char text[], int font_size, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
 					, int x, int y);
+// draws into the current framebuffer from a cached glyph atlas (pixel coordinates, origin top-left).
+// changes the current program, buffer bindings and the texture bound to unit 0.
+int ugles2_draw_text_atlas(struct ugles2_context* context
+					, const char text[], int font_size, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y);
+
+// text layout (line breaking and alignment computed once, drawn many times)
+#define UGLES2_ALIGN_LEFT	0
+#define UGLES2_ALIGN_CENTER	1
+#define UGLES2_ALIGN_RIGHT	2
+void* ugles2_create_text_layout(struct ugles2_context* context, const char text[], int font_size, int box_width, int align);
+void  ugles2_destroy_text_layout(void* layout);
+int   ugles2_text_layout_size(void* layout, int* width, int* height, int* lines);
+int   ugles2_draw_text_layout(struct ugles2_context* context, void* layout
+					, GLubyte* pixels, int width, int height
+					, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y);
+int   ugles2_draw_text_layout_atlas(struct ugles2_context* context, void* layout
+					, GLubyte red, GLubyte green, GLubyte blue, GLubyte alpha
+					, int x, int y);
+
+int  ugles2_set_text_flags(struct ugles2_context* context, int flags);	// UGLES2_BLEND_* for ugles2_draw_text
+void ugles2_clear_glyph_cache(struct ugles2_context* context);
+
+// blend (coverage bitmap over RGBA pixels laid out as in ugles2_draw_text)
+#define UGLES2_BLEND_PREMULTIPLIED	0x01	// pixels hold premultiplied alpha
+#define UGLES2_BLEND_SCALAR			0x02	// bypass the SSE2/NEON kernel (premultiplied only, straight is always scalar)
+void ugles2_blend_coverage(GLubyte pixels[], int width, int height, int x, int y
+					, GLubyte red, GLubyte green, GLubyte blue
+					, const unsigned char coverage[], int coverage_width, int coverage_pitch, int coverage_height, int flags);
+const char* ugles2_blend_kernel(void);
+
+// sprite batch: quads in pixel coordinates (origin top-left), sorted by layer then
+// texture and drawn from a streaming vertex ring in as few draw calls as possible.
+// custom programs take a_position, a_texture, a_color, u_screen and u_texture.
+struct ugles2_sprite {
+	GLuint texture;
+	int    layer;			// lower layers are drawn first
+	float  x, y, width, height;
+	float  s0, t0, s1, t1;
+	GLubyte color[4];		// multiplied with the texture
+};
+void* ugles2_create_sprite_batch(struct ugles2_context* context, int quads);	// quads per ring, 0 for the default
+void  ugles2_destroy_sprite_batch(void* batch);
+void  ugles2_begin_sprites(void* batch);
+void  ugles2_set_sprite_program(void* batch, GLuint program);	// for the sprites that follow, 0 for the default
+int   ugles2_draw_sprite(void* batch, const struct ugles2_sprite* sprite);
+int   ugles2_end_sprites(void* batch);	// returns the number of draw calls
 
 // matrix
 void ugles2_matrix_unit(float m[]);